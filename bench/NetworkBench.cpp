@@ -0,0 +1,1065 @@
+//
+//  NetworkBench.cpp
+//  Cinder_Network
+//
+//  A headless benchmark of the Network library over loopback. It needs no
+//  Cinder and builds on Linux and OS X with just boost:
+//
+//    g++ -std=c++11 -O2 -DNDEBUG -DBOOST_BIND_GLOBAL_PLACEHOLDERS -I../xcode
+//        -o NetworkBench NetworkBench.cpp ../xcode/Network.cpp
+//        -lboost_system -lpthread
+//
+//  Linux before glibc 2.34 also needs -lrt for the shared memory transport.
+//
+//  Usage: NetworkBench [--quick]
+//                      [--only latency|latency_shm|throughput|churn|scaling|timers|coroutines]
+//                      [--threads n] [--out file.json] [--trace file.json]
+//
+//  Results are written as JSON to stdout, or to the --out file, so runs
+//  before and after a change can be compared. Progress goes to stderr.
+//  --trace records the run with the Tracer and writes the last events of
+//  each thread as a Chrome trace, which also shows what tracing costs.
+//  Add -DNETWORK_SINGLE_THREADED=1 to measure the library without strands;
+//  run mode then uses a single thread. Built with -std=c++20, the
+//  coroutines scenario measures the awaitable functions. latency_shm
+//  repeats the latency scenario over the shared memory transport.
+//
+
+#include "Network.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+#include <string>
+#include <vector>
+
+//-----------------------------------------------------------------------------
+
+namespace
+{
+	struct BenchOptions
+	{
+		bool            quick;
+		std::string     only;
+		std::string     out;
+		std::string     trace;
+		uint32_t        maxThreads;
+	};
+
+	uint64_t now()
+	{
+		return Metrics::now();
+	}
+
+	double toSeconds( uint64_t nanos )
+	{
+		return static_cast< double >( nanos ) / 1000000000.0;
+	}
+
+	double toMicros( uint64_t nanos )
+	{
+		return static_cast< double >( nanos ) / 1000.0;
+	}
+
+	// Waits until value reaches target or the timeout expires. Returns false
+	// on timeout.
+	bool waitFor( const std::atomic< uint64_t > & value, uint64_t target, uint32_t timeoutMilli )
+	{
+		uint64_t deadline = now() + static_cast< uint64_t >( timeoutMilli ) * 1000000;
+		while( value.load( std::memory_order_acquire ) < target )
+		{
+			if( now() > deadline )
+			{
+				return false;
+			}
+			std::this_thread::sleep_for( std::chrono::microseconds( 200 ) );
+		}
+		return true;
+	}
+
+	uint64_t getPercentile( const std::vector< uint64_t > & sorted, double fraction )
+	{
+		if( sorted.empty() )
+		{
+			return 0;
+		}
+		size_t index = static_cast< size_t >( fraction * static_cast< double >( sorted.size() - 1 ) + 0.5 );
+		return sorted[ std::min( index, sorted.size() - 1 ) ];
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+// Runs a Hive for the duration of a scenario. In run mode a single
+// io_service is shared by threadCount threads calling Run, in worker mode
+// the Hive owns threadCount workers. Single threaded builds run the shared
+// io_service on one thread only.
+class BenchHive
+{
+private:
+	boost::shared_ptr< Hive >   mHive;
+	std::vector< std::thread >  mThreads;
+
+public:
+	BenchHive( uint32_t threadCount, bool workers )
+	{
+		if( workers )
+		{
+			mHive.reset( new Hive( threadCount ) );
+		}
+		else
+		{
+			mHive.reset( new Hive() );
+			boost::shared_ptr< Hive > hive = mHive;
+			if( NETWORK_SINGLE_THREADED )
+			{
+				threadCount = 1;
+			}
+			for( uint32_t i = 0; i < threadCount; ++i )
+			{
+				mThreads.push_back( std::thread( [ hive ]() { hive->run(); } ) );
+			}
+		}
+	}
+
+	~BenchHive()
+	{
+		stop();
+	}
+
+	boost::shared_ptr< Hive > getHive()
+	{
+		return mHive;
+	}
+
+	void stop()
+	{
+		if( !mHive->hasStopped() )
+		{
+			mHive->stop();
+		}
+		for( size_t i = 0; i < mThreads.size(); ++i )
+		{
+			mThreads[ i ].join();
+		}
+		mThreads.clear();
+	}
+};
+
+//-----------------------------------------------------------------------------
+
+// Writes every buffer it receives back to the peer.
+class EchoConnection : public Connection
+{
+private:
+	void onAccept( const std::string &, uint16_t )
+	{
+		recv();
+	}
+
+	void onConnect( const std::string &, uint16_t )
+	{
+	}
+
+	void onSend( const std::vector< uint8_t > & )
+	{
+	}
+
+	void onRecv( std::vector< uint8_t > & buffer )
+	{
+		send( buffer );
+		recv();
+	}
+
+	void onTimer( const boost::posix_time::time_duration & )
+	{
+	}
+
+	void onError( const boost::system::error_code & )
+	{
+	}
+
+public:
+	EchoConnection( boost::shared_ptr< Hive > hive )
+	: Connection( hive )
+	{
+		setReceiveBufferSize( 65536 );
+	}
+};
+
+//-----------------------------------------------------------------------------
+
+// Counts the bytes it receives and discards them.
+class SinkConnection : public Connection
+{
+private:
+	std::atomic< uint64_t > &   mBytes;
+
+private:
+	void onAccept( const std::string &, uint16_t )
+	{
+		recv();
+	}
+
+	void onConnect( const std::string &, uint16_t )
+	{
+	}
+
+	void onSend( const std::vector< uint8_t > & )
+	{
+	}
+
+	void onRecv( std::vector< uint8_t > & buffer )
+	{
+		mBytes.fetch_add( buffer.size(), std::memory_order_release );
+		recv();
+	}
+
+	void onTimer( const boost::posix_time::time_duration & )
+	{
+	}
+
+	void onError( const boost::system::error_code & )
+	{
+	}
+
+public:
+	SinkConnection( boost::shared_ptr< Hive > hive, std::atomic< uint64_t > & bytes )
+	: Connection( hive ), mBytes( bytes )
+	{
+		setReceiveBufferSize( 65536 );
+	}
+};
+
+//-----------------------------------------------------------------------------
+
+// Accepts connections made by NewConnection until stopped, keeping count.
+template< typename NewConnection >
+class BenchAcceptor : public Acceptor
+{
+private:
+	NewConnection               mNewConnection;
+	std::atomic< uint64_t >     mAccepts;
+
+private:
+	bool onAccept( boost::shared_ptr< Connection >, const std::string &, uint16_t )
+	{
+		mAccepts.fetch_add( 1, std::memory_order_release );
+		accept( mNewConnection() );
+		return true;
+	}
+
+	void onTimer( const boost::posix_time::time_duration & )
+	{
+	}
+
+	void onError( const boost::system::error_code & )
+	{
+	}
+
+public:
+	BenchAcceptor( boost::shared_ptr< Hive > hive, const NewConnection & newConnection )
+	: Acceptor( hive ), mNewConnection( newConnection ), mAccepts( 0 )
+	{
+	}
+
+	// Listens on an ephemeral loopback port, or on port 0 of a shared
+	// memory host, and returns the port.
+	uint16_t start( size_t backlog = 1, const std::string & host = "127.0.0.1" )
+	{
+		listen( host, 0 );
+		for( size_t i = 0; i < backlog; ++i )
+		{
+			accept( mNewConnection() );
+		}
+		return getPort();
+	}
+
+	const std::atomic< uint64_t > & getAccepts() const
+	{
+		return mAccepts;
+	}
+};
+
+template< typename NewConnection >
+boost::shared_ptr< BenchAcceptor< NewConnection > > makeAcceptor( boost::shared_ptr< Hive > hive, const NewConnection & newConnection )
+{
+	return boost::shared_ptr< BenchAcceptor< NewConnection > >( new BenchAcceptor< NewConnection >( hive, newConnection ) );
+}
+
+//-----------------------------------------------------------------------------
+
+// Sends a message, waits for the echo and repeats until told to stop,
+// optionally recording every round trip time.
+class PingConnection : public Connection
+{
+private:
+	SharedBuffer                mPayload;
+	std::vector< uint64_t > *   mSamples;
+	std::atomic< bool > &       mRunning;
+	std::atomic< uint64_t >     mRoundTrips;
+	uint64_t                    mLimit;
+	uint64_t                    mWarmup;
+	uint64_t                    mStart;
+	std::atomic< uint64_t > &   mDone;
+
+private:
+	void ping()
+	{
+		mStart = now();
+		send( mPayload );
+		recv( static_cast< int32_t >( mPayload->size() ) );
+	}
+
+	void onAccept( const std::string &, uint16_t )
+	{
+	}
+
+	void onConnect( const std::string &, uint16_t )
+	{
+		setSocketNoDelay();
+		ping();
+	}
+
+	void onSend( const std::vector< uint8_t > & )
+	{
+	}
+
+	void onRecv( std::vector< uint8_t > & )
+	{
+		uint64_t elapsed = now() - mStart;
+		uint64_t roundTrips = mRoundTrips.load( std::memory_order_relaxed ) + 1;
+		mRoundTrips.store( roundTrips, std::memory_order_relaxed );
+		if( mSamples && roundTrips > mWarmup )
+		{
+			mSamples->push_back( elapsed );
+		}
+		if( mRunning.load( std::memory_order_relaxed ) && ( mLimit == 0 || roundTrips < mLimit ) )
+		{
+			ping();
+		}
+		else
+		{
+			mDone.fetch_add( 1, std::memory_order_release );
+		}
+	}
+
+	void onTimer( const boost::posix_time::time_duration & )
+	{
+	}
+
+	void onError( const boost::system::error_code & )
+	{
+	}
+
+	void setSocketNoDelay()
+	{
+		boost::system::error_code ec;
+		getSocket().set_option( boost::asio::ip::tcp::no_delay( true ), ec );
+	}
+
+public:
+	PingConnection( boost::shared_ptr< Hive > hive, size_t messageBytes, std::atomic< bool > & running, std::atomic< uint64_t > & done, uint64_t limit = 0, uint64_t warmup = 0, std::vector< uint64_t > * samples = 0 )
+	: Connection( hive ), mPayload( new std::vector< uint8_t >( messageBytes, 0x5a ) ), mSamples( samples ), mRunning( running ), mRoundTrips( 0 ), mLimit( limit ), mWarmup( warmup ), mStart( 0 ), mDone( done )
+	{
+	}
+
+	uint64_t getRoundTrips() const
+	{
+		return mRoundTrips.load( std::memory_order_relaxed );
+	}
+};
+
+//-----------------------------------------------------------------------------
+
+// Streams messageCount messages, keeping at most window of them queued.
+class StreamConnection : public Connection
+{
+private:
+	SharedBuffer    mPayload;
+	uint64_t        mMessageCount;
+	uint64_t        mQueued;
+	size_t          mWindow;
+
+private:
+	void onAccept( const std::string &, uint16_t )
+	{
+	}
+
+	void onConnect( const std::string &, uint16_t )
+	{
+		for( size_t i = 0; i < mWindow && mQueued < mMessageCount; ++i, ++mQueued )
+		{
+			send( mPayload );
+		}
+	}
+
+	void onSend( const std::vector< uint8_t > & )
+	{
+		if( mQueued < mMessageCount )
+		{
+			++mQueued;
+			send( mPayload );
+		}
+	}
+
+	void onSendBatch( size_t bufferCount, uint64_t )
+	{
+		for( size_t i = 0; i < bufferCount && mQueued < mMessageCount; ++i, ++mQueued )
+		{
+			send( mPayload );
+		}
+	}
+
+	void onRecv( std::vector< uint8_t > & )
+	{
+	}
+
+	void onTimer( const boost::posix_time::time_duration & )
+	{
+	}
+
+	void onError( const boost::system::error_code & )
+	{
+	}
+
+public:
+	StreamConnection( boost::shared_ptr< Hive > hive, size_t messageBytes, uint64_t messageCount, size_t window, bool coalescing )
+	: Connection( hive ), mPayload( new std::vector< uint8_t >( messageBytes, 0x5a ) ), mMessageCount( messageCount ), mQueued( 0 ), mWindow( window )
+	{
+		setSendCoalescing( coalescing );
+		setSendNotifyPerBatch( coalescing );
+	}
+};
+
+//-----------------------------------------------------------------------------
+
+// Connects and immediately disconnects, then starts the next connection
+// until count connections have been made.
+class ChurnDriver : public boost::enable_shared_from_this< ChurnDriver >
+{
+private:
+	class ChurnConnection : public Connection
+	{
+	private:
+		boost::shared_ptr< ChurnDriver >    mDriver;
+		bool                                mConnected;
+
+	private:
+		void onAccept( const std::string &, uint16_t )
+		{
+		}
+
+		void onConnect( const std::string &, uint16_t )
+		{
+			mConnected = true;
+			disconnect();
+			mDriver->next();
+		}
+
+		void onSend( const std::vector< uint8_t > & )
+		{
+		}
+
+		void onRecv( std::vector< uint8_t > & )
+		{
+		}
+
+		void onTimer( const boost::posix_time::time_duration & )
+		{
+		}
+
+		void onError( const boost::system::error_code & )
+		{
+			if( !mConnected )
+			{
+				mDriver->fail();
+			}
+		}
+
+	public:
+		ChurnConnection( boost::shared_ptr< Hive > hive, boost::shared_ptr< ChurnDriver > driver )
+		: Connection( hive ), mDriver( driver ), mConnected( false )
+		{
+		}
+	};
+
+	boost::shared_ptr< Hive >   mHive;
+	uint16_t                    mPort;
+	uint64_t                    mCount;
+	std::atomic< uint64_t >     mStarted;
+	std::atomic< uint64_t >     mFailures;
+
+public:
+	ChurnDriver( boost::shared_ptr< Hive > hive, uint16_t port, uint64_t count )
+	: mHive( hive ), mPort( port ), mCount( count ), mStarted( 0 ), mFailures( 0 )
+	{
+	}
+
+	void next()
+	{
+		if( mStarted.fetch_add( 1, std::memory_order_relaxed ) < mCount )
+		{
+			boost::shared_ptr< ChurnConnection > connection( new ChurnConnection( mHive, shared_from_this() ) );
+			connection->connect( "127.0.0.1", mPort );
+		}
+	}
+
+	void fail()
+	{
+		mFailures.fetch_add( 1, std::memory_order_relaxed );
+		next();
+	}
+
+	uint64_t getFailures() const
+	{
+		return mFailures.load( std::memory_order_relaxed );
+	}
+};
+
+//-----------------------------------------------------------------------------
+
+struct NewEcho
+{
+	boost::shared_ptr< Hive > hive;
+	boost::shared_ptr< Connection > operator()() const
+	{
+		return boost::shared_ptr< Connection >( new EchoConnection( hive ) );
+	}
+};
+
+struct NewSink
+{
+	boost::shared_ptr< Hive > hive;
+	std::atomic< uint64_t > * bytes;
+	boost::shared_ptr< Connection > operator()() const
+	{
+		return boost::shared_ptr< Connection >( new SinkConnection( hive, *bytes ) );
+	}
+};
+
+//-----------------------------------------------------------------------------
+
+// Measures echo round trip latency of a single connection to host.
+std::string runLatency( const BenchOptions & options, const std::string & host )
+{
+	const size_t messageBytes = 64;
+	const uint64_t warmup = options.quick ? 500 : 2000;
+	const uint64_t roundTrips = options.quick ? 5000 : 50000;
+
+	BenchHive bench( 1, false );
+	NewEcho newEcho = { bench.getHive() };
+	boost::shared_ptr< BenchAcceptor< NewEcho > > acceptor = makeAcceptor( bench.getHive(), newEcho );
+	uint16_t port = acceptor->start( 1, host );
+
+	std::vector< uint64_t > samples;
+	samples.reserve( static_cast< size_t >( roundTrips ) );
+	std::atomic< bool > running( true );
+	std::atomic< uint64_t > done( 0 );
+	boost::shared_ptr< PingConnection > client( new PingConnection( bench.getHive(), messageBytes, running, done, warmup + roundTrips, warmup, &samples ) );
+	client->connect( host, port );
+	bool completed = waitFor( done, 1, 120000 );
+	client->disconnect();
+	acceptor->stop();
+	bench.stop();
+
+	std::sort( samples.begin(), samples.end() );
+	uint64_t total = 0;
+	for( size_t i = 0; i < samples.size(); ++i )
+	{
+		total += samples[ i ];
+	}
+	std::ostringstream json;
+	json << "{ \"message_bytes\": " << messageBytes
+	<< ", \"round_trips\": " << samples.size()
+	<< ", \"completed\": " << ( completed ? "true" : "false" )
+	<< ", \"mean_us\": " << ( samples.empty() ? 0.0 : toMicros( total / samples.size() ) )
+	<< ", \"p50_us\": " << toMicros( getPercentile( samples, 0.5 ) )
+	<< ", \"p99_us\": " << toMicros( getPercentile( samples, 0.99 ) )
+	<< ", \"p999_us\": " << toMicros( getPercentile( samples, 0.999 ) )
+	<< ", \"max_us\": " << toMicros( samples.empty() ? 0 : samples.back() )
+	<< " }";
+	return json.str();
+}
+
+//-----------------------------------------------------------------------------
+
+// Measures one way streaming throughput for a range of message sizes, with
+// and without send coalescing.
+std::string runThroughput( const BenchOptions & options )
+{
+	const size_t sizes[] = { 64, 512, 4096, 65536 };
+	const uint64_t totalBytes = options.quick ? ( 32 << 20 ) : ( 512 << 20 );
+	const uint64_t maxMessages = options.quick ? 100000 : 1000000;
+	const size_t window = 256;
+
+	std::ostringstream json;
+	json << "[";
+	bool first = true;
+	for( size_t s = 0; s < sizeof( sizes ) / sizeof( sizes[ 0 ] ); ++s )
+	{
+		for( int32_t coalescing = 0; coalescing < 2; ++coalescing )
+		{
+			uint64_t messageCount = std::min( maxMessages, totalBytes / sizes[ s ] );
+			uint64_t expected = messageCount * sizes[ s ];
+			std::fprintf( stderr, "throughput: %zu bytes x %llu, coalescing %d\n", sizes[ s ], static_cast< unsigned long long >( messageCount ), coalescing );
+
+			BenchHive bench( 2, false );
+			std::atomic< uint64_t > received( 0 );
+			NewSink newSink = { bench.getHive(), &received };
+			boost::shared_ptr< BenchAcceptor< NewSink > > acceptor = makeAcceptor( bench.getHive(), newSink );
+			uint16_t port = acceptor->start();
+
+			boost::shared_ptr< StreamConnection > client( new StreamConnection( bench.getHive(), sizes[ s ], messageCount, window, coalescing != 0 ) );
+			uint64_t start = now();
+			client->connect( "127.0.0.1", port );
+			bool completed = waitFor( received, expected, 120000 );
+			uint64_t elapsed = now() - start;
+			client->disconnect();
+			acceptor->stop();
+			bench.stop();
+
+			double seconds = toSeconds( elapsed );
+			json << ( first ? "" : "," ) << "\n    { \"message_bytes\": " << sizes[ s ]
+			<< ", \"coalescing\": " << ( coalescing ? "true" : "false" )
+			<< ", \"messages\": " << messageCount
+			<< ", \"completed\": " << ( completed ? "true" : "false" )
+			<< ", \"seconds\": " << seconds
+			<< ", \"messages_per_sec\": " << static_cast< double >( messageCount ) / seconds
+			<< ", \"megabytes_per_sec\": " << static_cast< double >( received.load() ) / seconds / ( 1024.0 * 1024.0 )
+			<< " }";
+			first = false;
+		}
+	}
+	json << "\n  ]";
+	return json.str();
+}
+
+//-----------------------------------------------------------------------------
+
+// Measures how fast connections can be accepted while clients connect and
+// disconnect as quickly as they can.
+std::string runChurn( const BenchOptions & options )
+{
+	const uint64_t count = options.quick ? 1000 : 10000;
+	const size_t concurrency = 16;
+
+	BenchHive bench( 2, false );
+	std::atomic< uint64_t > received( 0 );
+	NewSink newSink = { bench.getHive(), &received };
+	boost::shared_ptr< BenchAcceptor< NewSink > > acceptor = makeAcceptor( bench.getHive(), newSink );
+	uint16_t port = acceptor->start( concurrency );
+
+	boost::shared_ptr< ChurnDriver > driver( new ChurnDriver( bench.getHive(), port, count ) );
+	uint64_t start = now();
+	for( size_t i = 0; i < concurrency; ++i )
+	{
+		driver->next();
+	}
+	bool completed = waitFor( acceptor->getAccepts(), count - driver->getFailures(), 120000 );
+	uint64_t elapsed = now() - start;
+	uint64_t accepts = acceptor->getAccepts().load();
+	acceptor->stop();
+	bench.stop();
+
+	std::ostringstream json;
+	json << "{ \"connections\": " << count
+	<< ", \"accepts\": " << accepts
+	<< ", \"failures\": " << driver->getFailures()
+	<< ", \"completed\": " << ( completed ? "true" : "false" )
+	<< ", \"seconds\": " << toSeconds( elapsed )
+	<< ", \"accepts_per_sec\": " << static_cast< double >( accepts ) / toSeconds( elapsed )
+	<< " }";
+	return json.str();
+}
+
+//-----------------------------------------------------------------------------
+
+// Measures echo round trips per second of many connections as the number of
+// threads driving the Hive grows.
+std::string runScaling( const BenchOptions & options )
+{
+	const size_t connectionCount = 64;
+	const uint32_t durationMilli = options.quick ? 500 : 3000;
+
+	std::vector< uint32_t > threadCounts;
+	for( uint32_t threads = 1; threads <= options.maxThreads; threads *= 2 )
+	{
+		threadCounts.push_back( threads );
+	}
+	if( threadCounts.back() != options.maxThreads )
+	{
+		threadCounts.push_back( options.maxThreads );
+	}
+
+	std::ostringstream json;
+	json << "[";
+	bool first = true;
+	for( int32_t workers = 0; workers < 2; ++workers )
+	{
+		for( size_t t = 0; t < threadCounts.size(); ++t )
+		{
+			if( NETWORK_SINGLE_THREADED && !workers && threadCounts[ t ] > 1 )
+			{
+				continue;
+			}
+			std::fprintf( stderr, "scaling: %s, %u threads\n", workers ? "workers" : "run", threadCounts[ t ] );
+			BenchHive bench( threadCounts[ t ], workers != 0 );
+			NewEcho newEcho = { bench.getHive() };
+			boost::shared_ptr< BenchAcceptor< NewEcho > > acceptor = makeAcceptor( bench.getHive(), newEcho );
+			uint16_t port = acceptor->start( connectionCount );
+
+			std::atomic< bool > running( true );
+			std::atomic< uint64_t > done( 0 );
+			std::vector< boost::shared_ptr< PingConnection > > clients;
+			for( size_t i = 0; i < connectionCount; ++i )
+			{
+				clients.push_back( boost::shared_ptr< PingConnection >( new PingConnection( bench.getHive(), 64, running, done ) ) );
+				clients.back()->connect( "127.0.0.1", port );
+			}
+
+			// Measure after a warm up so every connection is established.
+			std::this_thread::sleep_for( std::chrono::milliseconds( durationMilli / 5 ) );
+			uint64_t startTrips = 0;
+			for( size_t i = 0; i < clients.size(); ++i )
+			{
+				startTrips += clients[ i ]->getRoundTrips();
+			}
+			uint64_t start = now();
+			std::this_thread::sleep_for( std::chrono::milliseconds( durationMilli ) );
+			uint64_t endTrips = 0;
+			for( size_t i = 0; i < clients.size(); ++i )
+			{
+				endTrips += clients[ i ]->getRoundTrips();
+			}
+			uint64_t elapsed = now() - start;
+			running.store( false, std::memory_order_relaxed );
+			waitFor( done, connectionCount, 5000 );
+			for( size_t i = 0; i < clients.size(); ++i )
+			{
+				clients[ i ]->disconnect();
+			}
+			acceptor->stop();
+			bench.stop();
+
+			json << ( first ? "" : "," ) << "\n    { \"mode\": \"" << ( workers ? "workers" : "run" ) << "\""
+			<< ", \"threads\": " << threadCounts[ t ]
+			<< ", \"connections\": " << connectionCount
+			<< ", \"round_trips_per_sec\": " << static_cast< double >( endTrips - startTrips ) / toSeconds( elapsed )
+			<< " }";
+			first = false;
+		}
+	}
+	json << "\n  ]";
+	return json.str();
+}
+
+//-----------------------------------------------------------------------------
+
+#if NETWORK_COROUTINES
+
+// A connection driven only by coroutines, so none of its handlers run.
+class AwaitConnection : public Connection
+{
+private:
+	void onAccept( const std::string &, uint16_t )
+	{
+	}
+
+	void onConnect( const std::string &, uint16_t )
+	{
+	}
+
+	void onSend( const std::vector< uint8_t > & )
+	{
+	}
+
+	void onRecv( std::vector< uint8_t > & )
+	{
+	}
+
+	void onTimer( const boost::posix_time::time_duration & )
+	{
+	}
+
+	void onError( const boost::system::error_code & )
+	{
+	}
+
+public:
+	AwaitConnection( boost::shared_ptr< Hive > hive )
+	: Connection( hive )
+	{
+	}
+};
+
+// Accepts one client and writes everything it receives back until the
+// client goes away.
+NetworkTask awaitEcho( boost::shared_ptr< Acceptor > acceptor, boost::shared_ptr< Connection > connection )
+{
+	IoResult result = co_await acceptor->asyncAccept( connection );
+	std::vector< uint8_t > buffer;
+	while( !result.error )
+	{
+		result = co_await connection->asyncRecv( buffer );
+		if( !result.error )
+		{
+			result = co_await connection->asyncSend( buffer );
+		}
+	}
+}
+
+// Connects, then sends a message and awaits its echo limit times, recording
+// the round trips after the warm up.
+NetworkTask awaitPing( boost::shared_ptr< Connection > connection, uint16_t port, size_t messageBytes, uint64_t limit, uint64_t warmup, std::vector< uint64_t > * samples, std::atomic< uint64_t > * done )
+{
+	IoResult result = co_await connection->asyncConnect( "127.0.0.1", port );
+	if( !result.error )
+	{
+		boost::system::error_code ec;
+		connection->getSocket().set_option( boost::asio::ip::tcp::no_delay( true ), ec );
+	}
+	std::vector< uint8_t > payload( messageBytes, 0x5a );
+	std::vector< uint8_t > buffer;
+	for( uint64_t roundTrips = 1; !result.error && roundTrips <= limit; ++roundTrips )
+	{
+		uint64_t start = now();
+		result = co_await connection->asyncSend( payload );
+		if( !result.error )
+		{
+			result = co_await connection->asyncRecv( buffer, static_cast< int32_t >( messageBytes ) );
+		}
+		if( !result.error && roundTrips > warmup )
+		{
+			samples->push_back( now() - start );
+		}
+	}
+	done->fetch_add( 1, std::memory_order_release );
+}
+
+// Measures echo round trip latency of a single connection when both ends
+// are coroutines awaiting the network.
+std::string runCoroutines( const BenchOptions & options )
+{
+	const size_t messageBytes = 64;
+	const uint64_t warmup = options.quick ? 500 : 2000;
+	const uint64_t roundTrips = options.quick ? 5000 : 50000;
+
+	BenchHive bench( 1, false );
+	NewEcho newEcho = { bench.getHive() };
+	boost::shared_ptr< BenchAcceptor< NewEcho > > acceptor = makeAcceptor( bench.getHive(), newEcho );
+	uint16_t port = acceptor->start( 0 );
+	boost::shared_ptr< Connection > server( new AwaitConnection( bench.getHive() ) );
+	boost::shared_ptr< Connection > client( new AwaitConnection( bench.getHive() ) );
+
+	std::vector< uint64_t > samples;
+	samples.reserve( static_cast< size_t >( roundTrips ) );
+	std::atomic< uint64_t > done( 0 );
+	awaitEcho( acceptor, server );
+	awaitPing( client, port, messageBytes, warmup + roundTrips, warmup, &samples, &done );
+	bool completed = waitFor( done, 1, 120000 ) && samples.size() == roundTrips;
+	client->disconnect();
+	acceptor->stop();
+	bench.stop();
+
+	std::sort( samples.begin(), samples.end() );
+	uint64_t total = 0;
+	for( size_t i = 0; i < samples.size(); ++i )
+	{
+		total += samples[ i ];
+	}
+	std::ostringstream json;
+	json << "{ \"message_bytes\": " << messageBytes
+	<< ", \"round_trips\": " << samples.size()
+	<< ", \"completed\": " << ( completed ? "true" : "false" )
+	<< ", \"mean_us\": " << ( samples.empty() ? 0.0 : toMicros( total / samples.size() ) )
+	<< ", \"p50_us\": " << toMicros( getPercentile( samples, 0.5 ) )
+	<< ", \"p99_us\": " << toMicros( getPercentile( samples, 0.99 ) )
+	<< ", \"max_us\": " << toMicros( samples.empty() ? 0 : samples.back() )
+	<< " }";
+	return json.str();
+}
+
+#endif
+
+//-----------------------------------------------------------------------------
+
+// Re-arms its timer every time it expires until the scenario stops it. Every
+// expiry is counted so an expiry dropped by the wheel shows up as a
+// schedule that never fired.
+class TimerOwner
+{
+private:
+	TimerWheel &                mWheel;
+	TimerWheel::Entry           mEntry;
+	const std::atomic< bool > & mRunning;
+	std::atomic< uint64_t > &   mSchedules;
+	std::atomic< uint64_t > &   mExpiries;
+
+private:
+	static void onExpire( const boost::shared_ptr< void > & owner )
+	{
+		TimerOwner * timerOwner = static_cast< TimerOwner * >( owner.get() );
+		timerOwner->mExpiries.fetch_add( 1, std::memory_order_relaxed );
+		if( timerOwner->mRunning.load( std::memory_order_relaxed ) )
+		{
+			timerOwner->schedule( owner );
+		}
+	}
+
+public:
+	TimerOwner( TimerWheel & wheel, const std::atomic< bool > & running, std::atomic< uint64_t > & schedules, std::atomic< uint64_t > & expiries )
+	: mWheel( wheel ), mEntry( &TimerOwner::onExpire ), mRunning( running ), mSchedules( schedules ), mExpiries( expiries )
+	{
+	}
+
+	void schedule( const boost::shared_ptr< void > & owner )
+	{
+		mSchedules.fetch_add( 1, std::memory_order_relaxed );
+		mWheel.schedule( mEntry, owner, mWheel.getResolution() );
+	}
+};
+
+// Measures timer wheel expiries per second while two threads run its ticks.
+// Every scheduled expiry has to fire once the owners stop re-arming.
+std::string runTimers( const BenchOptions & options )
+{
+	const size_t ownerCount = options.quick ? 10000 : 50000;
+	const uint32_t durationMilli = options.quick ? 500 : 3000;
+
+	BenchHive bench( 2, false );
+	TimerWheel wheel( bench.getHive()->getService(), 1 );
+	std::atomic< bool > running( true );
+	std::atomic< uint64_t > schedules( 0 );
+	std::atomic< uint64_t > expiries( 0 );
+	for( size_t i = 0; i < ownerCount; ++i )
+	{
+		boost::shared_ptr< TimerOwner > owner( new TimerOwner( wheel, running, schedules, expiries ) );
+		owner->schedule( owner );
+	}
+
+	uint64_t start = now();
+	std::this_thread::sleep_for( std::chrono::milliseconds( durationMilli ) );
+	running.store( false, std::memory_order_relaxed );
+	uint64_t elapsed = now() - start;
+	bool completed = waitFor( expiries, schedules.load(), 5000 ) && wheel.getScheduledCount() == 0;
+	bench.stop();
+
+	std::ostringstream json;
+	json << "{ \"owners\": " << ownerCount
+	<< ", \"schedules\": " << schedules.load()
+	<< ", \"expiries\": " << expiries.load()
+	<< ", \"completed\": " << ( completed ? "true" : "false" )
+	<< ", \"expiries_per_sec\": " << static_cast< double >( expiries.load() ) / toSeconds( elapsed )
+	<< " }";
+	return json.str();
+}
+
+//-----------------------------------------------------------------------------
+
+int main( int argc, char * argv[] )
+{
+	BenchOptions options;
+	options.quick = false;
+	options.maxThreads = std::max( std::thread::hardware_concurrency(), 1u );
+	for( int i = 1; i < argc; ++i )
+	{
+		if( std::strcmp( argv[ i ], "--quick" ) == 0 )
+		{
+			options.quick = true;
+		}
+		else if( std::strcmp( argv[ i ], "--only" ) == 0 && i + 1 < argc )
+		{
+			options.only = argv[ ++i ];
+		}
+		else if( std::strcmp( argv[ i ], "--out" ) == 0 && i + 1 < argc )
+		{
+			options.out = argv[ ++i ];
+		}
+		else if( std::strcmp( argv[ i ], "--trace" ) == 0 && i + 1 < argc )
+		{
+			options.trace = argv[ ++i ];
+		}
+		else if( std::strcmp( argv[ i ], "--threads" ) == 0 && i + 1 < argc )
+		{
+			options.maxThreads = std::max( std::atoi( argv[ ++i ] ), 1 );
+		}
+		else
+		{
+			std::fprintf( stderr, "usage: %s [--quick] [--only latency|latency_shm|throughput|churn|scaling|timers|coroutines] [--threads n] [--out file.json] [--trace file.json]\n", argv[ 0 ] );
+			return 1;
+		}
+	}
+	Tracer::setEnabled( !options.trace.empty() );
+
+	std::ostringstream json;
+	json << "{\n  \"timestamp\": " << static_cast< long long >( std::time( 0 ) )
+	<< ",\n  \"quick\": " << ( options.quick ? "true" : "false" )
+	<< ",\n  \"metrics\": " << ( NETWORK_METRICS ? "true" : "false" )
+	<< ",\n  \"single_threaded\": " << ( NETWORK_SINGLE_THREADED ? "true" : "false" )
+	<< ",\n  \"tracing\": " << ( NETWORK_TRACING && Tracer::isEnabled() ? "true" : "false" )
+	<< ",\n  \"hardware_concurrency\": " << std::thread::hardware_concurrency();
+	if( options.only.empty() || options.only == "latency" )
+	{
+		std::fprintf( stderr, "latency\n" );
+		json << ",\n  \"latency\": " << runLatency( options, "127.0.0.1" );
+	}
+#if NETWORK_SHM
+	if( options.only.empty() || options.only == "latency_shm" )
+	{
+		std::fprintf( stderr, "latency shm\n" );
+		json << ",\n  \"latency_shm\": " << runLatency( options, "shm://bench" );
+	}
+#endif
+	if( options.only.empty() || options.only == "throughput" )
+	{
+		json << ",\n  \"throughput\": " << runThroughput( options );
+	}
+	if( options.only.empty() || options.only == "churn" )
+	{
+		std::fprintf( stderr, "churn\n" );
+		json << ",\n  \"churn\": " << runChurn( options );
+	}
+	if( options.only.empty() || options.only == "scaling" )
+	{
+		json << ",\n  \"scaling\": " << runScaling( options );
+	}
+	if( options.only.empty() || options.only == "timers" )
+	{
+		std::fprintf( stderr, "timers\n" );
+		json << ",\n  \"timers\": " << runTimers( options );
+	}
+#if NETWORK_COROUTINES
+	if( options.only.empty() || options.only == "coroutines" )
+	{
+		std::fprintf( stderr, "coroutines\n" );
+		json << ",\n  \"coroutines\": " << runCoroutines( options );
+	}
+#endif
+	json << "\n}\n";
+
+	if( !options.trace.empty() && !Tracer::dump( options.trace ) )
+	{
+		std::fprintf( stderr, "could not write %s\n", options.trace.c_str() );
+		return 1;
+	}
+
+	if( options.out.empty() )
+	{
+		std::fputs( json.str().c_str(), stdout );
+	}
+	else
+	{
+		FILE * file = std::fopen( options.out.c_str(), "w" );
+		if( !file )
+		{
+			std::fprintf( stderr, "could not open %s\n", options.out.c_str() );
+			return 1;
+		}
+		std::fputs( json.str().c_str(), file );
+		std::fclose( file );
+	}
+	return 0;
+}
@@ -1,6 +1,7 @@
 #include "cinder/app/AppNative.h"
 #include "cinder/gl/gl.h"
 #include "Network.h"
+#include <boost/bind.hpp>
 #include <thread>
 
 using namespace ci;
@@ -11,11 +12,13 @@ std::mutex global_stream_lock;
 
 class MyServerConnect : public Connection {
   private:
+    // Handlers run on the Hive's worker thread. They only queue the event
+    // for the app thread and never wait on the frame loop.
+    boost::shared_ptr< EventQueue > mEvents;
+    
     void onAccept( const std::string & host, uint16_t port )
     {
-        global_stream_lock.lock();
-        std::cout << "[" << __FUNCTION__ << "] " << host << ":" << port << std::endl;
-        global_stream_lock.unlock();
+        mEvents->pushAccept( shared_from_this(), host, port );
         
         // Start the next receive
         recv();
@@ -23,45 +26,38 @@ class MyServerConnect : public Connection {
     
     void onConnect( const std::string & host, uint16_t port )
     {
-        global_stream_lock.lock();
-        std::cout << "[" << __FUNCTION__ << "] " << host << ":" << port << std::endl;
-        global_stream_lock.lock();
+        mEvents->pushConnect( shared_from_this(), host, port );
         
         recv();
     }
     
     void onSend( const std::vector< uint8_t > & buffer )
     {
-        global_stream_lock.lock();
-        std::cout << "[" << __FUNCTION__ << "] " << buffer.size() << " bytes" << std::endl;
-        for (size_t x = 0; x < buffer.size(); ++x) {
-            std::cout << std::hex << std::setfill( '0' ) << std::setw( 2 ) << (int)buffer[ x ] << " ";
-            if ( ( x + 1 ) % 16 == 0) {
-                std::cout << std::endl;
-            }
-        }
-        std::cout << std::endl;
-        global_stream_lock.unlock();
+        mEvents->pushSend( shared_from_this(), buffer );
     }
     
     void onRecv( std::vector< uint8_t > & buffer )
     {
-        global_stream_lock.lock();
-        std::cout << "[" << __FUNCTION__ << "] " << buffer.size() << " bytes" << std::endl;
-        for (size_t x = 0; x < buffer.size(); ++x) {
-            std::cout << std::hex << std::setfill( '0' ) << std::setw( 2 ) << (int)buffer[ x ] << " ";
-            if ( (x + 1 ) % 16 == 0) {
-                std::cout << std::endl;
-            }
-        }
-        std::cout << std::endl;
-        global_stream_lock.unlock();
-        
         // Start the next receive
         recv();
         
         // Echo the data back
         send( buffer );
+        
+        mEvents->pushRecv( shared_from_this(), buffer );
+    }
+    
+    void onRecvLease( const RecvLease & lease )
+    {
+        // Start the next receive
+        recv();
+        
+        // Echo the data back
+        send( lease->getBuffer() );
+        
+        // The event keeps the pooled block until the app thread is done
+        // with it, so the bytes are not moved out of the pool.
+        mEvents->pushRecv( shared_from_this(), lease );
     }
     
     void onTimer( const boost::posix_time::time_duration & delta )
@@ -73,15 +69,15 @@ class MyServerConnect : public Connection {
     
     void onError( const boost::system::error_code & ec )
     {
-        global_stream_lock.lock();
-        std::cout << "[" << __FUNCTION__ << "] " << ec << std::endl;
-        global_stream_lock.unlock();
+        mEvents->pushError( shared_from_this(), ec );
     }
     
 public:
-    MyServerConnect( boost::shared_ptr< Hive > hive )
-    : Connection( hive )
+    MyServerConnect( boost::shared_ptr< Hive > hive, boost::shared_ptr< EventQueue > events )
+    : Connection( hive ), mEvents( events )
     {
+        setAdaptiveReceive( true );
+        setSocketOptions( SocketOptions::lowLatency() );
     }
     
     ~MyServerConnect()
@@ -132,8 +128,11 @@ class Cinder_NetworkApp : public AppNative {
     void keyDown( KeyEvent k );
 	void update();
 	void draw();
+    void shutdown();
+    void handleEvent( NetworkEvent & event );
     
     boost::shared_ptr< Hive > hive;
+    boost::shared_ptr< EventQueue > events;
     boost::shared_ptr< MyServerAcceptor > acceptor;
     boost::shared_ptr< MyServerConnect > connection;
 };
@@ -145,11 +144,14 @@ void Cinder_NetworkApp::keyDown( KeyEvent k )
 
 void Cinder_NetworkApp::setup()
 {
-    hive = boost::shared_ptr< Hive >( new Hive() );
+    // The Hive runs its own worker thread; network events reach the app
+    // thread through the event queue drained in update().
+    hive = boost::shared_ptr< Hive >( new Hive( 1 ) );
+    events = boost::shared_ptr< EventQueue >( new EventQueue( hive ) );
     acceptor = boost::shared_ptr< MyServerAcceptor >( new MyServerAcceptor( hive ) );
     acceptor->listen("127.0.0.1", 7777);
     
-    connection = boost::shared_ptr< MyServerConnect >( new MyServerConnect( hive ) );
+    connection = boost::shared_ptr< MyServerConnect >( new MyServerConnect( hive, events ) );
     acceptor->accept( connection );
 }
 
@@ -159,16 +161,54 @@ void Cinder_NetworkApp::mouseDown( MouseEvent event )
 
 void Cinder_NetworkApp::update()
 {
+    // Spend at most 2 ms of the frame on network events, the rest stay
+    // queued for the next frame.
+    events->drain( boost::bind( &Cinder_NetworkApp::handleEvent, this, _1 ), 256, 2000 );
+}
+
+void Cinder_NetworkApp::handleEvent( NetworkEvent & event )
+{
+    // The acceptor and the connection timer still print from the worker
+    // thread.
+    global_stream_lock.lock();
+    switch( event.type ) {
+        case NetworkEvent::EVENT_ACCEPT:
+            std::cout << "[onAccept] " << event.host << ":" << event.port << std::endl;
+            break;
+        case NetworkEvent::EVENT_CONNECT:
+            std::cout << "[onConnect] " << event.host << ":" << event.port << std::endl;
+            break;
+        case NetworkEvent::EVENT_SEND:
+        case NetworkEvent::EVENT_RECV:
+        {
+            const std::vector< uint8_t > & buffer = event.getBuffer();
+            std::cout << ( event.type == NetworkEvent::EVENT_SEND ? "[onSend] " : "[onRecv] " ) << std::dec << buffer.size() << " bytes" << std::endl;
+            for (size_t x = 0; x < buffer.size(); ++x) {
+                std::cout << std::hex << std::setfill( '0' ) << std::setw( 2 ) << (int)buffer[ x ] << " ";
+                if ( ( x + 1 ) % 16 == 0) {
+                    std::cout << std::endl;
+                }
+            }
+            std::cout << std::dec << std::endl;
+            break;
+        }
+        case NetworkEvent::EVENT_ERROR:
+            std::cout << "[onError] " << event.error << std::endl;
+            break;
+    }
+    global_stream_lock.unlock();
 }
 
 void Cinder_NetworkApp::draw()
 {
 	// clear out the window with black
 	gl::clear( Color( 0, 0, 0 ) );
-    
-    hive->poll();
-    sleep(1);
-    
+}
+
+void Cinder_NetworkApp::shutdown()
+{
+    // Joins the worker thread before the app goes away.
+    hive->stop();
 }
 
 CINDER_APP_NATIVE( Cinder_NetworkApp, RendererGl )
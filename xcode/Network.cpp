@@ -1,386 +1,5894 @@
-#include "network.h"
+#include "Network.h"
 #include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
 #include <boost/lexical_cast.hpp>
-#include <boost/interprocess/detail/atomic.hpp>
+#include <algorithm>
+#include <utility>
+#include <cstring>
+#include <stdexcept>
+#include <chrono>
+#include <cmath>
+#include <cctype>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#if NETWORK_SHM || NETWORK_SENDFILE
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if NETWORK_SHM
+#include <sys/un.h>
+#endif
+#if defined( __linux__ )
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#elif defined( __APPLE__ )
+#include <pthread.h>
+#include <mach/mach.h>
+#include <mach/thread_policy.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
 
 //-----------------------------------------------------------------------------
 
-Hive::Hive()
-: mWorkPtr( new boost::asio::io_service::work( mIoService ) ), mShutdown( 0 )
+RecvBlock::RecvBlock( size_t blockSize )
+: mRefCount( 0 )
 {
+	mBuffer.reserve( blockSize );
 }
 
-Hive::~Hive()
+RecvBlock::~RecvBlock()
 {
 }
 
-boost::asio::io_service & Hive::getService()
+std::vector< uint8_t > & RecvBlock::getBuffer()
 {
-	return mIoService;
+	return mBuffer;
 }
 
-bool Hive::hasStopped()
+uint8_t * RecvBlock::data()
 {
-	return ( boost::interprocess::ipcdetail::atomic_cas32( &mShutdown, 1, 1 ) == 1 );
+	return mBuffer.empty() ? 0 : &mBuffer[ 0 ];
 }
 
-void Hive::poll()
+size_t RecvBlock::size() const
 {
-	mIoService.poll();
+	return mBuffer.size();
 }
 
-void Hive::run()
+void intrusive_ptr_add_ref( RecvBlock * block )
 {
-	mIoService.run();
+	block->mRefCount.fetch_add( 1, std::memory_order_relaxed );
 }
 
-void Hive::stop()
+void intrusive_ptr_release( RecvBlock * block )
 {
-	if( boost::interprocess::ipcdetail::atomic_cas32( &mShutdown, 1, 0 ) == 0 )
+	if( block->mRefCount.fetch_sub( 1, std::memory_order_acq_rel ) == 1 )
 	{
-		mWorkPtr.reset();
-		mIoService.run();
-		mIoService.stop();
+		// The block holds its free list alive while leased, take the
+		// reference before handing the block back so the list outlives the
+		// release.
+		boost::shared_ptr< RecvFreeList > freeList;
+		freeList.swap( block->mFreeList );
+		freeList->release( block );
 	}
 }
 
-void Hive::reset()
+//-----------------------------------------------------------------------------
+
+RecvFreeList::RecvFreeList( size_t maxFreeBlocks )
+: mMaxFreeBlocks( maxFreeBlocks ), mLeasedCount( 0 )
+{
+}
+
+RecvFreeList::~RecvFreeList()
+{
+	for( size_t i = 0; i < mBlocks.size(); ++i )
+	{
+		delete mBlocks[ i ];
+	}
+}
+
+void RecvFreeList::release( RecvBlock * block )
 {
-	if( boost::interprocess::ipcdetail::atomic_cas32( &mShutdown, 0, 1 ) == 1 )
+	block->mBuffer.clear();
+	mLeasedCount.fetch_sub( 1, std::memory_order_relaxed );
 	{
-		mIoService.reset();
-		mWorkPtr.reset( new boost::asio::io_service::work( mIoService ) );
+		std::lock_guard< std::mutex > lock( mMutex );
+		if( mBlocks.size() < mMaxFreeBlocks.load( std::memory_order_relaxed ) )
+		{
+			mBlocks.push_back( block );
+			return;
+		}
 	}
+	delete block;
 }
 
 //-----------------------------------------------------------------------------
 
-Acceptor::Acceptor( boost::shared_ptr< Hive > hive )
-: mHive( hive ), mAcceptor( hive->getService() ), mIoStrand(  hive->getService() ), mTimer( hive->getService() ),  mTimerInterval( 1000 ), mErrorState( 0 )
+RecvBufferPool::RecvBufferPool( size_t blockSize, size_t maxFreeBlocks, size_t listCount )
+: mBlockSize( blockSize )
 {
+	for( size_t i = 0; i < std::max< size_t >( listCount, 1 ); ++i )
+	{
+		mFreeLists.push_back( boost::shared_ptr< RecvFreeList >( new RecvFreeList( maxFreeBlocks ) ) );
+	}
 }
 
-Acceptor::~Acceptor()
+RecvBufferPool::~RecvBufferPool()
 {
 }
 
-void Acceptor::startTimer()
+RecvLease RecvBufferPool::acquire( size_t listIndex )
+{
+	const boost::shared_ptr< RecvFreeList > & freeList = mFreeLists[ listIndex % mFreeLists.size() ];
+	RecvBlock * block = 0;
+	{
+		std::lock_guard< std::mutex > lock( freeList->mMutex );
+		if( !freeList->mBlocks.empty() )
+		{
+			block = freeList->mBlocks.back();
+			freeList->mBlocks.pop_back();
+		}
+	}
+	size_t blockSize = mBlockSize.load( std::memory_order_relaxed );
+	if( !block )
+	{
+		block = new RecvBlock( blockSize );
+	}
+	else if( block->mBuffer.capacity() < blockSize )
+	{
+		block->mBuffer.reserve( blockSize );
+	}
+	freeList->mLeasedCount.fetch_add( 1, std::memory_order_relaxed );
+	block->mFreeList = freeList;
+	return RecvLease( block );
+}
+
+void RecvBufferPool::setBlockSize( size_t blockSize )
 {
-	mLastTime = boost::posix_time::microsec_clock::local_time();
-	mTimer.expires_from_now( boost::posix_time::milliseconds( mTimerInterval ) );
-	mTimer.async_wait( mIoStrand.wrap( boost::bind( &Acceptor::handleTimer, shared_from_this(), _1 ) ) );
+	mBlockSize.store( blockSize, std::memory_order_relaxed );
 }
 
-void Acceptor::startError( const boost::system::error_code & error )
+size_t RecvBufferPool::getBlockSize()
+{
+	return mBlockSize.load( std::memory_order_relaxed );
+}
+
+void RecvBufferPool::setMaxFreeBlocks( size_t maxFreeBlocks )
 {
-	if( boost::interprocess::ipcdetail::atomic_cas32( &mErrorState, 1, 0 ) == 0 )
+	for( size_t i = 0; i < mFreeLists.size(); ++i )
 	{
-		boost::system::error_code ec;
-		mAcceptor.cancel( ec );
-		mAcceptor.close( ec );
-		mTimer.cancel( ec );
-		onError( error );
+		mFreeLists[ i ]->mMaxFreeBlocks.store( maxFreeBlocks, std::memory_order_relaxed );
 	}
 }
 
-void Acceptor::dispatchAccept( boost::shared_ptr< Connection > connection )
+size_t RecvBufferPool::getMaxFreeBlocks()
 {
-	mAcceptor.async_accept( connection->getSocket(),  connection->getStrand().wrap( boost::bind(  &Acceptor::handleAccept, shared_from_this(), _1, connection ) ) );
+	return mFreeLists.front()->mMaxFreeBlocks.load( std::memory_order_relaxed );
 }
 
-void Acceptor::handleTimer( const boost::system::error_code & error )
+size_t RecvBufferPool::getFreeCount()
 {
-	if( error || hasError() || mHive->hasStopped() )
+	size_t count = 0;
+	for( size_t i = 0; i < mFreeLists.size(); ++i )
 	{
-		startError( error );
+		std::lock_guard< std::mutex > lock( mFreeLists[ i ]->mMutex );
+		count += mFreeLists[ i ]->mBlocks.size();
 	}
-	else
+	return count;
+}
+
+size_t RecvBufferPool::getLeasedCount()
+{
+	size_t count = 0;
+	for( size_t i = 0; i < mFreeLists.size(); ++i )
 	{
-		onTimer( boost::posix_time::microsec_clock::local_time() - mLastTime );
-		startTimer();
+		count += mFreeLists[ i ]->mLeasedCount.load( std::memory_order_relaxed );
 	}
+	return count;
 }
 
-void Acceptor::handleAccept( const boost::system::error_code & error, boost::shared_ptr< Connection > connection )
+//-----------------------------------------------------------------------------
+
+HandlerArena::HandlerArena()
+: mAllocations( 0 ), mHeapAllocations( 0 )
 {
-	if( error || hasError() || mHive->hasStopped() )
+	for( size_t i = 0; i < SLOT_COUNT; ++i )
 	{
-		connection->startError( error );
+		mSlots[ i ].mInUse.store( false, std::memory_order_relaxed );
 	}
-	else
+}
+
+void * HandlerArena::allocate( size_t size )
+{
+	mAllocations.fetch_add( 1, std::memory_order_relaxed );
+	if( size <= SLOT_SIZE )
 	{
-		if( connection->getSocket().is_open() )
+		for( size_t i = 0; i < SLOT_COUNT; ++i )
 		{
-			connection->startTimer();
-			if( onAccept( connection,  connection->getSocket().remote_endpoint().address().to_string(),  connection->getSocket().remote_endpoint().port() ) )
+			if( !mSlots[ i ].mInUse.load( std::memory_order_relaxed ) && !mSlots[ i ].mInUse.exchange( true, std::memory_order_acquire ) )
 			{
-				connection->onAccept(  mAcceptor.local_endpoint().address().to_string(),  mAcceptor.local_endpoint().port() );
+				return &mSlots[ i ].mStorage;
 			}
 		}
-		else
+	}
+	mHeapAllocations.fetch_add( 1, std::memory_order_relaxed );
+	return ::operator new( size );
+}
+
+void HandlerArena::deallocate( void * pointer )
+{
+	for( size_t i = 0; i < SLOT_COUNT; ++i )
+	{
+		if( pointer == &mSlots[ i ].mStorage )
 		{
-			startError( error );
+			mSlots[ i ].mInUse.store( false, std::memory_order_release );
+			return;
 		}
 	}
+	::operator delete( pointer );
 }
 
-void Acceptor::stop()
+uint64_t HandlerArena::getAllocationCount() const
 {
-	mIoStrand.post( boost::bind( &Acceptor::handleTimer, shared_from_this(), boost::asio::error::connection_reset ) );
+	return mAllocations.load( std::memory_order_relaxed );
 }
 
-void Acceptor::accept( boost::shared_ptr< Connection > connection )
+uint64_t HandlerArena::getHeapAllocationCount() const
 {
-	mIoStrand.post( boost::bind( &Acceptor::dispatchAccept, shared_from_this(), connection ) );
+	return mHeapAllocations.load( std::memory_order_relaxed );
 }
 
-void Acceptor::listen( const std::string & host, const uint16_t & port )
+//-----------------------------------------------------------------------------
+
+HandlerAllocator::HandlerAllocator()
 {
-	boost::asio::ip::tcp::resolver resolver( mHive->getService() );
-	boost::asio::ip::tcp::resolver::query query( host, boost::lexical_cast< std::string >( port ) );
-	boost::asio::ip::tcp::endpoint endpoint = *resolver.resolve( query );
-	mAcceptor.open( endpoint.protocol() );
-	mAcceptor.set_option( boost::asio::ip::tcp::acceptor::reuse_address( false ) );
-	mAcceptor.bind( endpoint );
-	mAcceptor.listen( boost::asio::socket_base::max_connections );
-	startTimer();
 }
 
-boost::shared_ptr< Hive > Acceptor::getHive()
+HandlerAllocator::~HandlerAllocator()
 {
-	return mHive;
 }
 
-boost::asio::ip::tcp::acceptor & Acceptor::getAcceptor()
+void * HandlerAllocator::allocate( size_t size )
 {
-	return mAcceptor;
+	return mArena.allocate( size );
 }
 
-int32_t Acceptor::getTimerInterval() const
+void HandlerAllocator::deallocate( void * pointer )
 {
-	return mTimerInterval;
+	mArena.deallocate( pointer );
 }
 
-void Acceptor::setTimerInterval( int32_t timerInterval )
+uint64_t HandlerAllocator::getAllocationCount() const
 {
-	mTimerInterval = timerInterval;
+	return mArena.getAllocationCount();
 }
 
-bool Acceptor::hasError()
+uint64_t HandlerAllocator::getHeapAllocationCount() const
+{
+	return mArena.getHeapAllocationCount();
+}
+
+HandlerArena * HandlerAllocator::getArena()
 {
-	return ( boost::interprocess::ipcdetail::atomic_cas32( &mErrorState, 1, 1 ) == 1 );
+	return &mArena;
 }
 
 //-----------------------------------------------------------------------------
 
-Connection::Connection( boost::shared_ptr< Hive > hive )
-: mHive( hive ), mSocket( hive->getService() ), mIoStrand(  hive->getService() ), mTimer( hive->getService() ),  mReceiveBufferSize( 4096 ), mTimerInterval( 1000 ), mErrorState( 0  )
+TimerWheel::Entry::Entry( Callback callback )
+: mPrev( 0 ), mNext( 0 ), mSlot( 0 ), mExpiry( 0 ), mCallback( callback )
 {
 }
 
-Connection::~Connection()
+TimerWheel::Entry::~Entry()
 {
 }
 
-void Connection::bind( const std::string & ip, uint16_t port )
+bool TimerWheel::Entry::isScheduled() const
 {
-	boost::asio::ip::tcp::endpoint endpoint( boost::asio::ip::address::from_string( ip ), port );
-	mSocket.open( endpoint.protocol() );
-	mSocket.set_option( boost::asio::ip::tcp::acceptor::reuse_address( false ) );
-	mSocket.bind( endpoint );
+	return mSlot != 0;
 }
 
-void Connection::startSend()
+//-----------------------------------------------------------------------------
+
+TimerWheel::TimerWheel( boost::asio::io_service & service, int32_t resolutionMilli )
+: mTimer( service ), mStartTime( Clock::now() ), mTime( mStartTime.time_since_epoch().count() ), mCurrentTick( 0 ), mArmedTick( 0 ), mScheduledCount( 0 ), mResolution( std::max( resolutionMilli, 1 ) ), mRunning( false )
 {
-	if( !mPendingSends.empty() )
+	for( size_t level = 0; level < LEVEL_COUNT; ++level )
 	{
-		boost::asio::async_write( mSocket, boost::asio::buffer(  mPendingSends.front() ), mIoStrand.wrap( boost::bind(  &Connection::handleSend, shared_from_this(),  boost::asio::placeholders::error, mPendingSends.begin() ) ) );
+		for( size_t slot = 0; slot < SLOT_COUNT; ++slot )
+		{
+			mSlots[ level ][ slot ] = 0;
+		}
 	}
 }
 
-void Connection::startRecv( int32_t totalBytes )
+TimerWheel::~TimerWheel()
+{
+	boost::system::error_code ec;
+	mTimer.cancel( ec );
+}
+
+uint64_t TimerWheel::getElapsedTicks( const Clock::time_point & time ) const
+{
+	return static_cast< uint64_t >( std::chrono::duration_cast< std::chrono::milliseconds >( time - mStartTime ).count() / mResolution );
+}
+
+void TimerWheel::link( Entry & entry )
+{
+	// Entries are placed on the coarsest level whose span covers their
+	// delay and move down a level each time that slot comes around.
+	uint64_t delta = entry.mExpiry > mCurrentTick ? entry.mExpiry - mCurrentTick : 0;
+	size_t level = 0;
+	while( level + 1 < LEVEL_COUNT && delta >= ( static_cast< uint64_t >( 1 ) << ( SLOT_BITS * ( level + 1 ) ) ) )
+	{
+		++level;
+	}
+	uint64_t expiry = entry.mExpiry;
+	uint64_t span = static_cast< uint64_t >( 1 ) << ( SLOT_BITS * LEVEL_COUNT );
+	if( delta >= span )
+	{
+		// Beyond the range of the wheel, park the entry in the furthest slot,
+		// it is linked again when that slot expires.
+		expiry = mCurrentTick + span - 1;
+	}
+	Entry ** slot = &mSlots[ level ][ ( expiry >> ( SLOT_BITS * level ) ) & ( SLOT_COUNT - 1 ) ];
+	entry.mSlot = slot;
+	entry.mPrev = 0;
+	entry.mNext = *slot;
+	if( *slot )
+	{
+		( *slot )->mPrev = &entry;
+	}
+	*slot = &entry;
+}
+
+void TimerWheel::unlink( Entry & entry )
 {
-	if( totalBytes > 0 )
+	if( entry.mPrev )
 	{
-		mRecvBuffer.resize( totalBytes );
-		boost::asio::async_read( mSocket, boost::asio::buffer(  mRecvBuffer ), mIoStrand.wrap( boost::bind(  &Connection::handleRecv, shared_from_this(), _1, _2 ) ) );
+		entry.mPrev->mNext = entry.mNext;
 	}
 	else
 	{
-		mRecvBuffer.resize( mReceiveBufferSize );
-		mSocket.async_read_some( boost::asio::buffer( mRecvBuffer ),  mIoStrand.wrap( boost::bind( &Connection::handleRecv,  shared_from_this(), _1, _2 ) ) );
+		*entry.mSlot = entry.mNext;
+	}
+	if( entry.mNext )
+	{
+		entry.mNext->mPrev = entry.mPrev;
 	}
+	entry.mPrev = 0;
+	entry.mNext = 0;
+	entry.mSlot = 0;
 }
 
-void Connection::startTimer()
+void TimerWheel::cascade( size_t level, size_t slot )
 {
-	mLastTime = boost::posix_time::microsec_clock::local_time();
-	mTimer.expires_from_now( boost::posix_time::milliseconds( mTimerInterval ) );
-	mTimer.async_wait( mIoStrand.wrap( boost::bind( &Connection::dispatchTimer, shared_from_this(), _1 ) ) );
+	Entry * entry = mSlots[ level ][ slot ];
+	mSlots[ level ][ slot ] = 0;
+	while( entry )
+	{
+		Entry * next = entry->mNext;
+		link( *entry );
+		entry = next;
+	}
 }
 
-void Connection::startError( const boost::system::error_code & error )
+void TimerWheel::advance()
 {
-	if( boost::interprocess::ipcdetail::atomic_cas32( &mErrorState, 1, 0 ) == 0 )
+	++mCurrentTick;
+	for( size_t level = 1; level < LEVEL_COUNT; ++level )
 	{
-		boost::system::error_code ec;
-		mSocket.shutdown( boost::asio::ip::tcp::socket::shutdown_both, ec );
-		mSocket.close( ec );
-		mTimer.cancel( ec );
-		onError( error );
+		if( ( ( mCurrentTick >> ( SLOT_BITS * ( level - 1 ) ) ) & ( SLOT_COUNT - 1 ) ) != 0 )
+		{
+			break;
+		}
+		cascade( level, ( mCurrentTick >> ( SLOT_BITS * level ) ) & ( SLOT_COUNT - 1 ) );
+	}
+    
+	Entry * entry = mSlots[ 0 ][ mCurrentTick & ( SLOT_COUNT - 1 ) ];
+	mSlots[ 0 ][ mCurrentTick & ( SLOT_COUNT - 1 ) ] = 0;
+	while( entry )
+	{
+		Entry * next = entry->mNext;
+		entry->mPrev = 0;
+		entry->mNext = 0;
+		entry->mSlot = 0;
+		if( entry->mExpiry > mCurrentTick )
+		{
+			link( *entry );
+		}
+		else
+		{
+			--mScheduledCount;
+			mExpired.push_back( std::make_pair( entry, boost::shared_ptr< void >() ) );
+			mExpired.back().second.swap( entry->mOwner );
+		}
+		entry = next;
 	}
 }
 
-void Connection::handleConnect( const boost::system::error_code & error )
+uint64_t TimerWheel::getNextTick() const
 {
-	if( error || hasError() || mHive->hasStopped() )
+	// The next tick with work is either one whose level 0 slot holds
+	// entries, or one at which a non-empty slot of a higher level cascades.
+	// Every entry is within SLOT_COUNT slots of its level, so nothing
+	// further away has to be looked at.
+	uint64_t span = static_cast< uint64_t >( 1 ) << ( SLOT_BITS * LEVEL_COUNT );
+	uint64_t next = mCurrentTick + span;
+	for( size_t level = 0; level < LEVEL_COUNT; ++level )
 	{
-		startError( error );
+		size_t shift = SLOT_BITS * level;
+		uint64_t first = ( ( mCurrentTick >> shift ) + 1 ) << shift;
+		for( uint64_t i = 0; i < SLOT_COUNT; ++i )
+		{
+			uint64_t tick = first + ( i << shift );
+			if( tick >= next )
+			{
+				break;
+			}
+			if( mSlots[ level ][ ( tick >> shift ) & ( SLOT_COUNT - 1 ) ] )
+			{
+				next = tick;
+				break;
+			}
+		}
 	}
-	else
+	return next;
+}
+
+void TimerWheel::startTick()
+{
+	mArmedTick = getNextTick();
+	mTimer.expires_at( mStartTime + std::chrono::milliseconds( static_cast< int64_t >( mArmedTick ) * mResolution ) );
+	mTimer.async_wait( boost::bind( &TimerWheel::handleTick, this, _1 ) );
+}
+
+void TimerWheel::handleTick( const boost::system::error_code & error )
+{
+	NETWORK_TRACE( TraceScope traceScope( "TimerWheel::handleTick", this ); )
+	if( error == boost::asio::error::operation_aborted )
 	{
-		if( mSocket.is_open() )
+		return;
+	}
+	// The next tick may run on another thread as soon as it is re-armed, so
+	// the expired entries are moved out of mExpired before the lock is
+	// dropped.
+	std::vector< std::pair< Entry *, boost::shared_ptr< void > > > expired;
+	{
+		std::lock_guard< std::mutex > lock( mMutex );
+		Clock::time_point time = Clock::now();
+		mTime.store( time.time_since_epoch().count(), std::memory_order_relaxed );
+		uint64_t targetTick = getElapsedTicks( time );
+		while( mCurrentTick < targetTick && mScheduledCount > 0 )
+		{
+			// Ticks without work are skipped rather than stepped through,
+			// so a tick costs what expires in it.
+			uint64_t nextTick = getNextTick();
+			if( nextTick > targetTick )
+			{
+				mCurrentTick = targetTick;
+				break;
+			}
+			mCurrentTick = nextTick - 1;
+			advance();
+		}
+		if( mScheduledCount > 0 )
 		{
-			onConnect( mSocket.remote_endpoint().address().to_string(), mSocket.remote_endpoint().port() );
+			startTick();
 		}
 		else
 		{
-			startError( error );
+			mRunning = false;
 		}
+		expired.swap( mExpired );
+	}
+    
+	// Callbacks run outside the lock so they can schedule again.
+	for( size_t i = 0; i < expired.size(); ++i )
+	{
+		expired[ i ].first->mCallback( expired[ i ].second );
+	}
+	expired.clear();
+    
+	// Hands the storage back so a steady tick does not allocate.
+	std::lock_guard< std::mutex > lock( mMutex );
+	if( mExpired.empty() && mExpired.capacity() < expired.capacity() )
+	{
+		mExpired.swap( expired );
 	}
 }
 
-void Connection::handleSend( const boost::system::error_code &  error, std::list< std::vector< uint8_t > >::iterator itr )
+void TimerWheel::schedule( Entry & entry, const boost::shared_ptr< void > & owner, int32_t delayMilli )
 {
-	if( error || hasError() || mHive->hasStopped() )
+	// A replaced owner is released after the lock, see cancel.
+	boost::shared_ptr< void > previous( owner );
+	std::lock_guard< std::mutex > lock( mMutex );
+	if( entry.mSlot )
 	{
-		startError( error );
+		unlink( entry );
+		--mScheduledCount;
 	}
-	else
+	// Ticks without work do not run, so the time is brought up to date
+	// here for the GetTime that follows a Schedule.
+	Clock::time_point time = Clock::now();
+	mTime.store( time.time_since_epoch().count(), std::memory_order_relaxed );
+	if( !mRunning )
 	{
-		onSend( *itr );
-		mPendingSends.erase( itr );
-		startSend();
+		// The wheel is idle, so no entry can be misplaced by jumping
+		// straight to the current tick.
+		mCurrentTick = getElapsedTicks( time );
+	}
+	uint64_t ticks = static_cast< uint64_t >( std::max( delayMilli, 0 ) + mResolution - 1 ) / mResolution;
+	entry.mExpiry = mCurrentTick + std::max( ticks, static_cast< uint64_t >( 1 ) );
+	entry.mOwner.swap( previous );
+	link( entry );
+	++mScheduledCount;
+	if( !mRunning )
+	{
+		mRunning = true;
+		startTick();
+	}
+	else if( entry.mExpiry < mArmedTick )
+	{
+		// Due before the tick the timer waits for. Re-arming cancels that
+		// wait, whose handler then returns without doing anything.
+		startTick();
 	}
 }
 
-void Connection::handleRecv( const boost::system::error_code & error, int32_t actual_bytes )
+void TimerWheel::cancel( Entry & entry )
 {
-	if( error || hasError() || mHive->hasStopped() )
+	// The owner may be the last reference to the object holding the entry,
+	// whose destructor cancels its entries again. Declared before the lock,
+	// it is released after the lock is dropped.
+	boost::shared_ptr< void > owner;
+	std::lock_guard< std::mutex > lock( mMutex );
+	if( entry.mSlot )
 	{
-		startError( error );
+		unlink( entry );
+		owner.swap( entry.mOwner );
+		--mScheduledCount;
 	}
-	else
+}
+
+TimerWheel::Clock::time_point TimerWheel::getTime()
+{
+	return Clock::time_point( Clock::duration( mTime.load( std::memory_order_relaxed ) ) );
+}
+
+boost::posix_time::time_duration TimerWheel::getElapsed( const Clock::time_point & since )
+{
+	return boost::posix_time::microseconds( std::chrono::duration_cast< std::chrono::microseconds >( getTime() - since ).count() );
+}
+
+int32_t TimerWheel::getResolution() const
+{
+	return mResolution;
+}
+
+size_t TimerWheel::getScheduledCount()
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	return mScheduledCount;
+}
+
+//-----------------------------------------------------------------------------
+
+HistogramSnapshot::HistogramSnapshot()
+: counts( LatencyHistogram::BUCKET_COUNT, 0 ), total( 0 ), max( 0 )
+{
+}
+
+uint64_t HistogramSnapshot::getPercentile( double fraction ) const
+{
+	if( total == 0 )
 	{
-		mRecvBuffer.resize( actual_bytes );
-		onRecv( mRecvBuffer );
-		mPendingRecvs.pop_front();
-		if( !mPendingRecvs.empty() )
+		return 0;
+	}
+	double target = std::ceil( std::min( std::max( fraction, 0.0 ), 1.0 ) * static_cast< double >( total ) );
+	uint64_t seen = 0;
+	for( size_t i = 0; i < counts.size(); ++i )
+	{
+		seen += counts[ i ];
+		if( seen > 0 && static_cast< double >( seen ) >= target )
 		{
-			startRecv( mPendingRecvs.front() );
+			return std::min( LatencyHistogram::getBucketValue( i ), max );
 		}
 	}
+	return max;
 }
 
-void Connection::handleTimer( const boost::system::error_code & error )
+void HistogramSnapshot::merge( const HistogramSnapshot & rhs )
 {
-	if( error || hasError() || mHive->hasStopped() )
+	for( size_t i = 0; i < counts.size() && i < rhs.counts.size(); ++i )
 	{
-		startError( error );
+		counts[ i ] += rhs.counts[ i ];
 	}
-	else
+	total += rhs.total;
+	max = std::max( max, rhs.max );
+}
+
+//-----------------------------------------------------------------------------
+
+LatencyHistogram::LatencyHistogram()
+: mMax( 0 )
+{
+	for( size_t i = 0; i < BUCKET_COUNT; ++i )
 	{
-		onTimer( boost::posix_time::microsec_clock::local_time() - mLastTime );
-		startTimer();
+		mCounts[ i ].store( 0, std::memory_order_relaxed );
 	}
 }
 
-void Connection::dispatchSend( std::vector< uint8_t > buffer )
+void LatencyHistogram::record( uint64_t nanos )
 {
-	bool shouldStartSend = mPendingSends.empty();
-	mPendingSends.push_back( buffer );
-	if( shouldStartSend )
+	mCounts[ getBucketIndex( nanos ) ].fetch_add( 1, std::memory_order_relaxed );
+	uint64_t max = mMax.load( std::memory_order_relaxed );
+	while( nanos > max && !mMax.compare_exchange_weak( max, nanos, std::memory_order_relaxed ) )
 	{
-		startSend();
 	}
 }
 
-void Connection::dispatchRecv( int32_t totalBytes )
+HistogramSnapshot LatencyHistogram::getSnapshot() const
 {
-	bool shouldStartReceive = mPendingRecvs.empty();
-	mPendingRecvs.push_back( totalBytes );
-	if( shouldStartReceive )
+	HistogramSnapshot snapshot;
+	for( size_t i = 0; i < BUCKET_COUNT; ++i )
 	{
-		startRecv( totalBytes );
+		snapshot.counts[ i ] = mCounts[ i ].load( std::memory_order_relaxed );
+		snapshot.total += snapshot.counts[ i ];
 	}
+	snapshot.max = mMax.load( std::memory_order_relaxed );
+	return snapshot;
 }
 
-void Connection::dispatchTimer( const boost::system::error_code & error )
+size_t LatencyHistogram::getBucketIndex( uint64_t nanos )
 {
-	mIoStrand.post( boost::bind( &Connection::handleTimer, shared_from_this(), error ) );
+	if( nanos < SUB_BUCKET_COUNT )
+	{
+		return static_cast< size_t >( nanos );
+	}
+	uint64_t maxValue = ( static_cast< uint64_t >( 1 ) << MAX_VALUE_BITS ) - 1;
+	nanos = std::min( nanos, maxValue );
+	// The highest set bit selects the power of two, the SUB_BUCKET_BITS bits
+	// below it select the bucket inside of it.
+	size_t shift = static_cast< size_t >( 63 - __builtin_clzll( nanos ) ) - SUB_BUCKET_BITS;
+	return ( shift + 1 ) * SUB_BUCKET_COUNT + static_cast< size_t >( ( nanos >> shift ) & ( SUB_BUCKET_COUNT - 1 ) );
 }
 
-void Connection::connect( const std::string & host, uint16_t port)
+uint64_t LatencyHistogram::getBucketValue( size_t index )
 {
-	boost::system::error_code ec;
-	boost::asio::ip::tcp::resolver resolver( mHive->getService() );
-	boost::asio::ip::tcp::resolver::query query( host, boost::lexical_cast< std::string >( port ) );
-	boost::asio::ip::tcp::resolver::iterator iterator = resolver.resolve( query );
-	mSocket.async_connect( *iterator, mIoStrand.wrap( boost::bind(  &Connection::handleConnect, shared_from_this(), _1 ) ) );
-	startTimer();
+	if( index < SUB_BUCKET_COUNT )
+	{
+		return index;
+	}
+	size_t shift = index / SUB_BUCKET_COUNT - 1;
+	uint64_t lowest = static_cast< uint64_t >( SUB_BUCKET_COUNT + index % SUB_BUCKET_COUNT ) << shift;
+	return lowest + ( static_cast< uint64_t >( 1 ) << shift ) - 1;
 }
 
-void Connection::disconnect()
+//-----------------------------------------------------------------------------
+
+MetricsSnapshot::MetricsSnapshot()
+: time( boost::posix_time::microsec_clock::universal_time() ), bytesSent( 0 ), bytesRecv( 0 ), messagesSent( 0 ), messagesRecv( 0 ), sendQueueDepth( 0 ), sendQueueHighWater( 0 ), pendingRecvs( 0 ), accepts( 0 ), errors( 0 )
 {
-	mIoStrand.post( boost::bind( &Connection::handleTimer, shared_from_this(), boost::asio::error::connection_reset ) );
 }
 
-void Connection::recv( int32_t totalBytes )
+void MetricsSnapshot::merge( const MetricsSnapshot & rhs )
 {
-	mIoStrand.post( boost::bind( &Connection::dispatchRecv, shared_from_this(), totalBytes ) );
+	bytesSent += rhs.bytesSent;
+	bytesRecv += rhs.bytesRecv;
+	messagesSent += rhs.messagesSent;
+	messagesRecv += rhs.messagesRecv;
+	sendQueueDepth += rhs.sendQueueDepth;
+	sendQueueHighWater = std::max( sendQueueHighWater, rhs.sendQueueHighWater );
+	pendingRecvs += rhs.pendingRecvs;
+	accepts += rhs.accepts;
+	errors += rhs.errors;
+	for( std::map< boost::system::error_code, uint64_t >::const_iterator itr = rhs.errorCounts.begin(); itr != rhs.errorCounts.end(); ++itr )
+	{
+		errorCounts[ itr->first ] += itr->second;
+	}
+	sendLatency.merge( rhs.sendLatency );
+	handlerTime.merge( rhs.handlerTime );
 }
 
-void Connection::send( const std::vector< uint8_t > & buffer )
+double MetricsSnapshot::getAcceptRate( const MetricsSnapshot & earlier ) const
 {
-	mIoStrand.post( boost::bind( &Connection::dispatchSend, shared_from_this(), buffer ) );
+	double seconds = static_cast< double >( ( time - earlier.time ).total_microseconds() ) / 1000000.0;
+	if( seconds <= 0.0 || accepts < earlier.accepts )
+	{
+		return 0.0;
+	}
+	return static_cast< double >( accepts - earlier.accepts ) / seconds;
 }
 
-boost::asio::ip::tcp::socket & Connection::getSocket()
+//-----------------------------------------------------------------------------
+
+Metrics::Metrics()
+: mBytesSent( 0 ), mBytesRecv( 0 ), mMessagesSent( 0 ), mMessagesRecv( 0 ), mSendQueueDepth( 0 ), mSendQueueHighWater( 0 ), mPendingRecvs( 0 ), mAccepts( 0 ), mErrors( 0 )
 {
-	return mSocket;
 }
 
-boost::asio::strand & Connection::getStrand()
+uint64_t Metrics::now()
 {
-	return mIoStrand;
+	return static_cast< uint64_t >( std::chrono::duration_cast< std::chrono::nanoseconds >( std::chrono::steady_clock::now().time_since_epoch() ).count() );
 }
 
-boost::shared_ptr< Hive > Connection::getHive()
+void Metrics::addSent( uint64_t bytes, uint64_t messages )
 {
-	return mHive;
+	mBytesSent.fetch_add( bytes, std::memory_order_relaxed );
+	mMessagesSent.fetch_add( messages, std::memory_order_relaxed );
 }
 
-void Connection::setReceiveBufferSize( int32_t size )
+void Metrics::addRecv( uint64_t bytes, uint64_t messages )
 {
-	mReceiveBufferSize = size;
+	mBytesRecv.fetch_add( bytes, std::memory_order_relaxed );
+	mMessagesRecv.fetch_add( messages, std::memory_order_relaxed );
 }
 
-int32_t Connection::getReceiveBufferSize() const
+void Metrics::addSendQueued()
 {
-	return mReceiveBufferSize;
+	uint64_t depth = mSendQueueDepth.fetch_add( 1, std::memory_order_relaxed ) + 1;
+	uint64_t highWater = mSendQueueHighWater.load( std::memory_order_relaxed );
+	while( depth > highWater && !mSendQueueHighWater.compare_exchange_weak( highWater, depth, std::memory_order_relaxed ) )
+	{
+	}
 }
 
-int32_t Connection::getTimerInterval() const
+void Metrics::removeSendQueued( uint64_t count )
 {
-	return mTimerInterval;
+	mSendQueueDepth.fetch_sub( count, std::memory_order_relaxed );
 }
 
-void Connection::setTimerInterval( int32_t timerInterval )
+void Metrics::addPendingRecv()
 {
-	mTimerInterval = timerInterval;
+	mPendingRecvs.fetch_add( 1, std::memory_order_relaxed );
 }
 
-bool Connection::hasError()
+void Metrics::removePendingRecv( uint64_t count )
+{
+	mPendingRecvs.fetch_sub( count, std::memory_order_relaxed );
+}
+
+void Metrics::addAccept()
+{
+	mAccepts.fetch_add( 1, std::memory_order_relaxed );
+}
+
+void Metrics::addError()
+{
+	mErrors.fetch_add( 1, std::memory_order_relaxed );
+}
+
+void Metrics::reset()
+{
+	mBytesSent.store( 0, std::memory_order_relaxed );
+	mBytesRecv.store( 0, std::memory_order_relaxed );
+	mMessagesSent.store( 0, std::memory_order_relaxed );
+	mMessagesRecv.store( 0, std::memory_order_relaxed );
+	mSendQueueDepth.store( 0, std::memory_order_relaxed );
+	mSendQueueHighWater.store( 0, std::memory_order_relaxed );
+	mPendingRecvs.store( 0, std::memory_order_relaxed );
+	mAccepts.store( 0, std::memory_order_relaxed );
+	mErrors.store( 0, std::memory_order_relaxed );
+}
+
+MetricsSnapshot Metrics::getSnapshot() const
+{
+	MetricsSnapshot snapshot;
+	snapshot.bytesSent = mBytesSent.load( std::memory_order_relaxed );
+	snapshot.bytesRecv = mBytesRecv.load( std::memory_order_relaxed );
+	snapshot.messagesSent = mMessagesSent.load( std::memory_order_relaxed );
+	snapshot.messagesRecv = mMessagesRecv.load( std::memory_order_relaxed );
+	snapshot.sendQueueDepth = mSendQueueDepth.load( std::memory_order_relaxed );
+	snapshot.sendQueueHighWater = mSendQueueHighWater.load( std::memory_order_relaxed );
+	snapshot.pendingRecvs = mPendingRecvs.load( std::memory_order_relaxed );
+	snapshot.accepts = mAccepts.load( std::memory_order_relaxed );
+	snapshot.errors = mErrors.load( std::memory_order_relaxed );
+	return snapshot;
+}
+
+//-----------------------------------------------------------------------------
+
+HiveMetrics::HiveMetrics()
+: mOtherErrors( 0 )
+{
+	for( size_t i = 0; i < SYSTEM_ERROR_COUNT; ++i )
+	{
+		mSystemErrors[ i ].store( 0, std::memory_order_relaxed );
+	}
+	for( size_t i = 0; i < MISC_ERROR_COUNT; ++i )
+	{
+		mMiscErrors[ i ].store( 0, std::memory_order_relaxed );
+	}
+}
+
+void HiveMetrics::addError( const boost::system::error_code & ec )
+{
+	Metrics::addError();
+	if( ec.category() == boost::asio::error::get_system_category() && ec.value() >= 0 && ec.value() < SYSTEM_ERROR_COUNT )
+	{
+		mSystemErrors[ ec.value() ].fetch_add( 1, std::memory_order_relaxed );
+	}
+	else if( ec.category() == boost::asio::error::get_misc_category() && ec.value() >= 0 && ec.value() < MISC_ERROR_COUNT )
+	{
+		mMiscErrors[ ec.value() ].fetch_add( 1, std::memory_order_relaxed );
+	}
+	else
+	{
+		mOtherErrors.fetch_add( 1, std::memory_order_relaxed );
+	}
+}
+
+void HiveMetrics::recordSendLatency( uint64_t nanos )
+{
+	mSendLatency.record( nanos );
+}
+
+void HiveMetrics::recordHandlerTime( uint64_t nanos )
+{
+	mHandlerTime.record( nanos );
+}
+
+MetricsSnapshot HiveMetrics::getSnapshot() const
+{
+	MetricsSnapshot snapshot = Metrics::getSnapshot();
+	for( int32_t i = 0; i < SYSTEM_ERROR_COUNT; ++i )
+	{
+		uint64_t count = mSystemErrors[ i ].load( std::memory_order_relaxed );
+		if( count > 0 )
+		{
+			snapshot.errorCounts[ boost::system::error_code( i, boost::asio::error::get_system_category() ) ] = count;
+		}
+	}
+	for( int32_t i = 0; i < MISC_ERROR_COUNT; ++i )
+	{
+		uint64_t count = mMiscErrors[ i ].load( std::memory_order_relaxed );
+		if( count > 0 )
+		{
+			snapshot.errorCounts[ boost::system::error_code( i, boost::asio::error::get_misc_category() ) ] = count;
+		}
+	}
+	// Errors of any other category are reported under a default constructed
+	// error code.
+	uint64_t otherCount = mOtherErrors.load( std::memory_order_relaxed );
+	if( otherCount > 0 )
+	{
+		snapshot.errorCounts[ boost::system::error_code() ] = otherCount;
+	}
+	snapshot.sendLatency = mSendLatency.getSnapshot();
+	snapshot.handlerTime = mHandlerTime.getSnapshot();
+	return snapshot;
+}
+
+//-----------------------------------------------------------------------------
+
+std::atomic< bool > Tracer::sEnabled( false );
+std::atomic< size_t > Tracer::sBufferEvents( 32768 );
+std::mutex Tracer::sMutex;
+std::vector< boost::shared_ptr< Tracer::Buffer > > Tracer::sBuffers;
+thread_local Tracer::ThreadBuffer Tracer::sThreadBuffer;
+thread_local std::string Tracer::sThreadName;
+
+Tracer::Event::Event()
+: mSequence( 0 ), mName( 0 ), mTime( 0 ), mDuration( 0 ), mObject( 0 ), mValue( 0 ), mPhase( 0 )
+{
+}
+
+Tracer::Buffer::Buffer( size_t events, uint32_t threadId, const std::string & name )
+: mEvents( std::max( events, static_cast< size_t >( 1 ) ) ), mCount( 0 ), mBase( 0 ), mName( name ), mThreadId( threadId ), mExited( false )
+{
+}
+
+Tracer::ThreadBuffer::ThreadBuffer()
+: mBuffer( 0 )
+{
+}
+
+Tracer::ThreadBuffer::~ThreadBuffer()
+{
+	if( mBuffer )
+	{
+		std::lock_guard< std::mutex > lock( sMutex );
+		mBuffer->mExited = true;
+	}
+}
+
+Tracer::Buffer & Tracer::getBuffer()
+{
+	if( !sThreadBuffer.mBuffer )
+	{
+		// Buffers are kept by the registry, so the events of a thread that
+		// has exited still show up in the next dump. Once they have been
+		// written or cleared its slot goes to the next new thread, so
+		// threads that come and go do not grow the registry.
+		std::lock_guard< std::mutex > lock( sMutex );
+		size_t index = 0;
+		while( index < sBuffers.size() && !( sBuffers[ index ]->mExited && sBuffers[ index ]->mCount.load( std::memory_order_relaxed ) == sBuffers[ index ]->mBase.load( std::memory_order_relaxed ) ) )
+		{
+			++index;
+		}
+		uint32_t threadId = static_cast< uint32_t >( index + 1 );
+		std::string name = sThreadName.empty() ? "thread " + boost::lexical_cast< std::string >( threadId ) : sThreadName;
+		boost::shared_ptr< Buffer > buffer = boost::make_shared< Buffer >( sBufferEvents.load( std::memory_order_relaxed ), threadId, name );
+		if( index < sBuffers.size() )
+		{
+			sBuffers[ index ] = buffer;
+		}
+		else
+		{
+			sBuffers.push_back( buffer );
+		}
+		sThreadBuffer.mBuffer = buffer.get();
+	}
+	return *sThreadBuffer.mBuffer;
+}
+
+void Tracer::record( const char * name, char phase, uint64_t time, uint64_t duration, const void * object, uint64_t value )
+{
+	Buffer & buffer = getBuffer();
+	uint64_t index = buffer.mCount.load( std::memory_order_relaxed );
+	Event & event = buffer.mEvents[ index % buffer.mEvents.size() ];
+	event.mSequence.store( 0, std::memory_order_relaxed );
+	std::atomic_thread_fence( std::memory_order_release );
+	event.mName.store( name, std::memory_order_relaxed );
+	event.mTime.store( time, std::memory_order_relaxed );
+	event.mDuration.store( duration, std::memory_order_relaxed );
+	event.mObject.store( reinterpret_cast< uintptr_t >( object ), std::memory_order_relaxed );
+	event.mValue.store( value, std::memory_order_relaxed );
+	event.mPhase.store( phase, std::memory_order_relaxed );
+	event.mSequence.store( index + 1, std::memory_order_release );
+	buffer.mCount.store( index + 1, std::memory_order_release );
+}
+
+std::string Tracer::formatMicros( uint64_t nanos )
+{
+	char text[ 32 ];
+	std::snprintf( text, sizeof( text ), "%llu.%03llu", static_cast< unsigned long long >( nanos / 1000 ), static_cast< unsigned long long >( nanos % 1000 ) );
+	return text;
+}
+
+void Tracer::setEnabled( bool enabled )
+{
+	sEnabled.store( enabled, std::memory_order_relaxed );
+}
+
+void Tracer::setBufferEvents( size_t events )
+{
+	sBufferEvents.store( events, std::memory_order_relaxed );
+}
+
+size_t Tracer::getBufferEvents()
+{
+	return sBufferEvents.load( std::memory_order_relaxed );
+}
+
+void Tracer::setThreadName( const std::string & name )
+{
+	sThreadName = name;
+	if( sThreadBuffer.mBuffer )
+	{
+		std::lock_guard< std::mutex > lock( sMutex );
+		sThreadBuffer.mBuffer->mName = name;
+	}
+}
+
+void Tracer::instant( const char * name, const void * object, uint64_t value )
+{
+	if( isEnabled() )
+	{
+		record( name, 'i', Metrics::now(), 0, object, value );
+	}
+}
+
+void Tracer::span( const char * name, uint64_t begin, uint64_t end, const void * object, uint64_t value )
+{
+	if( isEnabled() )
+	{
+		record( name, 'X', begin, end - begin, object, value );
+	}
+}
+
+void Tracer::asyncSpan( const char * name, uint64_t begin, uint64_t end, const void * object )
+{
+	if( isEnabled() )
+	{
+		record( name, 'b', begin, end - begin, object, 0 );
+	}
+}
+
+void Tracer::clear()
+{
+	std::lock_guard< std::mutex > lock( sMutex );
+	for( size_t i = 0; i < sBuffers.size(); ++i )
+	{
+		sBuffers[ i ]->mBase.store( sBuffers[ i ]->mCount.load( std::memory_order_acquire ), std::memory_order_relaxed );
+	}
+}
+
+void Tracer::write( std::ostream & stream )
+{
+	std::lock_guard< std::mutex > lock( sMutex );
+	stream << "{\"traceEvents\":[";
+	bool first = true;
+	for( size_t i = 0; i < sBuffers.size(); ++i )
+	{
+		Buffer & buffer = *sBuffers[ i ];
+		std::string tid = boost::lexical_cast< std::string >( buffer.mThreadId );
+        
+		std::string name;
+		for( size_t j = 0; j < buffer.mName.size(); ++j )
+		{
+			char c = buffer.mName[ j ];
+			if( c == '"' || c == '\\' )
+			{
+				name += '\\';
+			}
+			name += static_cast< unsigned char >( c ) < 0x20 ? ' ' : c;
+		}
+		stream << ( first ? "" : "," ) << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << tid << ",\"args\":{\"name\":\"" << name << "\"}}";
+		first = false;
+        
+		uint64_t capacity = buffer.mEvents.size();
+		uint64_t end = buffer.mCount.load( std::memory_order_acquire );
+		uint64_t begin = std::max( buffer.mBase.load( std::memory_order_relaxed ), end > capacity ? end - capacity : 0 );
+		for( uint64_t index = begin; index < end; ++index )
+		{
+			// A slot is kept only if it holds the expected event before and
+			// after it is copied.
+			Event & event = buffer.mEvents[ index % capacity ];
+			if( event.mSequence.load( std::memory_order_acquire ) != index + 1 )
+			{
+				continue;
+			}
+			const char * eventName = event.mName.load( std::memory_order_relaxed );
+			uint64_t time = event.mTime.load( std::memory_order_relaxed );
+			uint64_t duration = event.mDuration.load( std::memory_order_relaxed );
+			uint64_t objectId = event.mObject.load( std::memory_order_relaxed );
+			uint64_t value = event.mValue.load( std::memory_order_relaxed );
+			char phase = event.mPhase.load( std::memory_order_relaxed );
+			std::atomic_thread_fence( std::memory_order_acquire );
+			if( event.mSequence.load( std::memory_order_relaxed ) != index + 1 )
+			{
+				continue;
+			}
+            
+			char object[ 24 ];
+			std::snprintf( object, sizeof( object ), "0x%llx", static_cast< unsigned long long >( objectId ) );
+			std::string common = std::string( "{\"name\":\"" ) + eventName + "\",\"cat\":\"network\",\"pid\":1,\"tid\":" + tid;
+			switch( phase )
+			{
+			case 'X':
+				stream << ",\n" << common << ",\"ph\":\"X\",\"ts\":" << formatMicros( time ) << ",\"dur\":" << formatMicros( duration ) << ",\"args\":{\"object\":\"" << object << "\",\"value\":" << value << "}}";
+				break;
+			case 'i':
+				stream << ",\n" << common << ",\"ph\":\"i\",\"s\":\"t\",\"ts\":" << formatMicros( time ) << ",\"args\":{\"object\":\"" << object << "\",\"value\":" << value << "}}";
+				break;
+			case 'b':
+				// Async spans pair up by name and id, so spans of one object
+				// stack on their own track.
+				stream << ",\n" << common << ",\"ph\":\"b\",\"id\":\"" << object << "\",\"ts\":" << formatMicros( time ) << "}";
+				stream << ",\n" << common << ",\"ph\":\"e\",\"id\":\"" << object << "\",\"ts\":" << formatMicros( time + duration ) << "}";
+				break;
+			}
+		}
+		if( buffer.mExited )
+		{
+			// The thread is gone and its events are written, the buffer can
+			// go to a new thread.
+			buffer.mBase.store( end, std::memory_order_relaxed );
+		}
+	}
+	stream << "\n],\"displayTimeUnit\":\"ns\"}\n";
+}
+
+bool Tracer::dump( const std::string & path )
+{
+	std::ofstream stream( path.c_str(), std::ios::out | std::ios::trunc );
+	if( !stream )
+	{
+		return false;
+	}
+	write( stream );
+	stream.close();
+	return !stream.fail();
+}
+
+//-----------------------------------------------------------------------------
+
+HostResolver::Entry::Entry()
+: mExpiry( 0 ), mResolving( false )
+{
+}
+
+//-----------------------------------------------------------------------------
+
+HostResolver::HostResolver( boost::asio::io_service & service )
+: mIoService( service ), mResolver( service ), mTtl( 60000 ), mNegativeTtl( 5000 ), mMaxEntries( 1024 ), mLookupCount( 0 ), mHitCount( 0 )
+{
+}
+
+HostResolver::~HostResolver()
+{
+	mResolver.cancel();
+}
+
+uint64_t HostResolver::now()
+{
+	return static_cast< uint64_t >( std::chrono::duration_cast< std::chrono::milliseconds >( std::chrono::steady_clock::now().time_since_epoch() ).count() );
+}
+
+std::string HostResolver::getKey( const std::string & host )
+{
+	std::string key( host );
+	std::transform( key.begin(), key.end(), key.begin(), ::tolower );
+	return key;
+}
+
+void HostResolver::purge( uint64_t time )
+{
+	std::map< std::string, Entry >::iterator itr = mEntries.begin();
+	while( itr != mEntries.end() )
+	{
+		if( !itr->second.mResolving && itr->second.mExpiry <= time )
+		{
+			mEntries.erase( itr++ );
+		}
+		else
+		{
+			++itr;
+		}
+	}
+}
+
+void HostResolver::makeRoom( uint64_t time )
+{
+	purge( time );
+	while( !mEntries.empty() && mEntries.size() >= mMaxEntries )
+	{
+		// Drop the entry closest to expiring. Entries being resolved hold
+		// waiters and are kept.
+		std::map< std::string, Entry >::iterator soonest = mEntries.end();
+		for( std::map< std::string, Entry >::iterator itr = mEntries.begin(); itr != mEntries.end(); ++itr )
+		{
+			if( !itr->second.mResolving && ( soonest == mEntries.end() || itr->second.mExpiry < soonest->second.mExpiry ) )
+			{
+				soonest = itr;
+			}
+		}
+		if( soonest == mEntries.end() )
+		{
+			break;
+		}
+		mEntries.erase( soonest );
+	}
+}
+
+void HostResolver::startLookup( const std::string & key )
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	if( mLookup )
+	{
+		mIoService.post( boost::bind( &HostResolver::dispatchLookup, shared_from_this(), key ) );
+	}
+	else
+	{
+		// Asio runs the blocking getaddrinfo on a thread of its own.
+		boost::asio::ip::tcp::resolver::query query( key, "" );
+		mResolver.async_resolve( query, boost::bind( &HostResolver::handleLookup, shared_from_this(), _1, _2, key ) );
+	}
+}
+
+void HostResolver::dispatchLookup( const std::string & key )
+{
+	Lookup lookup;
+	{
+		std::lock_guard< std::mutex > lock( mMutex );
+		lookup = mLookup;
+	}
+	boost::system::error_code ec;
+	std::vector< boost::asio::ip::address > addresses;
+	if( lookup )
+	{
+		addresses = lookup( key, ec );
+	}
+	else
+	{
+		ec = boost::asio::error::operation_aborted;
+	}
+	finishLookup( key, ec, addresses );
+}
+
+void HostResolver::handleLookup( const boost::system::error_code & error, boost::asio::ip::tcp::resolver::iterator iterator, const std::string & key )
+{
+	std::vector< boost::asio::ip::address > addresses;
+	if( !error )
+	{
+		for( boost::asio::ip::tcp::resolver::iterator end; iterator != end; ++iterator )
+		{
+			boost::asio::ip::address address = iterator->endpoint().address();
+			if( std::find( addresses.begin(), addresses.end(), address ) == addresses.end() )
+			{
+				addresses.push_back( address );
+			}
+		}
+	}
+	finishLookup( key, error, addresses );
+}
+
+void HostResolver::finishLookup( const std::string & key, const boost::system::error_code & error, const std::vector< boost::asio::ip::address > & addresses )
+{
+	boost::system::error_code ec = error;
+	if( !ec && addresses.empty() )
+	{
+		ec = boost::asio::error::host_not_found;
+	}
+	std::vector< Callback > waiters;
+	{
+		std::lock_guard< std::mutex > lock( mMutex );
+		Entry & entry = mEntries[ key ];
+		entry.mAddresses = addresses;
+		entry.mError = ec;
+		entry.mExpiry = now() + static_cast< uint64_t >( std::max( ec ? mNegativeTtl : mTtl, 0 ) );
+		entry.mResolving = false;
+		waiters.swap( entry.mWaiters );
+	}
+	for( size_t i = 0; i < waiters.size(); ++i )
+	{
+		waiters[ i ]( ec, addresses );
+	}
+}
+
+void HostResolver::resolve( const std::string & host, const Callback & callback )
+{
+	boost::system::error_code ec;
+	boost::asio::ip::address numeric = boost::asio::ip::address::from_string( host, ec );
+	if( !ec )
+	{
+		mIoService.post( boost::bind( callback, boost::system::error_code(), std::vector< boost::asio::ip::address >( 1, numeric ) ) );
+		return;
+	}
+    
+	std::string key = getKey( host );
+	{
+		std::lock_guard< std::mutex > lock( mMutex );
+		std::map< std::string, std::vector< boost::asio::ip::address > >::iterator hostEntry = mHostEntries.find( key );
+		if( hostEntry != mHostEntries.end() )
+		{
+			mIoService.post( boost::bind( callback, boost::system::error_code(), hostEntry->second ) );
+			return;
+		}
+		uint64_t time = now();
+		std::map< std::string, Entry >::iterator itr = mEntries.find( key );
+		if( itr == mEntries.end() && mEntries.size() >= mMaxEntries )
+		{
+			makeRoom( time );
+		}
+		Entry & entry = mEntries[ key ];
+		if( !entry.mResolving && entry.mExpiry > time )
+		{
+			++mHitCount;
+			mIoService.post( boost::bind( callback, entry.mError, entry.mAddresses ) );
+			return;
+		}
+		entry.mWaiters.push_back( callback );
+		if( entry.mResolving )
+		{
+			return;
+		}
+		entry.mResolving = true;
+		++mLookupCount;
+	}
+	startLookup( key );
+}
+
+std::vector< boost::asio::ip::address > HostResolver::resolveNow( const std::string & host, bool allowLookup )
+{
+	boost::system::error_code ec;
+	boost::asio::ip::address numeric = boost::asio::ip::address::from_string( host, ec );
+	if( !ec )
+	{
+		return std::vector< boost::asio::ip::address >( 1, numeric );
+	}
+	ec.clear();
+    
+	std::string key = getKey( host );
+	Lookup lookup;
+	{
+		std::lock_guard< std::mutex > lock( mMutex );
+		std::map< std::string, std::vector< boost::asio::ip::address > >::iterator hostEntry = mHostEntries.find( key );
+		if( hostEntry != mHostEntries.end() )
+		{
+			return hostEntry->second;
+		}
+		std::map< std::string, Entry >::iterator itr = mEntries.find( key );
+		if( itr != mEntries.end() && !itr->second.mResolving && itr->second.mExpiry > now() )
+		{
+			++mHitCount;
+			if( itr->second.mError )
+			{
+				throw boost::system::system_error( itr->second.mError );
+			}
+			return itr->second.mAddresses;
+		}
+		if( !allowLookup )
+		{
+			throw boost::system::system_error( boost::asio::error::would_block );
+		}
+		lookup = mLookup;
+		++mLookupCount;
+	}
+    
+	std::vector< boost::asio::ip::address > addresses;
+	if( lookup )
+	{
+		addresses = lookup( key, ec );
+	}
+	else
+	{
+		boost::asio::ip::tcp::resolver resolver( mIoService );
+		boost::asio::ip::tcp::resolver::query query( key, "" );
+		boost::asio::ip::tcp::resolver::iterator iterator = resolver.resolve( query, ec );
+		for( boost::asio::ip::tcp::resolver::iterator end; !ec && iterator != end; ++iterator )
+		{
+			boost::asio::ip::address address = iterator->endpoint().address();
+			if( std::find( addresses.begin(), addresses.end(), address ) == addresses.end() )
+			{
+				addresses.push_back( address );
+			}
+		}
+	}
+	if( !ec && addresses.empty() )
+	{
+		ec = boost::asio::error::host_not_found;
+	}
+    
+	{
+		std::lock_guard< std::mutex > lock( mMutex );
+		if( mEntries.find( key ) == mEntries.end() && mEntries.size() >= mMaxEntries )
+		{
+			makeRoom( now() );
+		}
+		Entry & entry = mEntries[ key ];
+		if( !entry.mResolving )
+		{
+			entry.mAddresses = addresses;
+			entry.mError = ec;
+			entry.mExpiry = now() + static_cast< uint64_t >( std::max( ec ? mNegativeTtl : mTtl, 0 ) );
+		}
+	}
+	if( ec )
+	{
+		throw boost::system::system_error( ec );
+	}
+	return addresses;
+}
+
+void HostResolver::setHostEntry( const std::string & host, const std::vector< boost::asio::ip::address > & addresses )
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	mHostEntries[ getKey( host ) ] = addresses;
+}
+
+void HostResolver::removeHostEntry( const std::string & host )
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	mHostEntries.erase( getKey( host ) );
+}
+
+bool HostResolver::loadHostsFile( const std::string & path )
+{
+	std::ifstream file( path.c_str() );
+	if( !file )
+	{
+		return false;
+	}
+	std::string line;
+	while( std::getline( file, line ) )
+	{
+		line = line.substr( 0, line.find( '#' ) );
+		std::istringstream fields( line );
+		std::string field;
+		if( !( fields >> field ) )
+		{
+			continue;
+		}
+		boost::system::error_code ec;
+		boost::asio::ip::address address = boost::asio::ip::address::from_string( field, ec );
+		if( ec )
+		{
+			continue;
+		}
+		std::lock_guard< std::mutex > lock( mMutex );
+		while( fields >> field )
+		{
+			std::vector< boost::asio::ip::address > & addresses = mHostEntries[ getKey( field ) ];
+			if( std::find( addresses.begin(), addresses.end(), address ) == addresses.end() )
+			{
+				addresses.push_back( address );
+			}
+		}
+	}
+	return true;
+}
+
+void HostResolver::setLookup( const Lookup & lookup )
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	mLookup = lookup;
+}
+
+void HostResolver::setTtl( int32_t ttlMilli, int32_t negativeTtlMilli )
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	mTtl = ttlMilli;
+	mNegativeTtl = negativeTtlMilli;
+}
+
+int32_t HostResolver::getTtl()
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	return mTtl;
+}
+
+int32_t HostResolver::getNegativeTtl()
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	return mNegativeTtl;
+}
+
+void HostResolver::setMaxEntries( size_t maxEntries )
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	mMaxEntries = maxEntries;
+}
+
+void HostResolver::clear()
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	purge( std::numeric_limits< uint64_t >::max() );
+}
+
+size_t HostResolver::getCacheSize()
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	return mEntries.size();
+}
+
+uint64_t HostResolver::getLookupCount()
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	return mLookupCount;
+}
+
+uint64_t HostResolver::getHitCount()
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	return mHitCount;
+}
+
+//-----------------------------------------------------------------------------
+
+#if NETWORK_SHM
+
+ShmChannel::ShmChannel( boost::asio::io_service & service )
+: mSocket( service ), mSegment( 0 ), mSegmentBytes( 0 ), mRx( 0 ), mTx( 0 ), mRxData( 0 ), mTxData( 0 ), mRingBytes( 0 ), mOwner( false ), mPeerClosed( false )
+{
+	std::memset( mName, 0, sizeof( mName ) );
+}
+
+ShmChannel::~ShmChannel()
+{
+	close();
+}
+
+std::string ShmChannel::getPath( const std::string & name, uint16_t port, boost::system::error_code & ec )
+{
+	if( name.find_first_of( std::string( "/\0", 2 ) ) != std::string::npos )
+	{
+		ec = boost::asio::error::invalid_argument;
+		return std::string();
+	}
+    
+	// No other user may be able to place a socket where a listener is
+	// expected, so the directory has to be the user's own and closed to
+	// everyone else.
+	std::string directory;
+	const char * runtimeDirectory = std::getenv( "XDG_RUNTIME_DIR" );
+	if( runtimeDirectory != 0 && runtimeDirectory[ 0 ] == '/' )
+	{
+		directory = runtimeDirectory;
+	}
+	else
+	{
+		directory = "/tmp/network-" + boost::lexical_cast< std::string >( ::getuid() );
+		if( ::mkdir( directory.c_str(), 0700 ) != 0 && errno != EEXIST )
+		{
+			ec = boost::system::error_code( errno, boost::system::system_category() );
+			return std::string();
+		}
+	}
+	struct stat info;
+	if( ::lstat( directory.c_str(), &info ) != 0 )
+	{
+		ec = boost::system::error_code( errno, boost::system::system_category() );
+		return std::string();
+	}
+	if( !S_ISDIR( info.st_mode ) || info.st_uid != ::getuid() || ( info.st_mode & ( S_IRWXG | S_IRWXO ) ) != 0 )
+	{
+		ec = boost::asio::error::access_denied;
+		return std::string();
+	}
+    
+	std::string path = directory + "/network-" + name + "-" + boost::lexical_cast< std::string >( port ) + ".sock";
+	if( path.size() >= sizeof( sockaddr_un().sun_path ) )
+	{
+		ec = boost::asio::error::name_too_long;
+		return std::string();
+	}
+	return path;
+}
+
+void ShmChannel::removeSocket( const std::string & path )
+{
+	struct stat info;
+	if( ::lstat( path.c_str(), &info ) == 0 && S_ISSOCK( info.st_mode ) )
+	{
+		::unlink( path.c_str() );
+	}
+}
+
+void ShmChannel::map( int fd, size_t segmentBytes, boost::system::error_code & ec )
+{
+	void * memory = ::mmap( 0, segmentBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	if( memory == MAP_FAILED )
+	{
+		ec = boost::system::error_code( errno, boost::system::system_category() );
+		return;
+	}
+	mSegment = static_cast< Segment * >( memory );
+	mSegmentBytes = segmentBytes;
+	// Wakeups are written from the strand and must never block it.
+	mSocket.non_blocking( true, ec );
+}
+
+void ShmChannel::create( size_t ringBytes, boost::system::error_code & ec )
+{
+	static std::atomic< uint32_t > sSegmentCount( 0 );
+	std::snprintf( mName, NAME_SIZE, "/network-%d-%u", static_cast< int >( ::getpid() ), sSegmentCount.fetch_add( 1, std::memory_order_relaxed ) );
+	int fd = ::shm_open( mName, O_RDWR | O_CREAT | O_EXCL, 0600 );
+	if( fd < 0 )
+	{
+		ec = boost::system::error_code( errno, boost::system::system_category() );
+		return;
+	}
+	mOwner = true;
+    
+	// A new segment reads as zeros, which is an empty ring.
+	size_t segmentBytes = sizeof( Segment ) + 2 * ringBytes;
+	if( ::ftruncate( fd, static_cast< off_t >( segmentBytes ) ) != 0 )
+	{
+		ec = boost::system::error_code( errno, boost::system::system_category() );
+	}
+	else
+	{
+		map( fd, segmentBytes, ec );
+	}
+	::close( fd );
+	if( ec )
+	{
+		return;
+	}
+	mSegment->mRingBytes = ringBytes;
+	mRingBytes = ringBytes;
+	mTx = &mSegment->mRings[ 0 ];
+	mRx = &mSegment->mRings[ 1 ];
+	mTxData = reinterpret_cast< uint8_t * >( mSegment + 1 );
+	mRxData = mTxData + ringBytes;
+}
+
+void ShmChannel::open( boost::system::error_code & ec )
+{
+	mName[ NAME_SIZE - 1 ] = 0;
+	int fd = ::shm_open( mName, O_RDWR, 0 );
+	if( fd < 0 )
+	{
+		ec = boost::system::error_code( errno, boost::system::system_category() );
+		return;
+	}
+	// Both sides have it mapped now, the name is no longer needed.
+	::shm_unlink( mName );
+	struct stat status;
+	if( ::fstat( fd, &status ) != 0 )
+	{
+		ec = boost::system::error_code( errno, boost::system::system_category() );
+	}
+	else if( static_cast< size_t >( status.st_size ) < sizeof( Segment ) )
+	{
+		ec = boost::asio::error::invalid_argument;
+	}
+	else
+	{
+		map( fd, static_cast< size_t >( status.st_size ), ec );
+	}
+	::close( fd );
+	if( ec )
+	{
+		return;
+	}
+	mRingBytes = mSegment->mRingBytes;
+	// Some systems round the segment up to whole pages, so it may be
+	// larger than asked for.
+	if( mRingBytes == 0 || mRingBytes > ( mSegmentBytes - sizeof( Segment ) ) / 2 )
+	{
+		ec = boost::asio::error::invalid_argument;
+		return;
+	}
+	mRx = &mSegment->mRings[ 0 ];
+	mTx = &mSegment->mRings[ 1 ];
+	mRxData = reinterpret_cast< uint8_t * >( mSegment + 1 );
+	mTxData = mRxData + mRingBytes;
+}
+
+void ShmChannel::shutdown()
+{
+	if( mSegment )
+	{
+		mTx->mClosed.store( 1, std::memory_order_seq_cst );
+		if( mTx->mReaderWaiting.exchange( 0, std::memory_order_seq_cst ) )
+		{
+			wake();
+		}
+	}
+}
+
+void ShmChannel::close()
+{
+	boost::system::error_code ec;
+	mSocket.shutdown( boost::asio::local::stream_protocol::socket::shutdown_both, ec );
+	mSocket.close( ec );
+	if( mSegment )
+	{
+		::munmap( mSegment, mSegmentBytes );
+		mSegment = 0;
+	}
+	if( mOwner )
+	{
+		// The peer may never have opened the segment.
+		::shm_unlink( mName );
+		mOwner = false;
+	}
+}
+
+void ShmChannel::wake()
+{
+	// A full socket already holds wakeups the peer has not read yet.
+	uint8_t wakeup = 1;
+	boost::system::error_code ec;
+	mSocket.write_some( boost::asio::buffer( &wakeup, 1 ), ec );
+}
+
+size_t ShmChannel::read( uint8_t * data, size_t size, boost::system::error_code & ec )
+{
+	if( !mSegment )
+	{
+		return 0;
+	}
+	// The peer can write anything to the ring, so a fill level no ring can
+	// hold ends the connection rather than being copied.
+	uint64_t head = mRx->mHead.load( std::memory_order_relaxed );
+	uint64_t tail = mRx->mTail.load( std::memory_order_acquire );
+	if( tail < head || tail - head > mRingBytes )
+	{
+		ec = boost::asio::error::invalid_argument;
+		return 0;
+	}
+	size_t count = static_cast< size_t >( std::min< uint64_t >( size, tail - head ) );
+	if( count == 0 )
+	{
+		return 0;
+	}
+	size_t offset = static_cast< size_t >( head % mRingBytes );
+	size_t first = std::min( count, static_cast< size_t >( mRingBytes ) - offset );
+	std::memcpy( data, mRxData + offset, first );
+	std::memcpy( data + first, mRxData, count - first );
+    
+	// Publishing the head and checking the flag must not be reordered, or
+	// a writer starting to wait in between would never be woken.
+	mRx->mHead.store( head + count, std::memory_order_seq_cst );
+	if( mRx->mWriterWaiting.load( std::memory_order_seq_cst ) && mRx->mWriterWaiting.exchange( 0, std::memory_order_seq_cst ) )
+	{
+		wake();
+	}
+	return count;
+}
+
+size_t ShmChannel::write( const uint8_t * data, size_t size, boost::system::error_code & ec )
+{
+	if( !mSegment )
+	{
+		return 0;
+	}
+	uint64_t head = mTx->mHead.load( std::memory_order_acquire );
+	uint64_t tail = mTx->mTail.load( std::memory_order_relaxed );
+	if( tail < head || tail - head > mRingBytes )
+	{
+		ec = boost::asio::error::invalid_argument;
+		return 0;
+	}
+	size_t count = static_cast< size_t >( std::min< uint64_t >( size, mRingBytes - ( tail - head ) ) );
+	if( count == 0 )
+	{
+		return 0;
+	}
+	size_t offset = static_cast< size_t >( tail % mRingBytes );
+	size_t first = std::min( count, static_cast< size_t >( mRingBytes ) - offset );
+	std::memcpy( mTxData + offset, data, first );
+	std::memcpy( mTxData, data + first, count - first );
+	mTx->mTail.store( tail + count, std::memory_order_seq_cst );
+	if( mTx->mReaderWaiting.load( std::memory_order_seq_cst ) && mTx->mReaderWaiting.exchange( 0, std::memory_order_seq_cst ) )
+	{
+		wake();
+	}
+	return count;
+}
+
+bool ShmChannel::waitRead()
+{
+	if( !mSegment )
+	{
+		return true;
+	}
+	mRx->mReaderWaiting.store( 1, std::memory_order_seq_cst );
+	if( mRx->mClosed.load( std::memory_order_seq_cst ) || mRx->mTail.load( std::memory_order_seq_cst ) != mRx->mHead.load( std::memory_order_relaxed ) )
+	{
+		mRx->mReaderWaiting.store( 0, std::memory_order_relaxed );
+		return false;
+	}
+	return true;
+}
+
+bool ShmChannel::waitWrite()
+{
+	if( !mSegment )
+	{
+		return true;
+	}
+	mTx->mWriterWaiting.store( 1, std::memory_order_seq_cst );
+	if( mTx->mTail.load( std::memory_order_relaxed ) - mTx->mHead.load( std::memory_order_seq_cst ) < mRingBytes )
+	{
+		mTx->mWriterWaiting.store( 0, std::memory_order_relaxed );
+		return false;
+	}
+	return true;
+}
+
+bool ShmChannel::isDrained() const
+{
+	if( !mSegment )
+	{
+		return true;
+	}
+	// The flag first, data written before the shutdown is visible once the
+	// flag is.
+	bool closed = mPeerClosed || mRx->mClosed.load( std::memory_order_acquire );
+	return closed && mRx->mTail.load( std::memory_order_acquire ) == mRx->mHead.load( std::memory_order_relaxed );
+}
+
+void ShmChannel::setPeerClosed()
+{
+	mPeerClosed = true;
+}
+
+bool ShmChannel::isPeerClosed() const
+{
+	return mPeerClosed;
+}
+
+boost::asio::local::stream_protocol::socket & ShmChannel::getSocket()
+{
+	return mSocket;
+}
+
+boost::asio::mutable_buffers_1 ShmChannel::getNameBuffer()
+{
+	return boost::asio::buffer( mName, NAME_SIZE );
+}
+
+boost::asio::mutable_buffers_1 ShmChannel::getWakeBuffer()
+{
+	return boost::asio::buffer( mWakeBuffer, sizeof( mWakeBuffer ) );
+}
+
+#endif
+
+//-----------------------------------------------------------------------------
+
+#if NETWORK_SINGLE_THREADED
+
+// Holds the io_service of a Hive without workers for the calling thread
+// while it runs or polls. The thread holding it may enter again, as a
+// handler polling the Hive does.
+class Hive::ServiceClaim
+{
+private:
+	std::atomic< std::thread::id > &    mRunner;
+	bool                                mClaimed;
+	bool                                mEntered;
+    
+	ServiceClaim( const ServiceClaim & rhs );
+	ServiceClaim & operator =( const ServiceClaim & rhs );
+    
+public:
+	explicit ServiceClaim( std::atomic< std::thread::id > & runner )
+	: mRunner( runner )
+	{
+		std::thread::id runnerId;
+		mClaimed = mRunner.compare_exchange_strong( runnerId, std::this_thread::get_id(), std::memory_order_acquire );
+		mEntered = mClaimed || runnerId == std::this_thread::get_id();
+	}
+    
+	~ServiceClaim()
+	{
+		if( mClaimed )
+		{
+			mRunner.store( std::thread::id(), std::memory_order_release );
+		}
+	}
+    
+	bool hasEntered() const
+	{
+		return mEntered;
+	}
+};
+
+#endif
+
+//-----------------------------------------------------------------------------
+
+Hive::Hive()
+: mRecvPool( new RecvBufferPool() ), mNextService( 0 ), mOwnsWorkers( false ), mPinWorkers( false ), mShutdown( false )
+{
+	mIoServices.push_back( boost::shared_ptr< boost::asio::io_service >( new boost::asio::io_service() ) );
+	mWorkPtrs.push_back( boost::shared_ptr< boost::asio::io_service::work >( new boost::asio::io_service::work( *mIoServices.back() ) ) );
+	mTimerWheels.push_back( boost::shared_ptr< TimerWheel >( new TimerWheel( *mIoServices.back() ) ) );
+	mMetrics.push_back( boost::shared_ptr< HiveMetrics >( new HiveMetrics() ) );
+	mResolver.reset( new HostResolver( *mIoServices.front() ) );
+}
+
+Hive::Hive( uint32_t workerCount, bool pinWorkers )
+: mNextService( 0 ), mOwnsWorkers( true ), mPinWorkers( pinWorkers ), mShutdown( false )
+{
+	if( workerCount == 0 )
+	{
+		workerCount = std::max( std::thread::hardware_concurrency(), 1u );
+	}
+	for( uint32_t i = 0; i < workerCount; ++i )
+	{
+		// A concurrency hint of 1 tells asio that only one thread runs each
+		// io_service, which lets it hand completions straight back to that
+		// thread. Its internal locking stays in place.
+		mIoServices.push_back( boost::shared_ptr< boost::asio::io_service >( new boost::asio::io_service( 1 ) ) );
+		mWorkPtrs.push_back( boost::shared_ptr< boost::asio::io_service::work >( new boost::asio::io_service::work( *mIoServices.back() ) ) );
+		mTimerWheels.push_back( boost::shared_ptr< TimerWheel >( new TimerWheel( *mIoServices.back() ) ) );
+		mMetrics.push_back( boost::shared_ptr< HiveMetrics >( new HiveMetrics() ) );
+	}
+	mRecvPool.reset( new RecvBufferPool( 4096, 1024, mIoServices.size() ) );
+	mResolver.reset( new HostResolver( *mIoServices.front() ) );
+	startWorkers();
+}
+
+Hive::~Hive()
+{
+	if( !hasStopped() )
+	{
+		joinWorkers();
+	}
+}
+
+void Hive::startWorkers()
+{
+	if( mOwnsWorkers )
+	{
+		for( size_t i = 0; i < mIoServices.size(); ++i )
+		{
+			Worker worker;
+			worker.mIoService = mIoServices[ i ];
+			worker.mTimerWheel = mTimerWheels[ i ];
+			worker.mIndex = i;
+			worker.mPin = mPinWorkers;
+			mWorkers.push_back( std::thread( boost::bind( &Hive::runWorker, worker ) ) );
+		}
+	}
+}
+
+void Hive::joinWorkers()
+{
+	for( size_t i = 0; i < mWorkPtrs.size(); ++i )
+	{
+		mWorkPtrs[ i ].reset();
+	}
+	for( size_t i = 0; i < mWorkers.size(); ++i )
+	{
+		// The last reference to the Hive may be released by a handler on one
+		// of its own workers, which cannot join itself. It finishes on the
+		// io_service and timer wheel it holds on to.
+		if( mWorkers[ i ].get_id() == std::this_thread::get_id() )
+		{
+			mWorkers[ i ].detach();
+		}
+		else
+		{
+			mWorkers[ i ].join();
+		}
+	}
+	mWorkers.clear();
+}
+
+void Hive::runWorker( const Worker & worker )
+{
+	if( worker.mPin )
+	{
+		uint32_t cpu = static_cast< uint32_t >( worker.mIndex % std::max( std::thread::hardware_concurrency(), 1u ) );
+#if defined( __linux__ )
+		cpu_set_t cpuSet;
+		CPU_ZERO( &cpuSet );
+		CPU_SET( cpu, &cpuSet );
+		pthread_setaffinity_np( pthread_self(), sizeof( cpuSet ), &cpuSet );
+#elif defined( __APPLE__ )
+		// OS X has no hard affinity, threads with distinct tags are only
+		// kept apart by the scheduler.
+		thread_affinity_policy_data_t policy = { static_cast< integer_t >( cpu + 1 ) };
+		thread_policy_set( pthread_mach_thread_np( pthread_self() ), THREAD_AFFINITY_POLICY, reinterpret_cast< thread_policy_t >( &policy ), THREAD_AFFINITY_POLICY_COUNT );
+#endif
+	}
+	NETWORK_TRACE( Tracer::setThreadName( "network worker " + boost::lexical_cast< std::string >( worker.mIndex ) ); )
+	worker.mIoService->run();
+}
+
+boost::asio::io_service & Hive::getService()
+{
+	return *mIoServices.front();
+}
+
+boost::asio::io_service & Hive::getService( size_t index )
+{
+	return *mIoServices[ index ];
+}
+
+size_t Hive::getServiceCount() const
+{
+	return mIoServices.size();
+}
+
+boost::asio::io_service & Hive::getNextService()
+{
+	if( mIoServices.size() == 1 )
+	{
+		return *mIoServices.front();
+	}
+	return *mIoServices[ mNextService.fetch_add( 1, std::memory_order_relaxed ) % mIoServices.size() ];
+}
+
+boost::asio::io_service & Hive::getServiceForKey( size_t affinityKey )
+{
+	return *mIoServices[ affinityKey % mIoServices.size() ];
+}
+
+bool Hive::ownsWorkers() const
+{
+	return mOwnsWorkers;
+}
+
+bool Hive::runsInThisThread() const
+{
+	for( size_t i = 0; i < mIoServices.size(); ++i )
+	{
+		if( mIoServices[ i ]->get_executor().running_in_this_thread() )
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+size_t Hive::getServiceIndex( boost::asio::io_service & service ) const
+{
+	for( size_t i = 0; i < mIoServices.size(); ++i )
+	{
+		if( mIoServices[ i ].get() == &service )
+		{
+			return i;
+		}
+	}
+	return 0;
+}
+
+TimerWheel & Hive::getTimerWheel( boost::asio::io_service & service )
+{
+	return *mTimerWheels[ getServiceIndex( service ) ];
+}
+
+HiveMetrics & Hive::getHiveMetrics( boost::asio::io_service & service )
+{
+	return *mMetrics[ getServiceIndex( service ) ];
+}
+
+HostResolver & Hive::getResolver()
+{
+	return *mResolver;
+}
+
+MetricsSnapshot Hive::getMetrics() const
+{
+	MetricsSnapshot snapshot;
+	for( size_t i = 0; i < mMetrics.size(); ++i )
+	{
+		snapshot.merge( mMetrics[ i ]->getSnapshot() );
+	}
+	return snapshot;
+}
+
+boost::shared_ptr< RecvBufferPool > Hive::getRecvPool()
+{
+	return mRecvPool;
+}
+
+bool Hive::hasStopped()
+{
+	return mShutdown.load( std::memory_order_acquire );
+}
+
+void Hive::poll()
+{
+	if( mOwnsWorkers )
+	{
+		return;
+	}
+#if NETWORK_SINGLE_THREADED
+	ServiceClaim claim( mRunner );
+	if( !claim.hasEntered() )
+	{
+		throw std::logic_error( "a single threaded hive is already run by another thread" );
+	}
+#endif
+	for( size_t i = 0; i < mIoServices.size(); ++i )
+	{
+		mIoServices[ i ]->poll();
+	}
+}
+
+void Hive::run()
+{
+	if( mOwnsWorkers )
+	{
+		return;
+	}
+#if NETWORK_SINGLE_THREADED
+	ServiceClaim claim( mRunner );
+	if( !claim.hasEntered() )
+	{
+		throw std::logic_error( "a single threaded hive is already run by another thread" );
+	}
+#endif
+	mIoServices.front()->run();
+}
+
+void Hive::stop()
+{
+	if( !mShutdown.exchange( true, std::memory_order_acq_rel ) )
+	{
+		if( mOwnsWorkers )
+		{
+			// The workers drain their io_services once the work objects are
+			// gone, then exit.
+			joinWorkers();
+		}
+		else
+		{
+			mWorkPtrs.front().reset();
+#if NETWORK_SINGLE_THREADED
+			// Draining next to the thread running the io_service would race
+			// its handlers.
+			ServiceClaim claim( mRunner );
+			if( claim.hasEntered() )
+#endif
+			{
+				mIoServices.front()->run();
+			}
+		}
+		for( size_t i = 0; i < mIoServices.size(); ++i )
+		{
+			mIoServices[ i ]->stop();
+		}
+	}
+}
+
+void Hive::reset()
+{
+	if( mShutdown.exchange( false, std::memory_order_acq_rel ) )
+	{
+		for( size_t i = 0; i < mIoServices.size(); ++i )
+		{
+			mIoServices[ i ]->reset();
+			mWorkPtrs[ i ].reset( new boost::asio::io_service::work( *mIoServices[ i ] ) );
+		}
+		startWorkers();
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+#if defined( SO_REUSEPORT )
+typedef BooleanSocketOption< SOL_SOCKET, SO_REUSEPORT > ReusePortOption;
+#endif
+
+Acceptor::Listener::Listener( boost::asio::io_service & service, size_t affinityKey )
+: mAcceptor( service ), mStrand( service ), mAffinityKey( affinityKey )
+{
+}
+
+//-----------------------------------------------------------------------------
+
+Acceptor::Acceptor( boost::shared_ptr< Hive > hive )
+: Acceptor( hive, hive->getNextService() )
+{
+}
+
+Acceptor::Acceptor( boost::shared_ptr< Hive > hive, size_t affinityKey )
+: Acceptor( hive, hive->getServiceForKey( affinityKey ) )
+{
+}
+
+Acceptor::Acceptor( boost::shared_ptr< Hive > hive, boost::asio::io_service & service )
+: mHive( hive ), mIoService( service ), mAcceptor( mIoService ), mIoStrand( mIoService ), mTimerWheel( hive->getTimerWheel( mIoService ) ), mTimerEntry( &Acceptor::dispatchTimer ),  mTimerInterval( 1000 ), mBackoffEntry( &Acceptor::dispatchBackoff ), mAcceptBacklog( 0 ), mReusePort( false ), mErrorState( false )
+{
+	NETWORK_METRIC( mHiveMetrics = &hive->getHiveMetrics( mIoService ); )
+}
+
+Acceptor::~Acceptor()
+{
+	mTimerWheel.cancel( mTimerEntry );
+	mTimerWheel.cancel( mBackoffEntry );
+}
+
+void Acceptor::startAccept( size_t listener )
+{
+	if( hasError() || mHive->hasStopped() )
+	{
+		return;
+	}
+	// Listener 0 is the acceptor itself, the others are the additional
+	// SO_REUSEPORT listeners.
+	boost::asio::ip::tcp::acceptor & acceptor = ( listener == 0 ) ? mAcceptor : mListeners[ listener - 1 ]->mAcceptor;
+	size_t affinityKey = ( listener == 0 ) ? mHive->getServiceIndex( mIoService ) : mListeners[ listener - 1 ]->mAffinityKey;
+	boost::shared_ptr< Connection > connection = mConnectionFactory( mHive, affinityKey );
+#if NETWORK_SHM
+	if( mShmAcceptor )
+	{
+		startShmAccept( connection, static_cast< int32_t >( listener ) );
+		return;
+	}
+#endif
+	acceptor.async_accept( connection->getSocket(), connection->getStrand().wrap( makeAllocHandler( connection->getHandlerAllocator(), boost::bind( &Acceptor::handleAccept, shared_from_this(), _1, connection, static_cast< int32_t >( listener ) ) ) ) );
+}
+
+void Acceptor::startTimer()
+{
+	mTimerWheel.schedule( mTimerEntry, shared_from_this(), mTimerInterval );
+	mLastTime = mTimerWheel.getTime();
+}
+
+void Acceptor::startError( const boost::system::error_code & error )
+{
+	if( !mErrorState.exchange( true, std::memory_order_acq_rel ) )
+	{
+		boost::system::error_code ec;
+		mAcceptor.cancel( ec );
+		mAcceptor.close( ec );
+		for( size_t i = 0; i < mListeners.size(); ++i )
+		{
+			mListeners[ i ]->mStrand.post( makeAllocHandler( mHandlerAllocator, boost::bind( &Acceptor::dispatchClose, shared_from_this(), i + 1 ) ) );
+		}
+#if NETWORK_SHM
+		if( mShmAcceptor )
+		{
+			mShmAcceptor->close( ec );
+			ShmChannel::removeSocket( mShmPath );
+		}
+#endif
+		mTimerWheel.cancel( mTimerEntry );
+		mTimerWheel.cancel( mBackoffEntry );
+		if( error )
+		{
+			NETWORK_METRIC( mHiveMetrics->addError( error ); )
+		}
+		onError( error );
+	}
+}
+
+void Acceptor::postAccept( size_t listener )
+{
+	if( listener == 0 )
+	{
+		mIoStrand.post( makeAllocHandler( mHandlerAllocator, boost::bind( &Acceptor::startAccept, shared_from_this(), listener ) ) );
+	}
+	else
+	{
+		mListeners[ listener - 1 ]->mStrand.post( makeAllocHandler( mHandlerAllocator, boost::bind( &Acceptor::startAccept, shared_from_this(), listener ) ) );
+	}
+}
+
+void Acceptor::restartAccept( const boost::system::error_code & error, int32_t listener )
+{
+	// Accepts made through the connection factory replace themselves
+	// whatever became of them, so a failed accept never costs the listener
+	// a backlog slot.
+	if( listener < 0 || error == boost::asio::error::operation_aborted || hasError() || mHive->hasStopped() )
+	{
+		return;
+	}
+	if( error == boost::asio::error::no_descriptors || error == boost::system::errc::too_many_files_open_in_system ||
+		error == boost::asio::error::no_buffer_space || error == boost::asio::error::no_memory )
+	{
+		std::lock_guard< std::mutex > lock( mBackoffMutex );
+		if( mBackoffListeners.empty() )
+		{
+			mTimerWheel.schedule( mBackoffEntry, shared_from_this(), ACCEPT_BACKOFF_MILLI );
+		}
+		mBackoffListeners.push_back( static_cast< size_t >( listener ) );
+		return;
+	}
+	postAccept( static_cast< size_t >( listener ) );
+}
+
+void Acceptor::dispatchBackoff( const boost::shared_ptr< void > & owner )
+{
+	boost::shared_ptr< Acceptor > acceptor = boost::static_pointer_cast< Acceptor >( owner );
+	std::vector< size_t > listeners;
+	{
+		std::lock_guard< std::mutex > lock( acceptor->mBackoffMutex );
+		listeners.swap( acceptor->mBackoffListeners );
+	}
+	for( size_t i = 0; i < listeners.size(); ++i )
+	{
+		acceptor->postAccept( listeners[ i ] );
+	}
+}
+
+void Acceptor::dispatchAccept( boost::shared_ptr< Connection > connection )
+{
+#if NETWORK_SHM
+	if( mShmAcceptor )
+	{
+		startShmAccept( connection, -1 );
+		return;
+	}
+#endif
+	mAcceptor.async_accept( connection->getSocket(), connection->getStrand().wrap( makeAllocHandler( connection->getHandlerAllocator(), boost::bind( &Acceptor::handleAccept, shared_from_this(), _1, connection, -1 ) ) ) );
+}
+
+void Acceptor::dispatchClose( size_t listener )
+{
+	boost::system::error_code ec;
+	mListeners[ listener - 1 ]->mAcceptor.cancel( ec );
+	mListeners[ listener - 1 ]->mAcceptor.close( ec );
+}
+
+void Acceptor::dispatchTimer( const boost::shared_ptr< void > & owner )
+{
+	boost::shared_ptr< Acceptor > acceptor = boost::static_pointer_cast< Acceptor >( owner );
+	acceptor->mIoStrand.post( makeAllocHandler( acceptor->mHandlerAllocator, boost::bind( &Acceptor::handleTimer, acceptor, boost::system::error_code() ) ) );
+}
+
+void Acceptor::handleTimer( const boost::system::error_code & error )
+{
+	NETWORK_METRIC( HandlerTimer handlerTimer( *mHiveMetrics ); )
+	NETWORK_TRACE( TraceScope traceScope( "Acceptor::handleTimer", this ); )
+	if( error || hasError() || mHive->hasStopped() )
+	{
+		startError( error );
+	}
+	else
+	{
+		onTimer( mTimerWheel.getElapsed( mLastTime ) );
+		startTimer();
+	}
+}
+
+void Acceptor::handleAccept( const boost::system::error_code & error, boost::shared_ptr< Connection > connection, int32_t listener )
+{
+	NETWORK_METRIC( HandlerTimer handlerTimer( *mHiveMetrics ); )
+	NETWORK_TRACE( TraceScope traceScope( "Acceptor::handleAccept", this ); )
+	if( error || hasError() || mHive->hasStopped() )
+	{
+		connection->startError( error );
+	}
+	else
+	{
+		if( connection->getSocket().is_open() )
+		{
+			// A peer can reset between the accept and here, which must end
+			// that connection rather than throw out of a worker thread.
+			boost::system::error_code ec;
+			// The listening socket belongs to the acceptor's strand, so the
+			// local endpoint is the one Listen bound.
+			boost::asio::ip::tcp::endpoint remote = connection->getSocket().remote_endpoint( ec );
+			const boost::asio::ip::tcp::endpoint & local = mLocalEndpoint;
+			if( ec )
+			{
+				connection->startError( ec );
+			}
+			else
+			{
+				NETWORK_METRIC( mHiveMetrics->addAccept(); )
+				connection->applySocketOptions( connection->getSocket() );
+				connection->startOpen();
+				connection->startTimer();
+				if( onAccept( connection, remote.address().to_string(), remote.port() ) )
+				{
+					connection->onAccept( local.address().to_string(), local.port() );
+				}
+			}
+		}
+		else
+		{
+			// This runs on the connection's strand, the acceptor is torn
+			// down on its own.
+			mIoStrand.post( makeAllocHandler( mHandlerAllocator, boost::bind( &Acceptor::startError, shared_from_this(), error ) ) );
+		}
+	}
+	restartAccept( error, listener );
+}
+
+#if NETWORK_SHM
+
+void Acceptor::startShmAccept( boost::shared_ptr< Connection > connection, int32_t listener )
+{
+	connection->mShm.reset( new ShmChannel( connection->getService() ) );
+	mShmAcceptor->async_accept( connection->mShm->getSocket(), connection->getStrand().wrap( makeAllocHandler( connection->getHandlerAllocator(), boost::bind( &Acceptor::handleShmAccept, shared_from_this(), _1, connection, listener ) ) ) );
+}
+
+void Acceptor::handleShmAccept( const boost::system::error_code & error, boost::shared_ptr< Connection > connection, int32_t listener )
+{
+	NETWORK_METRIC( HandlerTimer handlerTimer( *mHiveMetrics ); )
+	NETWORK_TRACE( TraceScope traceScope( "Acceptor::handleShmAccept", this ); )
+	boost::system::error_code ec = error;
+	if( !ec && !hasError() && !mHive->hasStopped() )
+	{
+		// The segment is created here and its name sent to the client. The
+		// name fits into the buffer of a new socket, the write never
+		// blocks.
+		connection->mShm->create( ShmChannel::DEFAULT_RING_BYTES, ec );
+		if( !ec )
+		{
+			boost::asio::write( connection->mShm->getSocket(), connection->mShm->getNameBuffer(), ec );
+		}
+	}
+	if( ec || hasError() || mHive->hasStopped() )
+	{
+		connection->startError( ec );
+	}
+	else
+	{
+		NETWORK_METRIC( mHiveMetrics->addAccept(); )
+		connection->startOpen();
+		connection->startTimer();
+		connection->startShmWake();
+		if( onAccept( connection, mShmHost, mShmPort ) )
+		{
+			connection->onAccept( mShmHost, mShmPort );
+		}
+	}
+	restartAccept( ec, listener );
+}
+
+#endif
+
+void Acceptor::stop()
+{
+	mIoStrand.post( makeAllocHandler( mHandlerAllocator, boost::bind( &Acceptor::handleTimer, shared_from_this(), boost::asio::error::connection_reset ) ) );
+}
+
+void Acceptor::accept( boost::shared_ptr< Connection > connection )
+{
+	mIoStrand.post( makeAllocHandler( mHandlerAllocator, boost::bind( &Acceptor::dispatchAccept, shared_from_this(), connection ) ) );
+}
+
+void Acceptor::listen( const std::string & host, const uint16_t & port )
+{
+#if NETWORK_SHM
+	if( host.compare( 0, 6, "shm://" ) == 0 )
+	{
+		std::string name = host.substr( 6 );
+		std::string path;
+		uint16_t shmPort = port;
+		if( port == 0 )
+		{
+			// Every port 0 listener would share, and replace, the same
+			// socket, so a port whose socket does not exist yet is taken
+			// instead. Stale sockets in the range are skipped, not replaced.
+			mShmAcceptor.reset( new boost::asio::local::stream_protocol::acceptor( mIoService ) );
+			uint32_t first = static_cast< uint32_t >( Metrics::now() / 1000 );
+			boost::system::error_code ec = boost::asio::error::address_in_use;
+			for( uint32_t i = 0; i < SHM_PORT_COUNT && ec == boost::asio::error::address_in_use; ++i )
+			{
+				shmPort = static_cast< uint16_t >( SHM_PORT_FIRST + ( first + i ) % SHM_PORT_COUNT );
+				ec.clear();
+				path = ShmChannel::getPath( name, shmPort, ec );
+				if( ec )
+				{
+					break;
+				}
+				boost::system::error_code closeEc;
+				mShmAcceptor->close( closeEc );
+				mShmAcceptor->open();
+				mShmAcceptor->bind( boost::asio::local::stream_protocol::endpoint( path ), ec );
+			}
+			if( ec )
+			{
+				mShmAcceptor.reset();
+				throw boost::system::system_error( ec );
+			}
+			mShmAcceptor->listen( boost::asio::socket_base::max_connections );
+		}
+		else
+		{
+			// A socket left behind by a listener that did not stop cleanly is
+			// replaced, but one that still accepts is in use, as with TCP.
+			boost::system::error_code ec;
+			path = ShmChannel::getPath( name, port, ec );
+			if( ec )
+			{
+				throw boost::system::system_error( ec );
+			}
+			boost::asio::local::stream_protocol::endpoint endpoint( path );
+			mShmAcceptor.reset( new boost::asio::local::stream_protocol::acceptor( mIoService ) );
+			mShmAcceptor->open();
+			mShmAcceptor->bind( endpoint, ec );
+			if( ec == boost::asio::error::address_in_use )
+			{
+				boost::asio::local::stream_protocol::socket probe( mIoService );
+				boost::system::error_code probeEc;
+				probe.connect( endpoint, probeEc );
+				if( probeEc )
+				{
+					// Only a socket is replaced, never a file put there.
+					ShmChannel::removeSocket( path );
+					mShmAcceptor->bind( endpoint, ec );
+				}
+			}
+			if( ec )
+			{
+				mShmAcceptor.reset();
+				throw boost::system::system_error( ec );
+			}
+			mShmAcceptor->listen( boost::asio::socket_base::max_connections );
+		}
+		mShmHost = host;
+		mShmPath = path;
+		mShmPort = shmPort;
+		if( mConnectionFactory )
+		{
+			for( int32_t i = 0; i < mAcceptBacklog; ++i )
+			{
+				postAccept( 0 );
+			}
+		}
+		startTimer();
+		return;
+	}
+#endif
+	// A lookup on a thread running the Hive would stall every connection
+	// of its io_service, so only hosts known without one are taken there.
+	boost::asio::ip::tcp::endpoint endpoint( mHive->getResolver().resolveNow( host, !mHive->runsInThisThread() ).front(), port );
+	boost::system::error_code ec;
+	startListen( endpoint, ec );
+	if( ec )
+	{
+		throw boost::system::system_error( ec );
+	}
+}
+
+void Acceptor::listenAsync( const std::string & host, const uint16_t & port, const ListenCallback & callback )
+{
+#if NETWORK_SHM
+	if( host.compare( 0, 6, "shm://" ) == 0 )
+	{
+		listen( host, port );
+		if( callback )
+		{
+			mIoStrand.post( boost::bind( callback, boost::system::error_code() ) );
+		}
+		return;
+	}
+#endif
+	mHive->getResolver().resolve( host, mIoStrand.wrap( makeAllocHandler( mHandlerAllocator, boost::bind( &Acceptor::handleResolve, shared_from_this(), _1, _2, port, callback ) ) ) );
+}
+
+void Acceptor::startListen( const boost::asio::ip::tcp::endpoint & endpoint, boost::system::error_code & ec )
+{
+	mAcceptor.open( endpoint.protocol(), ec );
+	if( !ec )
+	{
+		mAcceptor.set_option( boost::asio::ip::tcp::acceptor::reuse_address( false ), ec );
+	}
+#if defined( SO_REUSEPORT )
+	if( !ec && mReusePort )
+	{
+		mAcceptor.set_option( ReusePortOption( true ), ec );
+	}
+#endif
+	if( !ec )
+	{
+		mAcceptor.bind( endpoint, ec );
+	}
+	if( !ec )
+	{
+		mAcceptor.listen( boost::asio::socket_base::max_connections, ec );
+	}
+	if( !ec )
+	{
+		mLocalEndpoint = mAcceptor.local_endpoint( ec );
+	}
+#if defined( __linux__ ) && defined( SO_REUSEPORT )
+	if( !ec && mReusePort && mConnectionFactory )
+	{
+		// The other listeners bind the port the acceptor got, so an
+		// ephemeral port is shared as well.
+		size_t serviceIndex = mHive->getServiceIndex( mIoService );
+		for( size_t i = 0; i < mHive->getServiceCount() && !ec; ++i )
+		{
+			if( i == serviceIndex )
+			{
+				continue;
+			}
+			boost::shared_ptr< Listener > listener( new Listener( mHive->getService( i ), i ) );
+			listener->mAcceptor.open( mLocalEndpoint.protocol(), ec );
+			if( !ec )
+			{
+				listener->mAcceptor.set_option( boost::asio::ip::tcp::acceptor::reuse_address( false ), ec );
+			}
+			if( !ec )
+			{
+				listener->mAcceptor.set_option( ReusePortOption( true ), ec );
+			}
+			if( !ec )
+			{
+				listener->mAcceptor.bind( mLocalEndpoint, ec );
+			}
+			if( !ec )
+			{
+				listener->mAcceptor.listen( boost::asio::socket_base::max_connections, ec );
+			}
+			if( !ec )
+			{
+				mListeners.push_back( listener );
+			}
+		}
+	}
+#endif
+	if( ec )
+	{
+		// Nothing accepts yet, so a failed listen leaves the acceptor as
+		// it was before.
+		boost::system::error_code closeEc;
+		mAcceptor.close( closeEc );
+		mListeners.clear();
+		mLocalEndpoint = boost::asio::ip::tcp::endpoint();
+		return;
+	}
+	if( mConnectionFactory )
+	{
+		for( size_t listener = 0; listener <= mListeners.size(); ++listener )
+		{
+			for( int32_t i = 0; i < mAcceptBacklog; ++i )
+			{
+				postAccept( listener );
+			}
+		}
+	}
+	startTimer();
+}
+
+void Acceptor::handleResolve( const boost::system::error_code & error, const std::vector< boost::asio::ip::address > & addresses, uint16_t port, const ListenCallback & callback )
+{
+	NETWORK_METRIC( HandlerTimer handlerTimer( *mHiveMetrics ); )
+	NETWORK_TRACE( TraceScope traceScope( "Acceptor::handleResolve", this ); )
+	boost::system::error_code ec = error;
+	if( !ec && ( hasError() || mHive->hasStopped() ) )
+	{
+		ec = boost::asio::error::operation_aborted;
+	}
+	if( !ec )
+	{
+		startListen( boost::asio::ip::tcp::endpoint( addresses.front(), port ), ec );
+	}
+	if( ec )
+	{
+		startError( ec );
+	}
+	if( callback )
+	{
+		callback( ec );
+	}
+}
+
+boost::shared_ptr< Hive > Acceptor::getHive()
+{
+	return mHive;
+}
+
+NetworkStrand & Acceptor::getStrand()
+{
+	return mIoStrand;
+}
+
+boost::asio::io_service & Acceptor::getService()
+{
+	return mIoService;
+}
+
+HandlerAllocator & Acceptor::getHandlerAllocator()
+{
+	return mHandlerAllocator;
+}
+
+boost::asio::ip::tcp::acceptor & Acceptor::getAcceptor()
+{
+	return mAcceptor;
+}
+
+int32_t Acceptor::getTimerInterval() const
+{
+	return mTimerInterval;
+}
+
+void Acceptor::setTimerInterval( int32_t timerInterval )
+{
+	mTimerInterval = timerInterval;
+}
+
+void Acceptor::setConnectionFactory( const ConnectionFactory & factory, int32_t backlog )
+{
+	mConnectionFactory = factory;
+	mAcceptBacklog = std::max( backlog, 1 );
+}
+
+int32_t Acceptor::getAcceptBacklog() const
+{
+	return mAcceptBacklog;
+}
+
+void Acceptor::setReusePort( bool enabled )
+{
+	mReusePort = enabled;
+}
+
+bool Acceptor::getReusePort() const
+{
+	return mReusePort;
+}
+
+size_t Acceptor::getListenerCount() const
+{
+	return mListeners.size() + 1;
+}
+
+uint16_t Acceptor::getPort() const
+{
+#if NETWORK_SHM
+	if( mShmAcceptor )
+	{
+		return mShmPort;
+	}
+#endif
+	return mLocalEndpoint.port();
+}
+
+bool Acceptor::hasError()
+{
+	return mErrorState.load( std::memory_order_acquire );
+}
+
+//-----------------------------------------------------------------------------
+
+#if defined( __linux__ ) && defined( TCP_QUICKACK )
+typedef BooleanSocketOption< IPPROTO_TCP, TCP_QUICKACK > QuickAckOption;
+#endif
+
+SocketOptions::SocketOptions()
+: noDelay( false ), quickAck( false ), keepAlive( false ), receiveBufferBytes( 0 ), sendBufferBytes( 0 )
+{
+}
+
+SocketOptions SocketOptions::lowLatency()
+{
+	SocketOptions options;
+	options.noDelay = true;
+	options.quickAck = true;
+	return options;
+}
+
+SocketOptions SocketOptions::bulk()
+{
+	SocketOptions options;
+	options.receiveBufferBytes = 4 * 1024 * 1024;
+	options.sendBufferBytes = 4 * 1024 * 1024;
+	return options;
+}
+
+//-----------------------------------------------------------------------------
+
+Connection::SendSource::SendSource()
+: mFile( -1 ), mData( 0 ), mOffset( 0 ), mBytes( 0 ), mSent( 0 )
+{
+#if NETWORK_COROUTINES
+	mAwaitable = 0;
+#endif
+}
+
+Connection::SendSource::~SendSource()
+{
+#if NETWORK_SENDFILE
+	if( mFile >= 0 )
+	{
+		::close( mFile );
+	}
+#endif
+}
+
+#if NETWORK_SENDFILE
+
+// Unmaps a file mapped by SendSource::map once the last reference to it is
+// released.
+struct MappedRegionDeleter
+{
+	size_t mBytes;
+    
+	void operator()( void * memory ) const
+	{
+		::munmap( memory, mBytes );
+	}
+};
+
+void Connection::SendSource::map( boost::system::error_code & ec )
+{
+	// Mappings start on a page boundary.
+	uint64_t pageBytes = static_cast< uint64_t >( ::sysconf( _SC_PAGESIZE ) );
+	uint64_t begin = mOffset - mOffset % pageBytes;
+	MappedRegionDeleter deleter = { static_cast< size_t >( mOffset + mBytes - begin ) };
+	void * memory = ::mmap( 0, deleter.mBytes, PROT_READ, MAP_SHARED, mFile, static_cast< off_t >( begin ) );
+	if( memory == MAP_FAILED )
+	{
+		ec = boost::system::error_code( errno, boost::system::system_category() );
+		return;
+	}
+	mOwner.reset( memory, deleter );
+	mData = static_cast< const uint8_t * >( memory ) + ( mOffset - begin );
+}
+
+#endif
+
+//-----------------------------------------------------------------------------
+
+Connection::Connection( boost::shared_ptr< Hive > hive )
+: Connection( hive, hive->getNextService() )
+{
+}
+
+Connection::Connection( boost::shared_ptr< Hive > hive, size_t affinityKey )
+: Connection( hive, hive->getServiceForKey( affinityKey ) )
+{
+}
+
+Connection::Connection( boost::shared_ptr< Hive > hive, boost::asio::io_service & service )
+: mHive( hive ), mIoService( service ), mSocket( mIoService ), mIoStrand( mIoService ), mTimerWheel( hive->getTimerWheel( mIoService ) ), mTimerEntry( &Connection::dispatchTimer ), mConnectEntry( &Connection::dispatchConnectTimer ), mConnectNext( 0 ), mConnectAttemptDelay( 250 ), mReceiveBufferSize( 4096 ), mReceiveBufferStartSize( 4096 ), mTimerInterval( 1000 ), mSendBatchMaxBytes( 65536 ), mSendBatchMaxBuffers( 64 ), mSendCoalescing( false ), mSendNotifyPerBatch( false ), mSendQueueBytes( 0 ), mSendQueueHighBytes( 0 ), mSendQueueLowBytes( 0 ), mSendQueuePolicy( SEND_QUEUE_NOTIFY ), mSendQueueFull( false ), mFrameBegin( 0 ), mFrameEnd( 0 ), mFrameMaxBytes( 16 * 1024 * 1024 ), mFramePrefixBytes( 0 ), mFrameBigEndian( true ), mFrameReading( false ), mLingerTimeout( 5000 ), mSendShutdown( false ), mState( STATE_CONNECTING ), mSocketOptionsSet( false ), mAdaptiveReceive( false ), mAdaptiveMinBytes( 512 ), mAdaptiveMaxBytes( 256 * 1024 ), mAdaptiveLowReads( 0 ), mDrainWatched( false )
+{
+	mServiceIndex = hive->getServiceIndex( mIoService );
+	NETWORK_METRIC( mHiveMetrics = &hive->getHiveMetrics( mIoService ); )
+#if NETWORK_SHM
+	mShmReading = false;
+	mShmSending = false;
+#endif
+#if NETWORK_COROUTINES
+	mConnectAwaitable = 0;
+#endif
+}
+
+Connection::~Connection()
+{
+	mTimerWheel.cancel( mTimerEntry );
+	mTimerWheel.cancel( mConnectEntry );
+	clearQueues();
+}
+
+void Connection::bind( const std::string & ip, uint16_t port )
+{
+	boost::asio::ip::tcp::endpoint endpoint( boost::asio::ip::address::from_string( ip ), port );
+	mSocket.open( endpoint.protocol() );
+	mSocket.set_option( boost::asio::ip::tcp::acceptor::reuse_address( false ) );
+	applySocketOptions( mSocket );
+	mSocket.bind( endpoint );
+}
+
+void Connection::startSend()
+{
+	if( !mPendingSends.empty() )
+	{
+		size_t bytes = 0;
+		mSendBuffers.clear();
+		if( !mPendingSends.front() )
+		{
+			// A file or region is written a chunk at a time, so progress
+			// can be reported.
+			SendSource & source = *mPendingSources.front();
+			bytes = static_cast< size_t >( std::min< uint64_t >( source.mBytes - source.mSent, SEND_CHUNK_BYTES ) );
+#if NETWORK_SENDFILE
+			if( !source.mData )
+			{
+#if NETWORK_SHM
+				if( mShm )
+				{
+					// The ring can only be written from memory.
+					boost::system::error_code ec;
+					source.map( ec );
+					if( ec )
+					{
+						startError( ec );
+						return;
+					}
+				}
+				else
+#endif
+				{
+					// Wait until the socket is writable, then let the kernel
+					// copy from the file.
+					mSocket.async_write_some( boost::asio::null_buffers(), mIoStrand.wrap( makeAllocHandler( mHandlerAllocator, boost::bind( &Connection::handleSendFile, shared_from_this(), _1, bytes ) ) ) );
+					return;
+				}
+			}
+#endif
+			mSendBuffers.push_back( boost::asio::buffer( source.mData + source.mSent, bytes ) );
+		}
+		else
+		{
+			// Gather the front of the queue into one write. Without
+			// coalescing the batch is always the single front buffer.
+			size_t maxBuffers = mSendCoalescing ? std::max( mSendBatchMaxBuffers, 1 ) : 1;
+			size_t maxBytes = static_cast< size_t >( std::max( mSendBatchMaxBytes, 0 ) );
+			for( std::list< SharedBuffer >::iterator itr = mPendingSends.begin(); itr != mPendingSends.end() && *itr && mSendBuffers.size() < maxBuffers; ++itr )
+			{
+				if( !mSendBuffers.empty() && bytes + ( *itr )->size() > maxBytes )
+				{
+					break;
+				}
+				mSendBuffers.push_back( boost::asio::buffer( **itr ) );
+				bytes += ( *itr )->size();
+			}
+		}
+#if NETWORK_SHM
+		if( mShm )
+		{
+			mShmSendBuffer = 0;
+			mShmSendOffset = 0;
+			mShmSendBytes = bytes;
+			mShmSending = true;
+			continueShmSend();
+			return;
+		}
+#endif
+		boost::asio::async_write( mSocket, mSendBuffers, mIoStrand.wrap( makeAllocHandler( mHandlerAllocator, boost::bind(  &Connection::handleSend, shared_from_this(),  boost::asio::placeholders::error, mSendBuffers.size(), bytes ) ) ) );
+	}
+}
+
+void Connection::startRecv( int32_t totalBytes )
+{
+	if( totalBytes == RECV_INTO )
+	{
+		startRecvInto();
+		return;
+	}
+#if NETWORK_SHM
+	if( mShm )
+	{
+		mRecvLease = mHive->getRecvPool()->acquire( mServiceIndex );
+		std::vector< uint8_t > & recvBuffer = mRecvLease->getBuffer();
+		recvBuffer.resize( totalBytes > 0 ? totalBytes : mReceiveBufferSize );
+		startShmRead( recvBuffer.data(), recvBuffer.size(), totalBytes > 0 ? recvBuffer.size() : 1, SHM_READ_RECV );
+		return;
+	}
+#endif
+	// Wait for data before leasing a block, so a connection idling with a
+	// recv posted holds no receive memory.
+	mSocket.async_read_some( boost::asio::null_buffers(), mIoStrand.wrap( makeAllocHandler( mHandlerAllocator, boost::bind( &Connection::handleRecvReady, shared_from_this(), _1, totalBytes ) ) ) );
+}
+
+void Connection::startRecvInto()
+{
+	RecvTarget & target = mPendingRecvTargets.front();
+#if NETWORK_SHM
+	if( mShm )
+	{
+		// The ring is read into one buffer at a time, continuing after the
+		// bytes already read.
+		size_t skip = target.mDone;
+		size_t index = 0;
+		while( skip >= boost::asio::buffer_size( target.mBuffers[ index ] ) )
+		{
+			skip -= boost::asio::buffer_size( target.mBuffers[ index++ ] );
+		}
+		size_t size = boost::asio::buffer_size( target.mBuffers[ index ] ) - skip;
+		startShmRead( boost::asio::buffer_cast< uint8_t * >( target.mBuffers[ index ] ) + skip, size, size, SHM_READ_INTO );
+		return;
+	}
+#endif
+	boost::asio::async_read( mSocket, target.mBuffers, mIoStrand.wrap( makeAllocHandler( mHandlerAllocator, boost::bind( &Connection::handleRecvInto, shared_from_this(), _1, _2 ) ) ) );
+}
+
+void Connection::startFrameRecv()
+{
+	// Move a trailing partial frame to the front so the whole buffer is
+	// available to the next read.
+	if( mFrameBegin > 0 )
+	{
+		if( mFrameEnd > mFrameBegin )
+		{
+			std::memmove( &mFrameBuffer[ 0 ], &mFrameBuffer[ mFrameBegin ], mFrameEnd - mFrameBegin );
+		}
+		mFrameEnd -= mFrameBegin;
+		mFrameBegin = 0;
+	}
+    
+	// Grow the buffer when the partial frame does not fit, so a large frame
+	// completes in as few reads as possible. The size is checked before it
+	// is added to, so no prefix can make it wrap around.
+	size_t prefixBytes = static_cast< size_t >( mFramePrefixBytes );
+	size_t required = std::max( static_cast< size_t >( std::max( mReceiveBufferSize, 1 ) ), prefixBytes );
+	if( mFrameEnd >= prefixBytes )
+	{
+		uint64_t frameBytes = 0;
+		for( size_t i = 0; i < prefixBytes; ++i )
+		{
+			frameBytes = ( frameBytes << 8 ) | mFrameBuffer[ mFrameBigEndian ? i : prefixBytes - 1 - i ];
+		}
+		if( frameBytes > mFrameMaxBytes || frameBytes > std::numeric_limits< size_t >::max() - prefixBytes )
+		{
+			startError( boost::asio::error::message_size );
+			return;
+		}
+		required = std::max( required, prefixBytes + static_cast< size_t >( frameBytes ) );
+	}
+	if( mFrameBuffer.size() < required )
+	{
+		mFrameBuffer.resize( required );
+	}
+	else if( mFrameEnd == 0 && mFrameBuffer.size() > required )
+	{
+		// Nothing is buffered, so memory grown for a large frame is given
+		// back rather than held for the life of the connection.
+		std::vector< uint8_t >( required ).swap( mFrameBuffer );
+	}
+#if NETWORK_SHM
+	if( mShm )
+	{
+		startShmRead( &mFrameBuffer[ mFrameEnd ], mFrameBuffer.size() - mFrameEnd, 1, SHM_READ_FRAME );
+		return;
+	}
+#endif
+	mSocket.async_read_some( boost::asio::buffer( &mFrameBuffer[ mFrameEnd ], mFrameBuffer.size() - mFrameEnd ), mIoStrand.wrap( makeAllocHandler( mHandlerAllocator, boost::bind( &Connection::handleFrameRecv, shared_from_this(), _1, _2 ) ) ) );
+}
+
+void Connection::startTimer()
+{
+	mTimerWheel.schedule( mTimerEntry, shared_from_this(), mTimerInterval );
+	mLastTime = mTimerWheel.getTime();
+}
+
+void Connection::startError( const boost::system::error_code & error )
+{
+	if( mState.exchange( STATE_CLOSED, std::memory_order_acq_rel ) != STATE_CLOSED )
+	{
+		boost::system::error_code ec;
+		mSocket.shutdown( boost::asio::ip::tcp::socket::shutdown_both, ec );
+		mSocket.close( ec );
+		mTimerWheel.cancel( mTimerEntry );
+		mTimerWheel.cancel( mConnectEntry );
+		for( size_t i = 0; i < mConnectSockets.size(); ++i )
+		{
+			mConnectSockets[ i ]->close( ec );
+		}
+#if NETWORK_SHM
+		if( mShm )
+		{
+			mShm->close();
+		}
+#endif
+#if NETWORK_COROUTINES
+		// Awaited sends still queued will never be written.
+		for( size_t i = 0; i < mPendingSources.size(); ++i )
+		{
+			if( mPendingSources[ i ]->mAwaitable )
+			{
+				mPendingSources[ i ]->mAwaitable->post( mIoStrand, mHandlerAllocator, boost::asio::error::operation_aborted, 0 );
+				mPendingSources[ i ]->mAwaitable = 0;
+			}
+		}
+#endif
+		if( error )
+		{
+			NETWORK_METRIC( mMetrics.addError(); mHiveMetrics->addError( error ); )
+		}
+		onError( error );
+	}
+}
+
+void Connection::applySocketOptions( boost::asio::ip::tcp::socket & socket )
+{
+	if( !mSocketOptionsSet || !socket.is_open() )
+	{
+		return;
+	}
+	// Options the platform does not support are skipped.
+	boost::system::error_code ec;
+	socket.set_option( boost::asio::ip::tcp::no_delay( mSocketOptions.noDelay ), ec );
+	socket.set_option( boost::asio::socket_base::keep_alive( mSocketOptions.keepAlive ), ec );
+	if( mSocketOptions.receiveBufferBytes > 0 )
+	{
+		socket.set_option( boost::asio::socket_base::receive_buffer_size( mSocketOptions.receiveBufferBytes ), ec );
+	}
+	if( mSocketOptions.sendBufferBytes > 0 )
+	{
+		socket.set_option( boost::asio::socket_base::send_buffer_size( mSocketOptions.sendBufferBytes ), ec );
+	}
+#if defined( __linux__ ) && defined( TCP_QUICKACK )
+	if( mSocketOptions.quickAck )
+	{
+		socket.set_option( QuickAckOption( true ), ec );
+	}
+#endif
+}
+
+void Connection::updateRecv( size_t requestedBytes, size_t actualBytes )
+{
+	if( mAdaptiveReceive && requestedBytes > 0 )
+	{
+		if( actualBytes >= requestedBytes )
+		{
+			// A full buffer suggests more was waiting.
+			mAdaptiveLowReads = 0;
+			mReceiveBufferSize = std::min( mReceiveBufferSize * 2, mAdaptiveMaxBytes );
+		}
+		else if( actualBytes * 4 < requestedBytes )
+		{
+			if( ++mAdaptiveLowReads >= 8 )
+			{
+				mAdaptiveLowReads = 0;
+				mReceiveBufferSize = std::max( mReceiveBufferSize / 2, mAdaptiveMinBytes );
+			}
+		}
+		else
+		{
+			mAdaptiveLowReads = 0;
+		}
+	}
+#if defined( __linux__ ) && defined( TCP_QUICKACK )
+	// Quick ack mode does not stick, the kernel leaves it again on its own.
+	// It only needs re-arming once data arrived; a read that filled its
+	// buffer is followed by another at once, so only the last read of a
+	// burst pays for the setsockopt.
+	if( mSocketOptions.quickAck && actualBytes > 0 && ( requestedBytes == 0 || actualBytes < requestedBytes ) && mSocket.is_open() )
+	{
+		boost::system::error_code ec;
+		mSocket.set_option( QuickAckOption( true ), ec );
+	}
+#endif
+}
+
+void Connection::startOpen()
+{
+	State state = STATE_CONNECTING;
+	mState.compare_exchange_strong( state, STATE_OPEN, std::memory_order_acq_rel );
+}
+
+void Connection::startDrain()
+{
+	if( mSendShutdown )
+	{
+		return;
+	}
+	mSendShutdown = true;
+	// The wheel's time is only current within its own ticks.
+	mDrainTime = TimerWheel::Clock::now();
+	boost::system::error_code ec;
+#if NETWORK_SHM
+	if( mShm )
+	{
+		// The socket stays open in both directions, it still carries the
+		// wakeups of the peer's sends.
+		mShm->shutdown();
+	}
+	else
+#endif
+	{
+		mSocket.shutdown( boost::asio::ip::tcp::socket::shutdown_send, ec );
+	}
+	if( ec )
+	{
+		startError( ec );
+		return;
+	}
+	// Keep a read outstanding, it is what sees the peer close.
+	if( mPendingRecvs.empty() && !mFrameReading )
+	{
+		dispatchRecv( 0 );
+	}
+}
+
+void Connection::startConnectAttempt()
+{
+	boost::shared_ptr< boost::asio::ip::tcp::socket > socket( new boost::asio::ip::tcp::socket( mIoService ) );
+	mConnectSockets.push_back( socket );
+	if( mSocketOptionsSet )
+	{
+		// Opened here so the buffer sizes are in place for the handshake.
+		boost::system::error_code ec;
+		socket->open( mConnectEndpoints[ mConnectNext ].protocol(), ec );
+		applySocketOptions( *socket );
+	}
+	socket->async_connect( mConnectEndpoints[ mConnectNext++ ], mIoStrand.wrap( makeAllocHandler( mHandlerAllocator, boost::bind( &Connection::handleConnect, shared_from_this(), _1, socket ) ) ) );
+	if( mConnectNext < mConnectEndpoints.size() )
+	{
+		// Give this attempt a head start, then race the next address
+		// alongside it (RFC 8305).
+		mTimerWheel.schedule( mConnectEntry, shared_from_this(), mConnectAttemptDelay );
+	}
+}
+
+void Connection::handleResolve( const boost::system::error_code & error, const std::vector< boost::asio::ip::address > & addresses, uint16_t port )
+{
+	NETWORK_METRIC( HandlerTimer handlerTimer( *mHiveMetrics ); )
+	NETWORK_TRACE( TraceScope traceScope( "Connection::handleResolve", this ); )
+	if( error || hasError() || mHive->hasStopped() )
+	{
+		failConnect( error );
+		return;
+	}
+    
+	// Alternate address families, starting with the resolver's first
+	// preference, so a broken family costs one attempt delay at most.
+	std::vector< boost::asio::ip::address > preferred;
+	std::vector< boost::asio::ip::address > other;
+	for( size_t i = 0; i < addresses.size(); ++i )
+	{
+		( addresses[ i ].is_v6() == addresses.front().is_v6() ? preferred : other ).push_back( addresses[ i ] );
+	}
+	mConnectEndpoints.clear();
+	for( size_t i = 0; i < std::max( preferred.size(), other.size() ); ++i )
+	{
+		if( i < preferred.size() )
+		{
+			mConnectEndpoints.push_back( boost::asio::ip::tcp::endpoint( preferred[ i ], port ) );
+		}
+		if( i < other.size() )
+		{
+			mConnectEndpoints.push_back( boost::asio::ip::tcp::endpoint( other[ i ], port ) );
+		}
+	}
+	mConnectNext = 0;
+    
+	if( mSocket.is_open() )
+	{
+		// A bound socket has its family and local port fixed, so only
+		// that family can be tried, and only once.
+		boost::system::error_code ec;
+		boost::asio::ip::tcp::endpoint local = mSocket.local_endpoint( ec );
+		if( ec )
+		{
+			failConnect( ec );
+			return;
+		}
+		for( size_t i = 0; i < mConnectEndpoints.size(); ++i )
+		{
+			if( mConnectEndpoints[ i ].protocol() == local.protocol() )
+			{
+				mSocket.async_connect( mConnectEndpoints[ i ], mIoStrand.wrap( makeAllocHandler( mHandlerAllocator, boost::bind( &Connection::handleConnect, shared_from_this(), _1, boost::shared_ptr< boost::asio::ip::tcp::socket >() ) ) ) );
+				mConnectEndpoints.clear();
+				return;
+			}
+		}
+		failConnect( boost::asio::error::address_family_not_supported );
+		return;
+	}
+	startConnectAttempt();
+}
+
+void Connection::failConnect( const boost::system::error_code & error )
+{
+#if NETWORK_COROUTINES
+	if( mConnectAwaitable )
+	{
+		// The awaitable ends the connection once it resumes.
+		resumeConnect( error ? error : boost::system::error_code( boost::asio::error::operation_aborted ) );
+		return;
+	}
+#endif
+	startError( error );
+}
+
+#if NETWORK_COROUTINES
+
+void Connection::resumeConnect( const boost::system::error_code & ec )
+{
+	IoAwaitable * awaitable = mConnectAwaitable;
+	mConnectAwaitable = 0;
+	awaitable->complete( ec, 0 );
+}
+
+#endif
+
+void Connection::dispatchConnectTimer( const boost::shared_ptr< void > & owner )
+{
+	boost::shared_ptr< Connection > connection = boost::static_pointer_cast< Connection >( owner );
+	connection->mIoStrand.post( makeAllocHandler( connection->mHandlerAllocator, boost::bind( &Connection::handleConnectDelay, connection ) ) );
+}
+
+void Connection::handleConnectDelay()
+{
+	NETWORK_METRIC( HandlerTimer handlerTimer( *mHiveMetrics ); )
+	NETWORK_TRACE( TraceScope traceScope( "Connection::handleConnectDelay", this ); )
+	if( hasError() || mHive->hasStopped() )
+	{
+		return;
+	}
+	if( !mConnectSockets.empty() && mConnectNext < mConnectEndpoints.size() )
+	{
+		startConnectAttempt();
+	}
+}
+
+void Connection::handleConnect( const boost::system::error_code & error, boost::shared_ptr< boost::asio::ip::tcp::socket > socket )
+{
+	NETWORK_METRIC( HandlerTimer handlerTimer( *mHiveMetrics ); )
+	NETWORK_TRACE( TraceScope traceScope( "Connection::handleConnect", this ); )
+	boost::system::error_code ec;
+	if( socket )
+	{
+		std::vector< boost::shared_ptr< boost::asio::ip::tcp::socket > >::iterator itr = std::find( mConnectSockets.begin(), mConnectSockets.end(), socket );
+		if( itr == mConnectSockets.end() )
+		{
+			// Lost the race to an attempt that already connected.
+			return;
+		}
+		mConnectSockets.erase( itr );
+		if( error || hasError() || mHive->hasStopped() )
+		{
+			socket->close( ec );
+			if( !hasError() && !mHive->hasStopped() )
+			{
+				if( mConnectNext < mConnectEndpoints.size() )
+				{
+					mTimerWheel.cancel( mConnectEntry );
+					startConnectAttempt();
+					return;
+				}
+				if( !mConnectSockets.empty() )
+				{
+					return;
+				}
+			}
+			mConnectEndpoints.clear();
+			failConnect( error );
+			return;
+		}
+		
+		mTimerWheel.cancel( mConnectEntry );
+		for( size_t i = 0; i < mConnectSockets.size(); ++i )
+		{
+			mConnectSockets[ i ]->close( ec );
+		}
+		mConnectSockets.clear();
+		mConnectEndpoints.clear();
+		mSocket = std::move( *socket );
+	}
+    
+	if( error || hasError() || mHive->hasStopped() )
+	{
+		failConnect( error );
+	}
+	else
+	{
+		boost::system::error_code ec;
+		boost::asio::ip::tcp::endpoint remote;
+		if( mSocket.is_open() )
+		{
+			remote = mSocket.remote_endpoint( ec );
+		}
+		if( ec )
+		{
+			failConnect( ec );
+		}
+		else if( mSocket.is_open() )
+		{
+#if NETWORK_COROUTINES
+			if( mConnectAwaitable )
+			{
+				resumeConnect( boost::system::error_code() );
+				return;
+			}
+#endif
+			startOpen();
+			onConnect( remote.address().to_string(), remote.port() );
+		}
+		else
+		{
+			failConnect( error );
+		}
+	}
+}
+
+void Connection::handleSend( const boost::system::error_code &  error, size_t sendCount, size_t sendBytes )
+{
+	NETWORK_METRIC( HandlerTimer handlerTimer( *mHiveMetrics ); )
+	NETWORK_TRACE( TraceScope traceScope( "Connection::handleSend", this ); )
+	if( error || hasError() || mHive->hasStopped() )
+	{
+		startError( error );
+	}
+	else
+	{
+		if( !mPendingSends.front() )
+		{
+			SendSource & source = *mPendingSources.front();
+			source.mSent += sendBytes;
+#if NETWORK_COROUTINES
+			if( source.mAwaitable )
+			{
+				// An awaited send is only reported to its coroutine.
+				if( source.mSent >= source.mBytes )
+				{
+					source.mAwaitable->post( mIoStrand, mHandlerAllocator, boost::system::error_code(), static_cast< size_t >( source.mBytes ) );
+				}
+			}
+			else
+#endif
+			{
+				onSendProgress( source.mSent, source.mBytes );
+			}
+			sendCount = 0;
+			if( source.mSent >= source.mBytes )
+			{
+				sendCount = 1;
+				mPendingSources.pop_front();
+				mPendingSends.pop_front();
+			}
+		}
+		else if( mSendCoalescing && mSendNotifyPerBatch )
+		{
+			onSendBatch( sendCount, static_cast< uint64_t >( sendBytes ) );
+			for( size_t i = 0; i < sendCount; ++i )
+			{
+				mPendingSends.pop_front();
+			}
+		}
+		else
+		{
+			for( size_t i = 0; i < sendCount; ++i )
+			{
+				onSend( *mPendingSends.front() );
+				mPendingSends.pop_front();
+			}
+		}
+#if NETWORK_METRICS
+		uint64_t sentTime = Metrics::now();
+		for( size_t i = 0; i < sendCount; ++i )
+		{
+			mHiveMetrics->recordSendLatency( sentTime - mSendQueueTimes.front() );
+			NETWORK_TRACE( Tracer::asyncSpan( "Connection::sendQueued", mSendQueueTimes.front(), sentTime, this ); )
+			mSendQueueTimes.pop_front();
+		}
+		mMetrics.addSent( sendBytes, sendCount );
+		mMetrics.removeSendQueued( sendCount );
+		mHiveMetrics->addSent( sendBytes, sendCount );
+		mHiveMetrics->removeSendQueued( sendCount );
+#endif
+		// Sequentially consistent, so a group that starts watching as the
+		// last send completes either sees the smaller queue or is notified.
+		uint64_t queuedBytes = mSendQueueBytes.fetch_sub( sendBytes, std::memory_order_seq_cst ) - sendBytes;
+		if( mSendQueueFull && queuedBytes <= mSendQueueLowBytes )
+		{
+			mSendQueueFull = false;
+			onDrain( queuedBytes );
+		}
+		if( mDrainWatched.load( std::memory_order_seq_cst ) )
+		{
+			notifyDrain();
+		}
+		startSend();
+		if( mPendingSends.empty() && getState() == STATE_DRAINING )
+		{
+			startDrain();
+		}
+	}
+}
+
+#if NETWORK_SENDFILE
+
+void Connection::handleSendFile( const boost::system::error_code & error, size_t sendBytes )
+{
+	size_t sentBytes = 0;
+	{
+		// Scoped so the HandleSend below records its own run.
+		NETWORK_METRIC( HandlerTimer handlerTimer( *mHiveMetrics ); )
+		NETWORK_TRACE( TraceScope traceScope( "Connection::handleSendFile", this ); )
+		if( error || hasError() || mHive->hasStopped() )
+		{
+			startError( error );
+			return;
+		}
+		SendSource & source = *mPendingSources.front();
+		off_t offset = static_cast< off_t >( source.mOffset + source.mSent );
+        
+		// The call must not block the strand. The socket is left
+		// non-blocking, which asio's own operations work with, so nothing
+		// queued on it can end up in a blocking call.
+		if( !mSocket.native_non_blocking() )
+		{
+			boost::system::error_code ec;
+			mSocket.native_non_blocking( true, ec );
+		}
+#if defined( __APPLE__ )
+		off_t written = static_cast< off_t >( sendBytes );
+		int result = ::sendfile( source.mFile, mSocket.native_handle(), offset, &written, 0, 0 );
+		if( result < 0 && written > 0 )
+		{
+			// Interrupted after part of the range was sent.
+			result = 0;
+		}
+#else
+		ssize_t written = ::sendfile( mSocket.native_handle(), source.mFile, &offset, sendBytes );
+		ssize_t result = written;
+#endif
+		int sendError = errno;
+		if( result < 0 )
+		{
+			if( sendError == EAGAIN || sendError == EWOULDBLOCK || sendError == EINTR )
+			{
+				mSocket.async_write_some( boost::asio::null_buffers(), mIoStrand.wrap( makeAllocHandler( mHandlerAllocator, boost::bind( &Connection::handleSendFile, shared_from_this(), _1, sendBytes ) ) ) );
+			}
+			else
+			{
+				startError( boost::system::error_code( sendError, boost::system::system_category() ) );
+			}
+			return;
+		}
+		if( written == 0 )
+		{
+			// The file is shorter than the range queued.
+			startError( boost::asio::error::eof );
+			return;
+		}
+		sentBytes = static_cast< size_t >( written );
+	}
+	handleSend( boost::system::error_code(), 1, sentBytes );
+}
+
+#endif
+
+void Connection::handleRecv( const boost::system::error_code & error, int32_t actual_bytes )
+{
+	NETWORK_METRIC( HandlerTimer handlerTimer( *mHiveMetrics ); )
+	NETWORK_TRACE( TraceScope traceScope( "Connection::handleRecv", this ); )
+	RecvLease lease;
+	lease.swap( mRecvLease );
+	if( error || hasError() || mHive->hasStopped() )
+	{
+		startError( error );
+	}
+	else
+	{
+		// Reads of an exact size say nothing about the right buffer size.
+		updateRecv( mPendingRecvs.front() == 0 ? lease->getBuffer().size() : 0, actual_bytes );
+		lease->getBuffer().resize( actual_bytes );
+		NETWORK_METRIC( mMetrics.addRecv( actual_bytes ); mMetrics.removePendingRecv(); mHiveMetrics->addRecv( actual_bytes ); mHiveMetrics->removePendingRecv(); )
+		{
+			NETWORK_TRACE( TraceScope traceScope( "Connection::onRecv", this ); )
+			onRecvLease( lease );
+		}
+		mPendingRecvs.pop_front();
+		if( !mPendingRecvs.empty() )
+		{
+			startRecv( mPendingRecvs.front() );
+		}
+	}
+}
+
+void Connection::handleRecvReady( const boost::system::error_code & error, int32_t totalBytes )
+{
+	size_t readBytes = 0;
+	boost::system::error_code ec;
+	{
+		// Scoped so the HandleRecv below records its own run.
+		NETWORK_METRIC( HandlerTimer handlerTimer( *mHiveMetrics ); )
+		NETWORK_TRACE( TraceScope traceScope( "Connection::handleRecvReady", this ); )
+		if( error || hasError() || mHive->hasStopped() )
+		{
+			startError( error );
+			return;
+		}
+		mRecvLease = mHive->getRecvPool()->acquire( mServiceIndex );
+		std::vector< uint8_t > & recvBuffer = mRecvLease->getBuffer();
+		recvBuffer.resize( totalBytes > 0 ? totalBytes : mReceiveBufferSize );
+        
+		// The read takes what has arrived and must not wait for more. Only
+		// its flags make it non-blocking, so the socket keeps the mode the
+		// application sees through GetSocket and its synchronous reads and
+		// writes still block.
+		ssize_t result = ::recv( mSocket.native_handle(), recvBuffer.data(), recvBuffer.size(), MSG_DONTWAIT );
+		if( result < 0 )
+		{
+			ec = boost::system::error_code( errno, boost::system::system_category() );
+		}
+		else if( result == 0 && !recvBuffer.empty() )
+		{
+			ec = boost::asio::error::eof;
+		}
+		else
+		{
+			readBytes = static_cast< size_t >( result );
+		}
+		if( ec == boost::asio::error::would_block || ec == boost::asio::error::try_again || ec == boost::asio::error::interrupted )
+		{
+			// Woken without data after all, give the block back and wait.
+			mRecvLease.reset();
+			startRecv( totalBytes );
+			return;
+		}
+		if( !ec && totalBytes > 0 && readBytes < static_cast< size_t >( totalBytes ) )
+		{
+			// Part of an exact read arrived, the block is held until the
+			// rest has.
+			boost::asio::async_read( mSocket, boost::asio::buffer( &recvBuffer[ readBytes ], recvBuffer.size() - readBytes ), mIoStrand.wrap( makeAllocHandler( mHandlerAllocator, boost::bind( &Connection::handleRecvRest, shared_from_this(), _1, _2, readBytes ) ) ) );
+			return;
+		}
+	}
+	handleRecv( ec, static_cast< int32_t >( readBytes ) );
+}
+
+void Connection::handleRecvRest( const boost::system::error_code & error, size_t actualBytes, size_t readBytes )
+{
+	handleRecv( error, static_cast< int32_t >( readBytes + actualBytes ) );
+}
+
+void Connection::handleRecvInto( const boost::system::error_code & error, size_t actualBytes )
+{
+	NETWORK_METRIC( HandlerTimer handlerTimer( *mHiveMetrics ); )
+	NETWORK_TRACE( TraceScope traceScope( "Connection::handleRecvInto", this ); )
+	if( error || hasError() || mHive->hasStopped() )
+	{
+		startError( error );
+		return;
+	}
+	RecvTarget & target = mPendingRecvTargets.front();
+	target.mDone += actualBytes;
+	if( target.mDone < target.mBytes )
+	{
+		startRecvInto();
+		return;
+	}
+    
+	std::vector< boost::asio::mutable_buffer > buffers;
+	buffers.swap( target.mBuffers );
+	size_t bytes = target.mBytes;
+	mPendingRecvTargets.pop_front();
+	NETWORK_METRIC( mMetrics.addRecv( bytes ); mMetrics.removePendingRecv(); mHiveMetrics->addRecv( bytes ); mHiveMetrics->removePendingRecv(); )
+	updateRecv( 0, bytes );
+	{
+		NETWORK_TRACE( TraceScope traceScope( "Connection::onRecvInto", this ); )
+		onRecvInto( buffers, bytes );
+	}
+	mPendingRecvs.pop_front();
+	if( !mPendingRecvs.empty() )
+	{
+		startRecv( mPendingRecvs.front() );
+	}
+}
+
+void Connection::handleFrameRecv( const boost::system::error_code & error, size_t actualBytes )
+{
+	NETWORK_METRIC( HandlerTimer handlerTimer( *mHiveMetrics ); )
+	NETWORK_TRACE( TraceScope traceScope( "Connection::handleFrameRecv", this ); )
+	if( error || hasError() || mHive->hasStopped() )
+	{
+		startError( error );
+		return;
+	}
+    
+	updateRecv( mFrameBuffer.size() - mFrameEnd, actualBytes );
+	mFrameEnd += actualBytes;
+	NETWORK_METRIC( mMetrics.addRecv( actualBytes, 0 ); mHiveMetrics->addRecv( actualBytes, 0 ); )
+	size_t prefixBytes = static_cast< size_t >( mFramePrefixBytes );
+	while( mFrameEnd - mFrameBegin >= prefixBytes )
+	{
+		const uint8_t * header = &mFrameBuffer[ mFrameBegin ];
+		uint64_t frameBytes = 0;
+		for( size_t i = 0; i < prefixBytes; ++i )
+		{
+			frameBytes = ( frameBytes << 8 ) | header[ mFrameBigEndian ? i : prefixBytes - 1 - i ];
+		}
+		if( frameBytes > mFrameMaxBytes )
+		{
+			startError( boost::asio::error::message_size );
+			return;
+		}
+		if( mFrameEnd - mFrameBegin - prefixBytes < frameBytes )
+		{
+			break;
+		}
+		mFrameBegin += prefixBytes + static_cast< size_t >( frameBytes );
+		NETWORK_METRIC( mMetrics.addRecv( 0 ); mHiveMetrics->addRecv( 0 ); )
+		{
+			NETWORK_TRACE( TraceScope traceScope( "Connection::onRecvFrame", this ); )
+			onRecvFrame( header + prefixBytes, static_cast< size_t >( frameBytes ) );
+		}
+		if( hasError() )
+		{
+			return;
+		}
+	}
+	if( mFrameBegin == mFrameEnd )
+	{
+		mFrameBegin = 0;
+		mFrameEnd = 0;
+	}
+	startFrameRecv();
+}
+
+void Connection::clearQueues()
+{
+#if NETWORK_METRICS
+	// Sends and recvs still queued never complete, take them off the
+	// shared gauges.
+	mHiveMetrics->removeSendQueued( mSendQueueTimes.size() );
+	mHiveMetrics->removePendingRecv( mFrameReading ? 1 : mPendingRecvs.size() );
+	mSendQueueTimes.clear();
+#endif
+	mRecvLease.reset();
+	mPendingRecvs.clear();
+	mPendingRecvTargets.clear();
+	mPendingSends.clear();
+	mPendingSources.clear();
+	mSendBuffers.clear();
+	mSendQueueBytes.store( 0, std::memory_order_relaxed );
+	mSendQueueFull = false;
+	{
+		std::lock_guard< std::mutex > lock( mDrainMutex );
+		mDrainGroups.clear();
+		mDrainWatched.store( false, std::memory_order_relaxed );
+	}
+	mFrameBegin = 0;
+	mFrameEnd = 0;
+	mFrameReading = false;
+	mConnectSockets.clear();
+	mConnectEndpoints.clear();
+	mConnectNext = 0;
+#if NETWORK_COROUTINES
+	mConnectAwaitable = 0;
+#endif
+#if NETWORK_SHM
+	mShm.reset();
+	mShmReading = false;
+	mShmSending = false;
+#endif
+}
+
+void Connection::recycle()
+{
+	// Only called once the last reference is gone, so no handler of this
+	// connection is pending.
+	boost::system::error_code ec;
+	mSocket.close( ec );
+	mTimerWheel.cancel( mTimerEntry );
+	mTimerWheel.cancel( mConnectEntry );
+	clearQueues();
+	std::vector< uint8_t >().swap( mFrameBuffer );
+	NETWORK_METRIC( mMetrics.reset(); )
+	mSendShutdown = false;
+	mReceiveBufferSize = mReceiveBufferStartSize;
+	mAdaptiveLowReads = 0;
+	mState.store( STATE_CONNECTING, std::memory_order_release );
+	onRecycle();
+}
+
+void Connection::onRecycle()
+{
+}
+
+void Connection::onRecvFrame( const uint8_t * data, size_t size )
+{
+	std::vector< uint8_t > buffer( data, data + size );
+	onRecv( buffer );
+}
+
+void Connection::onRecvLease( const RecvLease & lease )
+{
+	onRecv( lease->getBuffer() );
+}
+
+void Connection::onRecvInto( const std::vector< boost::asio::mutable_buffer > &, size_t )
+{
+}
+
+void Connection::handleTimer( const boost::system::error_code & error )
+{
+	NETWORK_METRIC( HandlerTimer handlerTimer( *mHiveMetrics ); )
+	NETWORK_TRACE( TraceScope traceScope( "Connection::handleTimer", this ); )
+	if( error || hasError() || mHive->hasStopped() )
+	{
+		startError( error );
+	}
+	else if( mSendShutdown && std::chrono::duration_cast< std::chrono::milliseconds >( mTimerWheel.getTime() - mDrainTime ).count() >= mLingerTimeout )
+	{
+		startError( boost::asio::error::timed_out );
+	}
+	else
+	{
+		onTimer( mTimerWheel.getElapsed( mLastTime ) );
+		startTimer();
+	}
+}
+
+void Connection::handleShutdown()
+{
+	NETWORK_TRACE( TraceScope traceScope( "Connection::handleShutdown", this ); )
+	State state = getState();
+	if( state == STATE_DRAINING )
+	{
+		// Sends made before Shutdown were posted ahead of this handler, so
+		// they are already queued.
+		if( mPendingSends.empty() )
+		{
+			startDrain();
+		}
+	}
+	else if( state == STATE_CONNECTING )
+	{
+		// Nothing was exchanged yet, there is nothing to drain.
+		startError( boost::asio::error::operation_aborted );
+	}
+}
+
+#if NETWORK_SHM
+
+void Connection::startShmConnect( const std::string & host, uint16_t port )
+{
+	mShm.reset( new ShmChannel( mIoService ) );
+	boost::system::error_code ec;
+	std::string path = ShmChannel::getPath( host.substr( 6 ), port, ec );
+	if( ec )
+	{
+		mIoStrand.post( makeAllocHandler( mHandlerAllocator, boost::bind( &Connection::handleShmConnect, shared_from_this(), ec, host, port ) ) );
+		return;
+	}
+	boost::asio::local::stream_protocol::endpoint endpoint( path );
+	mShm->getSocket().async_connect( endpoint, mIoStrand.wrap( makeAllocHandler( mHandlerAllocator, boost::bind( &Connection::handleShmConnect, shared_from_this(), _1, host, port ) ) ) );
+}
+
+void Connection::startShmWake()
+{
+	mShm->getSocket().async_read_some( mShm->getWakeBuffer(), mIoStrand.wrap( makeAllocHandler( mHandlerAllocator, boost::bind( &Connection::handleShmWake, shared_from_this(), _1, _2 ) ) ) );
+}
+
+void Connection::startShmRead( uint8_t * data, size_t size, size_t minBytes, ShmRead kind )
+{
+	mShmReadData = data;
+	mShmReadBytes = size;
+	mShmReadMinBytes = minBytes;
+	mShmReadDone = 0;
+	mShmReadKind = kind;
+	mShmReading = true;
+	continueShmRead();
+}
+
+void Connection::continueShmRead()
+{
+	while( true )
+	{
+		boost::system::error_code ec;
+		mShmReadDone += mShm->read( mShmReadData + mShmReadDone, mShmReadBytes - mShmReadDone, ec );
+		if( ec )
+		{
+			mShmReading = false;
+			startError( ec );
+			return;
+		}
+		if( mShmReadDone >= mShmReadMinBytes )
+		{
+			// Completed through the strand like a socket read, so a
+			// stream of reads does not recurse.
+			mShmReading = false;
+			switch( mShmReadKind )
+			{
+			case SHM_READ_FRAME:
+				mIoStrand.post( makeAllocHandler( mHandlerAllocator, boost::bind( &Connection::handleFrameRecv, shared_from_this(), boost::system::error_code(), mShmReadDone ) ) );
+				break;
+			case SHM_READ_INTO:
+				mIoStrand.post( makeAllocHandler( mHandlerAllocator, boost::bind( &Connection::handleRecvInto, shared_from_this(), boost::system::error_code(), mShmReadDone ) ) );
+				break;
+			default:
+				mIoStrand.post( makeAllocHandler( mHandlerAllocator, boost::bind( &Connection::handleRecv, shared_from_this(), boost::system::error_code(), static_cast< int32_t >( mShmReadDone ) ) ) );
+				break;
+			}
+			return;
+		}
+		if( mShm->isDrained() )
+		{
+			mShmReading = false;
+			startError( boost::asio::error::eof );
+			return;
+		}
+		if( mShm->waitRead() )
+		{
+			return;
+		}
+	}
+}
+
+void Connection::continueShmSend()
+{
+	if( mShm->isPeerClosed() )
+	{
+		mShmSending = false;
+		startError( boost::asio::error::broken_pipe );
+		return;
+	}
+	while( true )
+	{
+		while( mShmSendBuffer < mSendBuffers.size() )
+		{
+			const boost::asio::const_buffer & buffer = mSendBuffers[ mShmSendBuffer ];
+			size_t size = boost::asio::buffer_size( buffer );
+			boost::system::error_code ec;
+			mShmSendOffset += mShm->write( boost::asio::buffer_cast< const uint8_t * >( buffer ) + mShmSendOffset, size - mShmSendOffset, ec );
+			if( ec )
+			{
+				mShmSending = false;
+				startError( ec );
+				return;
+			}
+			if( mShmSendOffset < size )
+			{
+				break;
+			}
+			++mShmSendBuffer;
+			mShmSendOffset = 0;
+		}
+		if( mShmSendBuffer == mSendBuffers.size() )
+		{
+			mShmSending = false;
+			mIoStrand.post( makeAllocHandler( mHandlerAllocator, boost::bind( &Connection::handleSend, shared_from_this(), boost::system::error_code(), mSendBuffers.size(), mShmSendBytes ) ) );
+			return;
+		}
+		if( mShm->waitWrite() )
+		{
+			return;
+		}
+	}
+}
+
+void Connection::handleShmConnect( const boost::system::error_code & error, const std::string & host, uint16_t port )
+{
+	NETWORK_METRIC( HandlerTimer handlerTimer( *mHiveMetrics ); )
+	NETWORK_TRACE( TraceScope traceScope( "Connection::handleShmConnect", this ); )
+	if( error || hasError() || mHive->hasStopped() )
+	{
+		startError( error );
+		return;
+	}
+	// The acceptor answers with the name of the segment it created.
+	boost::asio::async_read( mShm->getSocket(), mShm->getNameBuffer(), mIoStrand.wrap( makeAllocHandler( mHandlerAllocator, boost::bind( &Connection::handleShmHandshake, shared_from_this(), _1, host, port ) ) ) );
+}
+
+void Connection::handleShmHandshake( const boost::system::error_code & error, const std::string & host, uint16_t port )
+{
+	NETWORK_METRIC( HandlerTimer handlerTimer( *mHiveMetrics ); )
+	NETWORK_TRACE( TraceScope traceScope( "Connection::handleShmHandshake", this ); )
+	boost::system::error_code ec = error;
+	if( !ec && !hasError() && !mHive->hasStopped() )
+	{
+		mShm->open( ec );
+	}
+	if( ec || hasError() || mHive->hasStopped() )
+	{
+		startError( ec );
+		return;
+	}
+	startOpen();
+	startShmWake();
+	onConnect( host, port );
+}
+
+void Connection::handleShmWake( const boost::system::error_code & error, size_t )
+{
+	NETWORK_METRIC( HandlerTimer handlerTimer( *mHiveMetrics ); )
+	NETWORK_TRACE( TraceScope traceScope( "Connection::handleShmWake", this ); )
+	if( hasError() || mHive->hasStopped() || ( error && error != boost::asio::error::eof ) )
+	{
+		startError( error );
+		return;
+	}
+	if( error )
+	{
+		// The peer is gone, but what it wrote before is still readable.
+		mShm->setPeerClosed();
+	}
+	if( mShmReading )
+	{
+		continueShmRead();
+	}
+	else if( error && mShm->isDrained() )
+	{
+		startError( error );
+	}
+	if( mShmSending && !hasError() )
+	{
+		continueShmSend();
+	}
+	if( !error && !hasError() )
+	{
+		startShmWake();
+	}
+}
+
+#endif
+
+void Connection::dispatchSend( const SharedBuffer & buffer )
+{
+	NETWORK_TRACE( TraceScope traceScope( "Connection::dispatchSend", this ); )
+	if( mSendShutdown )
+	{
+		// Only a Send racing Shutdown on another thread gets here, the
+		// send side is already closed.
+		mSendQueueBytes.fetch_sub( buffer->size(), std::memory_order_relaxed );
+		return;
+	}
+	bool shouldStartSend = mPendingSends.empty();
+	mPendingSends.push_back( buffer );
+	NETWORK_METRIC( mMetrics.addSendQueued(); mHiveMetrics->addSendQueued(); mSendQueueTimes.push_back( Metrics::now() ); )
+	if( !mSendQueueFull && mSendQueueHighBytes > 0 )
+	{
+		uint64_t queuedBytes = mSendQueueBytes.load( std::memory_order_relaxed );
+		if( queuedBytes >= mSendQueueHighBytes )
+		{
+			mSendQueueFull = true;
+			onSendQueueFull( queuedBytes );
+		}
+	}
+	if( shouldStartSend )
+	{
+		startSend();
+	}
+}
+
+void Connection::dispatchSendSource( const boost::shared_ptr< SendSource > & source )
+{
+	NETWORK_TRACE( TraceScope traceScope( "Connection::dispatchSendSource", this ); )
+	if( mSendShutdown )
+	{
+		mSendQueueBytes.fetch_sub( source->mBytes, std::memory_order_relaxed );
+#if NETWORK_COROUTINES
+		if( source->mAwaitable )
+		{
+			source->mAwaitable->post( mIoStrand, mHandlerAllocator, boost::asio::error::shut_down, 0 );
+		}
+#endif
+		return;
+	}
+	mPendingSources.push_back( source );
+	dispatchSend( SharedBuffer() );
+}
+
+void Connection::onSendProgress( uint64_t, uint64_t )
+{
+}
+
+void Connection::onSendQueueFull( uint64_t )
+{
+}
+
+void Connection::onDrain( uint64_t )
+{
+}
+
+void Connection::onSendBatch( size_t, uint64_t )
+{
+}
+
+void Connection::dispatchRecv( int32_t totalBytes )
+{
+	NETWORK_TRACE( TraceScope traceScope( "Connection::dispatchRecv", this ); )
+	if( mFramePrefixBytes > 0 )
+	{
+		// Framed reads are continuous, only the first request starts them.
+		if( !mFrameReading )
+		{
+			mFrameReading = true;
+			NETWORK_METRIC( mMetrics.addPendingRecv(); mHiveMetrics->addPendingRecv(); )
+			startFrameRecv();
+		}
+		return;
+	}
+    
+	bool shouldStartReceive = mPendingRecvs.empty();
+	mPendingRecvs.push_back( totalBytes );
+	NETWORK_METRIC( mMetrics.addPendingRecv(); mHiveMetrics->addPendingRecv(); )
+	if( shouldStartReceive )
+	{
+		startRecv( totalBytes );
+	}
+}
+
+void Connection::dispatchRecvInto( const std::vector< boost::asio::mutable_buffer > & buffers )
+{
+	NETWORK_TRACE( TraceScope traceScope( "Connection::dispatchRecvInto", this ); )
+	RecvTarget target;
+	target.mBuffers = buffers;
+	target.mBytes = boost::asio::buffer_size( buffers );
+	target.mDone = 0;
+	mPendingRecvTargets.push_back( target );
+	dispatchRecv( RECV_INTO );
+}
+
+void Connection::dispatchTimer( const boost::shared_ptr< void > & owner )
+{
+	boost::shared_ptr< Connection > connection = boost::static_pointer_cast< Connection >( owner );
+	connection->mIoStrand.post( makeAllocHandler( connection->mHandlerAllocator, boost::bind( &Connection::handleTimer, connection, boost::system::error_code() ) ) );
+}
+
+void Connection::setConnectAttemptDelay( int32_t delayMilli )
+{
+	mConnectAttemptDelay = delayMilli;
+}
+
+int32_t Connection::getConnectAttemptDelay() const
+{
+	return mConnectAttemptDelay;
+}
+
+void Connection::connect( const std::string & host, uint16_t port)
+{
+#if NETWORK_SHM
+	if( host.compare( 0, 6, "shm://" ) == 0 )
+	{
+		startShmConnect( host, port );
+		startTimer();
+		return;
+	}
+#endif
+	mHive->getResolver().resolve( host, mIoStrand.wrap( makeAllocHandler( mHandlerAllocator, boost::bind( &Connection::handleResolve, shared_from_this(), _1, _2, port ) ) ) );
+	startTimer();
+}
+
+void Connection::disconnect()
+{
+	NETWORK_TRACE( Tracer::instant( "Connection::disconnect", this ); )
+	mIoStrand.post( makeAllocHandler( mHandlerAllocator, boost::bind( &Connection::handleTimer, shared_from_this(), boost::asio::error::connection_reset ) ) );
+}
+
+void Connection::shutdown()
+{
+	NETWORK_TRACE( Tracer::instant( "Connection::shutdown", this ); )
+	// Draining starts here rather than on the strand, so a Send made after
+	// Shutdown returns is refused instead of being queued and dropped.
+	State state = STATE_OPEN;
+	if( mState.compare_exchange_strong( state, STATE_DRAINING, std::memory_order_acq_rel ) || state == STATE_CONNECTING )
+	{
+		mIoStrand.post( makeAllocHandler( mHandlerAllocator, boost::bind( &Connection::handleShutdown, shared_from_this() ) ) );
+	}
+}
+
+void Connection::recv( int32_t totalBytes )
+{
+	// Negative counts read whatever arrives, like 0, and can never be
+	// mistaken for the RECV_INTO marker.
+	totalBytes = std::max( totalBytes, 0 );
+	NETWORK_TRACE( Tracer::instant( "Connection::recv", this, static_cast< uint64_t >( totalBytes ) ); )
+	mIoStrand.post( makeAllocHandler( mHandlerAllocator, boost::bind( &Connection::dispatchRecv, shared_from_this(), totalBytes ) ) );
+}
+
+bool Connection::recvInto( void * data, size_t size )
+{
+	return recvInto( std::vector< boost::asio::mutable_buffer >( 1, boost::asio::mutable_buffer( data, size ) ) );
+}
+
+bool Connection::recvInto( const std::vector< boost::asio::mutable_buffer > & buffers )
+{
+	// Framing is set before the first read, so a read into caller memory
+	// is refused here rather than ending the connection on the strand.
+	if( mFramePrefixBytes > 0 )
+	{
+		return false;
+	}
+	// An empty read has nothing to wait for and is not queued.
+	if( boost::asio::buffer_size( buffers ) > 0 )
+	{
+		NETWORK_TRACE( Tracer::instant( "Connection::recvInto", this, boost::asio::buffer_size( buffers ) ); )
+		mIoStrand.post( makeAllocHandler( mHandlerAllocator, boost::bind( &Connection::dispatchRecvInto, shared_from_this(), buffers ) ) );
+	}
+	return true;
+}
+
+bool Connection::admitSend( size_t bytes )
+{
+	// Bytes are counted when they are posted, so the queue size includes
+	// buffers still waiting on the strand.
+	uint64_t queuedBytes = mSendQueueBytes.load( std::memory_order_relaxed );
+	if( mSendQueueHighBytes == 0 || queuedBytes < mSendQueueHighBytes )
+	{
+		mSendQueueBytes.fetch_add( bytes, std::memory_order_relaxed );
+		return true;
+	}
+	switch( mSendQueuePolicy )
+	{
+	case SEND_QUEUE_DROP:
+		break;
+	case SEND_QUEUE_DISCONNECT:
+		disconnect();
+		break;
+	default:
+		mSendQueueBytes.fetch_add( bytes, std::memory_order_relaxed );
+		break;
+	}
+	return false;
+}
+
+bool Connection::send( const std::vector< uint8_t > & buffer )
+{
+	if( getState() >= STATE_DRAINING )
+	{
+		return false;
+	}
+	bool admitted = admitSend( buffer.size() );
+	if( admitted || mSendQueuePolicy == SEND_QUEUE_NOTIFY )
+	{
+		NETWORK_TRACE( Tracer::instant( "Connection::send", this, buffer.size() ); )
+		mIoStrand.post( makeAllocHandler( mHandlerAllocator, boost::bind( &Connection::dispatchSend, shared_from_this(), SharedBuffer( boost::make_shared< std::vector< uint8_t > >( buffer ) ) ) ) );
+	}
+	return admitted;
+}
+
+bool Connection::send( std::vector< uint8_t > && buffer )
+{
+	if( getState() >= STATE_DRAINING )
+	{
+		return false;
+	}
+	bool admitted = admitSend( buffer.size() );
+	if( admitted || mSendQueuePolicy == SEND_QUEUE_NOTIFY )
+	{
+		NETWORK_TRACE( Tracer::instant( "Connection::send", this, buffer.size() ); )
+		mIoStrand.post( makeAllocHandler( mHandlerAllocator, boost::bind( &Connection::dispatchSend, shared_from_this(), SharedBuffer( boost::make_shared< std::vector< uint8_t > >( std::move( buffer ) ) ) ) ) );
+	}
+	return admitted;
+}
+
+bool Connection::send( const SharedBuffer & buffer )
+{
+	bool admitted = false;
+	postSend( buffer, admitted );
+	return admitted;
+}
+
+bool Connection::postSend( const SharedBuffer & buffer, bool & admitted )
+{
+	admitted = false;
+	if( getState() >= STATE_DRAINING )
+	{
+		return false;
+	}
+	admitted = admitSend( buffer->size() );
+	if( admitted || mSendQueuePolicy == SEND_QUEUE_NOTIFY )
+	{
+		NETWORK_TRACE( Tracer::instant( "Connection::send", this, buffer->size() ); )
+		mIoStrand.post( makeAllocHandler( mHandlerAllocator, boost::bind( &Connection::dispatchSend, shared_from_this(), buffer ) ) );
+		return true;
+	}
+	return false;
+}
+
+void Connection::watchDrain( const boost::weak_ptr< BroadcastGroup > & group )
+{
+	std::lock_guard< std::mutex > lock( mDrainMutex );
+	for( size_t i = 0; i < mDrainGroups.size(); ++i )
+	{
+		if( !mDrainGroups[ i ].owner_before( group ) && !group.owner_before( mDrainGroups[ i ] ) )
+		{
+			return;
+		}
+	}
+	mDrainGroups.push_back( group );
+	mDrainWatched.store( true, std::memory_order_seq_cst );
+}
+
+void Connection::notifyDrain()
+{
+	// A group still waiting for the queue to shrink watches again from
+	// its Flush.
+	std::vector< boost::weak_ptr< BroadcastGroup > > groups;
+	{
+		std::lock_guard< std::mutex > lock( mDrainMutex );
+		groups.swap( mDrainGroups );
+		mDrainWatched.store( false, std::memory_order_relaxed );
+	}
+	for( size_t i = 0; i < groups.size(); ++i )
+	{
+		boost::shared_ptr< BroadcastGroup > group = groups[ i ].lock();
+		if( group )
+		{
+			group->flush( shared_from_this() );
+		}
+	}
+}
+
+bool Connection::sendFrame( const std::vector< uint8_t > & payload )
+{
+	size_t prefixBytes = static_cast< size_t >( mFramePrefixBytes );
+	uint64_t frameBytes = payload.size();
+	if( prefixBytes == 0 || frameBytes > mFrameMaxBytes || ( prefixBytes < 8 && frameBytes >> ( 8 * prefixBytes ) != 0 ) )
+	{
+		return false;
+	}
+	boost::shared_ptr< std::vector< uint8_t > > buffer = boost::make_shared< std::vector< uint8_t > >( prefixBytes + payload.size() );
+	for( size_t i = 0; i < prefixBytes; ++i )
+	{
+		( *buffer )[ mFrameBigEndian ? prefixBytes - 1 - i : i ] = static_cast< uint8_t >( frameBytes >> ( 8 * i ) );
+	}
+	if( !payload.empty() )
+	{
+		std::memcpy( &( *buffer )[ prefixBytes ], &payload[ 0 ], payload.size() );
+	}
+	return send( SharedBuffer( buffer ) );
+}
+
+bool Connection::postSendSource( const boost::shared_ptr< SendSource > & source )
+{
+	if( getState() >= STATE_DRAINING )
+	{
+		return false;
+	}
+	bool admitted = admitSend( static_cast< size_t >( source->mBytes ) );
+	if( admitted || mSendQueuePolicy == SEND_QUEUE_NOTIFY )
+	{
+		NETWORK_TRACE( Tracer::instant( "Connection::send", this, source->mBytes ); )
+		mIoStrand.post( makeAllocHandler( mHandlerAllocator, boost::bind( &Connection::dispatchSendSource, shared_from_this(), source ) ) );
+	}
+	return admitted;
+}
+
+#if NETWORK_SENDFILE
+
+bool Connection::sendFile( const std::string & path, uint64_t offset, uint64_t length )
+{
+	boost::shared_ptr< SendSource > source = boost::make_shared< SendSource >();
+	source->mFile = ::open( path.c_str(), O_RDONLY );
+	struct stat status;
+	if( source->mFile < 0 || ::fstat( source->mFile, &status ) != 0 || offset > static_cast< uint64_t >( status.st_size ) )
+	{
+		return false;
+	}
+	source->mOffset = offset;
+	source->mBytes = length > 0 ? length : static_cast< uint64_t >( status.st_size ) - offset;
+	if( source->mBytes == 0 )
+	{
+		return true;
+	}
+	if( offset + source->mBytes > static_cast< uint64_t >( status.st_size ) )
+	{
+		return false;
+	}
+	return postSendSource( source );
+}
+
+#endif
+
+bool Connection::sendRegion( const void * data, size_t size, const boost::shared_ptr< const void > & owner )
+{
+	if( size == 0 )
+	{
+		return true;
+	}
+	boost::shared_ptr< SendSource > source = boost::make_shared< SendSource >();
+	source->mData = static_cast< const uint8_t * >( data );
+	source->mOwner = owner;
+	source->mBytes = size;
+	return postSendSource( source );
+}
+
+boost::asio::io_service & Connection::getService()
+{
+	return mIoService;
+}
+
+boost::asio::ip::tcp::socket & Connection::getSocket()
+{
+	return mSocket;
+}
+
+NetworkStrand & Connection::getStrand()
+{
+	return mIoStrand;
+}
+
+HandlerAllocator & Connection::getHandlerAllocator()
+{
+	return mHandlerAllocator;
+}
+
+boost::shared_ptr< Hive > Connection::getHive()
+{
+	return mHive;
+}
+
+void Connection::setReceiveBufferSize( int32_t size )
+{
+	mReceiveBufferSize = size;
+	mReceiveBufferStartSize = size;
+}
+
+int32_t Connection::getReceiveBufferSize() const
+{
+	return mReceiveBufferSize;
+}
+
+void Connection::setAdaptiveReceive( bool enabled, int32_t minBytes, int32_t maxBytes )
+{
+	mAdaptiveReceive = enabled;
+	mAdaptiveMinBytes = std::max( minBytes, 1 );
+	mAdaptiveMaxBytes = std::max( maxBytes, mAdaptiveMinBytes );
+	mAdaptiveLowReads = 0;
+	mReceiveBufferSize = std::min( std::max( mReceiveBufferSize, mAdaptiveMinBytes ), mAdaptiveMaxBytes );
+	mReceiveBufferStartSize = mReceiveBufferSize;
+}
+
+bool Connection::getAdaptiveReceive() const
+{
+	return mAdaptiveReceive;
+}
+
+void Connection::setSocketOptions( const SocketOptions & options )
+{
+	mSocketOptions = options;
+	mSocketOptionsSet = true;
+}
+
+const SocketOptions & Connection::getSocketOptions() const
+{
+	return mSocketOptions;
+}
+
+int32_t Connection::getTimerInterval() const
+{
+	return mTimerInterval;
+}
+
+void Connection::setTimerInterval( int32_t timerInterval )
+{
+	mTimerInterval = timerInterval;
+}
+
+void Connection::setSendCoalescing( bool enabled )
+{
+	mSendCoalescing = enabled;
+}
+
+bool Connection::getSendCoalescing() const
+{
+	return mSendCoalescing;
+}
+
+void Connection::setSendBatchLimits( int32_t maxBytes, int32_t maxBuffers )
+{
+	mSendBatchMaxBytes = maxBytes;
+	mSendBatchMaxBuffers = maxBuffers;
+}
+
+int32_t Connection::getSendBatchMaxBytes() const
+{
+	return mSendBatchMaxBytes;
+}
+
+int32_t Connection::getSendBatchMaxBuffers() const
+{
+	return mSendBatchMaxBuffers;
+}
+
+void Connection::setSendNotifyPerBatch( bool perBatch )
+{
+	mSendNotifyPerBatch = perBatch;
+}
+
+bool Connection::getSendNotifyPerBatch() const
+{
+	return mSendNotifyPerBatch;
+}
+
+void Connection::setSendQueueWatermarks( uint64_t highBytes, uint64_t lowBytes )
+{
+	mSendQueueHighBytes = highBytes;
+	mSendQueueLowBytes = std::min( lowBytes, highBytes );
+}
+
+uint64_t Connection::getSendQueueHighWatermark() const
+{
+	return mSendQueueHighBytes;
+}
+
+uint64_t Connection::getSendQueueLowWatermark() const
+{
+	return mSendQueueLowBytes;
+}
+
+void Connection::setSendQueuePolicy( SendQueuePolicy policy )
+{
+	mSendQueuePolicy = policy;
+}
+
+Connection::SendQueuePolicy Connection::getSendQueuePolicy() const
+{
+	return mSendQueuePolicy;
+}
+
+uint64_t Connection::getSendQueueBytes() const
+{
+	return mSendQueueBytes.load( std::memory_order_relaxed );
+}
+
+void Connection::setFraming( int32_t prefixBytes, bool bigEndian, uint64_t maxFrameBytes )
+{
+	if( prefixBytes != 0 && prefixBytes != 1 && prefixBytes != 2 && prefixBytes != 4 && prefixBytes != 8 )
+	{
+		throw std::invalid_argument( "frame prefix must be 1, 2, 4 or 8 bytes" );
+	}
+	mFramePrefixBytes = prefixBytes;
+	mFrameBigEndian = bigEndian;
+	mFrameMaxBytes = maxFrameBytes;
+}
+
+int32_t Connection::getFramePrefixBytes() const
+{
+	return mFramePrefixBytes;
+}
+
+bool Connection::getFrameBigEndian() const
+{
+	return mFrameBigEndian;
+}
+
+uint64_t Connection::getFrameMaxBytes() const
+{
+	return mFrameMaxBytes;
+}
+
+MetricsSnapshot Connection::getMetrics() const
+{
+#if NETWORK_METRICS
+	return mMetrics.getSnapshot();
+#else
+	return MetricsSnapshot();
+#endif
+}
+
+bool Connection::hasError()
+{
+	return mState.load( std::memory_order_acquire ) == STATE_CLOSED;
+}
+
+Connection::State Connection::getState() const
+{
+	return mState.load( std::memory_order_acquire );
+}
+
+void Connection::setLingerTimeout( int32_t timeoutMilli )
+{
+	mLingerTimeout = timeoutMilli;
+}
+
+int32_t Connection::getLingerTimeout() const
+{
+	return mLingerTimeout;
+}
+
+//-----------------------------------------------------------------------------
+
+ConnectionPool::Recycler::Recycler( const boost::shared_ptr< ConnectionPool > & pool )
+: mPool( pool )
+{
+}
+
+void ConnectionPool::Recycler::operator()( Connection * connection ) const
+{
+	boost::shared_ptr< ConnectionPool > pool = mPool.lock();
+	if( pool )
+	{
+		pool->release( connection );
+	}
+	else
+	{
+		delete connection;
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+ConnectionPool::ConnectionPool( boost::shared_ptr< Hive > hive, const Constructor & constructor, size_t maxFreeConnections )
+: mHive( hive ), mConstructor( constructor ), mFreeConnections( hive->getServiceCount() ), mMaxFreeConnections( maxFreeConnections ), mLeasedCount( 0 ), mCreatedCount( 0 ), mReusedCount( 0 )
+{
+}
+
+ConnectionPool::~ConnectionPool()
+{
+	for( size_t i = 0; i < mFreeConnections.size(); ++i )
+	{
+		for( size_t j = 0; j < mFreeConnections[ i ].size(); ++j )
+		{
+			delete mFreeConnections[ i ][ j ];
+		}
+	}
+}
+
+boost::shared_ptr< Connection > ConnectionPool::acquire()
+{
+	return acquire( mHive->getServiceIndex( mHive->getNextService() ) );
+}
+
+boost::shared_ptr< Connection > ConnectionPool::acquire( size_t affinityKey )
+{
+	size_t index = affinityKey % mFreeConnections.size();
+	Connection * connection = 0;
+	{
+		std::lock_guard< std::mutex > lock( mMutex );
+		if( !mFreeConnections[ index ].empty() )
+		{
+			connection = mFreeConnections[ index ].back();
+			mFreeConnections[ index ].pop_back();
+			++mReusedCount;
+		}
+		else
+		{
+			++mCreatedCount;
+		}
+		++mLeasedCount;
+	}
+	if( !connection )
+	{
+		// The index is an affinity key selecting the same io_service.
+		connection = mConstructor( mHive, index );
+	}
+	return boost::shared_ptr< Connection >( connection, Recycler( shared_from_this() ) );
+}
+
+void ConnectionPool::release( Connection * connection )
+{
+	connection->recycle();
+	size_t index = mHive->getServiceIndex( connection->getService() );
+	{
+		std::lock_guard< std::mutex > lock( mMutex );
+		--mLeasedCount;
+		if( mFreeConnections[ index ].size() < mMaxFreeConnections )
+		{
+			mFreeConnections[ index ].push_back( connection );
+			return;
+		}
+	}
+	delete connection;
+}
+
+void ConnectionPool::reserve( size_t count )
+{
+	for( size_t i = 0; i < count; ++i )
+	{
+		size_t index = i % mFreeConnections.size();
+		Connection * connection = mConstructor( mHive, index );
+		std::lock_guard< std::mutex > lock( mMutex );
+		++mCreatedCount;
+		if( mFreeConnections[ index ].size() >= mMaxFreeConnections )
+		{
+			delete connection;
+			break;
+		}
+		mFreeConnections[ index ].push_back( connection );
+	}
+}
+
+Acceptor::ConnectionFactory ConnectionPool::getFactory()
+{
+	return boost::bind( static_cast< boost::shared_ptr< Connection > ( ConnectionPool::* )( size_t ) >( &ConnectionPool::acquire ), shared_from_this(), _2 );
+}
+
+void ConnectionPool::setMaxFreeConnections( size_t maxFreeConnections )
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	mMaxFreeConnections = maxFreeConnections;
+}
+
+size_t ConnectionPool::getMaxFreeConnections()
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	return mMaxFreeConnections;
+}
+
+size_t ConnectionPool::getFreeCount()
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	size_t count = 0;
+	for( size_t i = 0; i < mFreeConnections.size(); ++i )
+	{
+		count += mFreeConnections[ i ].size();
+	}
+	return count;
+}
+
+size_t ConnectionPool::getLeasedCount()
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	return mLeasedCount;
+}
+
+uint64_t ConnectionPool::getCreatedCount()
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	return mCreatedCount;
+}
+
+uint64_t ConnectionPool::getReusedCount()
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	return mReusedCount;
+}
+
+//-----------------------------------------------------------------------------
+
+BroadcastGroup::BroadcastGroup( uint64_t slowBytes, SlowPolicy slowPolicy )
+: mSlowBytes( slowBytes ), mSlowPolicy( slowPolicy ), mPublishCount( 0 ), mSkipCount( 0 ), mCoalesceCount( 0 )
+{
+}
+
+BroadcastGroup::~BroadcastGroup()
+{
+}
+
+void BroadcastGroup::add( boost::shared_ptr< Connection > connection )
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	Member member;
+	member.mConnection = connection;
+	mMembers.push_back( member );
+}
+
+void BroadcastGroup::remove( boost::shared_ptr< Connection > connection )
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	std::vector< Member >::iterator itr = mMembers.begin();
+	while( itr != mMembers.end() )
+	{
+		if( itr->mConnection.expired() || itr->mConnection.lock() == connection )
+		{
+			itr = mMembers.erase( itr );
+		}
+		else
+		{
+			++itr;
+		}
+	}
+}
+
+size_t BroadcastGroup::getMemberCount()
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	return mMembers.size();
+}
+
+size_t BroadcastGroup::publish( const std::vector< uint8_t > & buffer )
+{
+	return publish( SharedBuffer( boost::make_shared< std::vector< uint8_t > >( buffer ) ) );
+}
+
+size_t BroadcastGroup::publish( std::vector< uint8_t > && buffer )
+{
+	return publish( SharedBuffer( boost::make_shared< std::vector< uint8_t > >( std::move( buffer ) ) ) );
+}
+
+size_t BroadcastGroup::publish( const SharedBuffer & buffer )
+{
+	// Members are only picked under the lock. Sending posts to every
+	// member's strand, which is done after releasing it.
+	std::vector< boost::shared_ptr< Connection > > sends;
+	std::vector< boost::shared_ptr< Connection > > kept;
+	uint64_t slowBytes;
+	{
+		std::lock_guard< std::mutex > lock( mMutex );
+		++mPublishCount;
+		slowBytes = mSlowBytes;
+		sends.reserve( mMembers.size() );
+		std::vector< Member >::iterator itr = mMembers.begin();
+		while( itr != mMembers.end() )
+		{
+			boost::shared_ptr< Connection > connection = itr->mConnection.lock();
+			if( !connection || connection->hasError() )
+			{
+				itr = mMembers.erase( itr );
+				continue;
+			}
+			if( connection->getSendQueueBytes() >= slowBytes )
+			{
+				if( mSlowPolicy == BROADCAST_LATEST )
+				{
+					if( itr->mLatest )
+					{
+						++mCoalesceCount;
+					}
+					itr->mLatest = buffer;
+					kept.push_back( connection );
+				}
+				else
+				{
+					++mSkipCount;
+				}
+			}
+			else
+			{
+				// The new payload supersedes one kept while the member was slow.
+				if( itr->mLatest )
+				{
+					++mCoalesceCount;
+					itr->mLatest.reset();
+				}
+				sends.push_back( connection );
+			}
+			++itr;
+		}
+	}
+    
+	size_t count = 0;
+	size_t refused = 0;
+	for( size_t i = 0; i < sends.size(); ++i )
+	{
+		bool admitted;
+		if( sends[ i ]->postSend( buffer, admitted ) )
+		{
+			++count;
+		}
+		else
+		{
+			++refused;
+		}
+	}
+	for( size_t i = 0; i < kept.size(); ++i )
+	{
+		flush( kept[ i ] );
+	}
+	if( refused > 0 )
+	{
+		std::lock_guard< std::mutex > lock( mMutex );
+		mSkipCount += refused;
+	}
+	return count;
+}
+
+size_t BroadcastGroup::flush()
+{
+	std::vector< boost::shared_ptr< Connection > > connections;
+	{
+		std::lock_guard< std::mutex > lock( mMutex );
+		for( size_t i = 0; i < mMembers.size(); ++i )
+		{
+			if( mMembers[ i ].mLatest )
+			{
+				boost::shared_ptr< Connection > connection = mMembers[ i ].mConnection.lock();
+				if( connection )
+				{
+					connections.push_back( connection );
+				}
+			}
+		}
+	}
+	size_t count = 0;
+	for( size_t i = 0; i < connections.size(); ++i )
+	{
+		if( flush( connections[ i ] ) )
+		{
+			++count;
+		}
+	}
+	return count;
+}
+
+bool BroadcastGroup::flush( boost::shared_ptr< Connection > connection )
+{
+	if( !connection )
+	{
+		return false;
+	}
+	SharedBuffer latest;
+	{
+		std::lock_guard< std::mutex > lock( mMutex );
+		for( size_t i = 0; i < mMembers.size(); ++i )
+		{
+			if( mMembers[ i ].mLatest && mMembers[ i ].mConnection.lock() == connection )
+			{
+				if( connection->getSendQueueBytes() >= mSlowBytes )
+				{
+					// Still slow, the next send completion tries again. The
+					// queue is read again once watched, as its last send may
+					// have completed in between.
+					connection->watchDrain( shared_from_this() );
+					if( connection->mSendQueueBytes.load( std::memory_order_seq_cst ) >= mSlowBytes )
+					{
+						return false;
+					}
+				}
+				latest.swap( mMembers[ i ].mLatest );
+				break;
+			}
+		}
+	}
+	if( !latest )
+	{
+		return false;
+	}
+	bool admitted;
+	return connection->postSend( latest, admitted );
+}
+
+void BroadcastGroup::setSlowBytes( uint64_t slowBytes )
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	mSlowBytes = slowBytes;
+}
+
+uint64_t BroadcastGroup::getSlowBytes()
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	return mSlowBytes;
+}
+
+void BroadcastGroup::setSlowPolicy( SlowPolicy slowPolicy )
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	mSlowPolicy = slowPolicy;
+}
+
+BroadcastGroup::SlowPolicy BroadcastGroup::getSlowPolicy()
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	return mSlowPolicy;
+}
+
+uint64_t BroadcastGroup::getPublishCount()
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	return mPublishCount;
+}
+
+uint64_t BroadcastGroup::getSkipCount()
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	return mSkipCount;
+}
+
+uint64_t BroadcastGroup::getCoalesceCount()
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	return mCoalesceCount;
+}
+
+//-----------------------------------------------------------------------------
+
+#if NETWORK_COROUTINES
+
+IoAwaitable::IoAwaitable()
+{
+	mResult.bytes = 0;
+}
+
+void IoAwaitable::complete( const boost::system::error_code & ec, size_t bytes )
+{
+	mResult.error = ec;
+	mResult.bytes = bytes;
+	mHandle.resume();
+}
+
+void IoAwaitable::abort( NetworkStrand & strand, HandlerAllocator & allocator )
+{
+	post( strand, allocator, boost::asio::error::operation_aborted, 0 );
+}
+
+void IoAwaitable::post( NetworkStrand & strand, HandlerAllocator & allocator, const boost::system::error_code & ec, size_t bytes )
+{
+	strand.post( makeAllocHandler( allocator, boost::bind( &IoAwaitable::complete, this, ec, bytes ) ) );
+}
+
+//-----------------------------------------------------------------------------
+
+RecvAwaitable::RecvAwaitable( boost::shared_ptr< Connection > connection, std::vector< uint8_t > & buffer, int32_t totalBytes )
+: mConnection( connection ), mBuffer( buffer ), mTotalBytes( totalBytes )
+{
+}
+
+void RecvAwaitable::await_suspend( std::coroutine_handle<> handle )
+{
+	mHandle = handle;
+	mConnection->mIoStrand.dispatch( makeAllocHandler( mConnection->mHandlerAllocator, boost::bind( &RecvAwaitable::start, this ) ) );
+}
+
+void RecvAwaitable::start()
+{
+	IoCompletion completion = { this };
+	Connection & connection = *mConnection;
+	bool shm = false;
+#if NETWORK_SHM
+	shm = static_cast< bool >( connection.mShm );
+#endif
+	if( connection.hasError() || connection.mHive->hasStopped() )
+	{
+		abort( connection.mIoStrand, connection.mHandlerAllocator );
+	}
+	else if( connection.mFramePrefixBytes > 0 || !connection.mPendingRecvs.empty() || shm )
+	{
+		// A second read on the socket would interleave bytes with the
+		// framed read or Recv already in flight, and the shm transport
+		// does not read from the socket at all.
+		post( connection.mIoStrand, connection.mHandlerAllocator, boost::asio::error::operation_not_supported, 0 );
+	}
+	else if( mTotalBytes > 0 )
+	{
+		mBuffer.resize( mTotalBytes );
+		boost::asio::async_read( connection.mSocket, boost::asio::buffer( mBuffer ), connection.mIoStrand.wrap( makeAllocHandler( connection.mHandlerAllocator, completion ) ) );
+	}
+	else
+	{
+		mBuffer.resize( connection.mReceiveBufferSize );
+		connection.mSocket.async_read_some( boost::asio::buffer( mBuffer ), connection.mIoStrand.wrap( makeAllocHandler( connection.mHandlerAllocator, completion ) ) );
+	}
+}
+
+IoResult RecvAwaitable::await_resume()
+{
+	// A refused read leaves the connection as it was.
+	mBuffer.resize( mResult.bytes );
+	if( mResult.error && mResult.error != boost::asio::error::operation_not_supported )
+	{
+		mConnection->startError( mResult.error );
+	}
+	else
+	{
+		NETWORK_METRIC( mConnection->mMetrics.addRecv( mResult.bytes ); mConnection->mHiveMetrics->addRecv( mResult.bytes ); )
+	}
+	return mResult;
+}
+
+//-----------------------------------------------------------------------------
+
+SendAwaitable::SendAwaitable( boost::shared_ptr< Connection > connection, const boost::asio::const_buffer & buffer )
+: mConnection( connection ), mBuffer( buffer )
+{
+}
+
+void SendAwaitable::await_suspend( std::coroutine_handle<> handle )
+{
+	// Posted rather than dispatched, so the buffer is queued behind
+	// buffers passed to Send before the await.
+	mHandle = handle;
+	mConnection->mIoStrand.post( makeAllocHandler( mConnection->mHandlerAllocator, boost::bind( &SendAwaitable::start, this ) ) );
+}
+
+void SendAwaitable::start()
+{
+	Connection & connection = *mConnection;
+	size_t bytes = boost::asio::buffer_size( mBuffer );
+	if( connection.hasError() || connection.mHive->hasStopped() )
+	{
+		abort( connection.mIoStrand, connection.mHandlerAllocator );
+	}
+	else if( connection.getState() == Connection::STATE_DRAINING )
+	{
+		post( connection.mIoStrand, connection.mHandlerAllocator, boost::asio::error::shut_down, 0 );
+	}
+	else if( bytes == 0 )
+	{
+		post( connection.mIoStrand, connection.mHandlerAllocator, boost::system::error_code(), 0 );
+	}
+	else if( !connection.admitSend( bytes ) && connection.mSendQueuePolicy != Connection::SEND_QUEUE_NOTIFY )
+	{
+		post( connection.mIoStrand, connection.mHandlerAllocator, boost::asio::error::no_buffer_space, 0 );
+	}
+	else
+	{
+		// Queued as a region, so it is written in order with Send and
+		// HandleSend resumes the coroutine once all of it is out. The
+		// source comes from the handler memory like the write itself.
+		boost::shared_ptr< Connection::SendSource > source = boost::allocate_shared< Connection::SendSource >( ArenaAllocator< Connection::SendSource >( connection.mHandlerAllocator.getArena() ) );
+		source->mData = static_cast< const uint8_t * >( mBuffer.data() );
+		source->mBytes = bytes;
+		source->mAwaitable = this;
+		NETWORK_TRACE( Tracer::instant( "Connection::asyncSend", &connection, bytes ); )
+		connection.dispatchSendSource( source );
+	}
+}
+
+IoResult SendAwaitable::await_resume()
+{
+	// A refused send leaves the connection as it was. Written bytes were
+	// already counted by HandleSend.
+	if( mResult.error && mResult.error != boost::asio::error::no_buffer_space && mResult.error != boost::asio::error::shut_down )
+	{
+		mConnection->startError( mResult.error );
+	}
+	return mResult;
+}
+
+//-----------------------------------------------------------------------------
+
+ConnectAwaitable::ConnectAwaitable( boost::shared_ptr< Connection > connection, const std::string & host, uint16_t port )
+: mConnection( connection ), mHost( host ), mPort( port )
+{
+}
+
+void ConnectAwaitable::await_suspend( std::coroutine_handle<> handle )
+{
+	mHandle = handle;
+	mConnection->mIoStrand.dispatch( makeAllocHandler( mConnection->mHandlerAllocator, boost::bind( &ConnectAwaitable::start, this ) ) );
+}
+
+void ConnectAwaitable::start()
+{
+	Connection & connection = *mConnection;
+	if( connection.hasError() || connection.mHive->hasStopped() )
+	{
+		abort( connection.mIoStrand, connection.mHandlerAllocator );
+	}
+	else
+	{
+		// The connect runs as for Connect, racing the addresses with the
+		// socket options set on every attempt, and resumes this awaitable
+		// instead of calling OnConnect. The timer closes the connection
+		// once the Hive stops, which ends a resolve or connect still in
+		// flight.
+		connection.mConnectAwaitable = this;
+		connection.startTimer();
+		connection.mHive->getResolver().resolve( mHost, connection.mIoStrand.wrap( makeAllocHandler( connection.mHandlerAllocator, boost::bind( &Connection::handleResolve, mConnection, _1, _2, mPort ) ) ) );
+	}
+}
+
+IoResult ConnectAwaitable::await_resume()
+{
+	if( mResult.error )
+	{
+		mConnection->startError( mResult.error );
+	}
+	else
+	{
+		mConnection->startOpen();
+	}
+	return mResult;
+}
+
+//-----------------------------------------------------------------------------
+
+AcceptAwaitable::AcceptAwaitable( boost::shared_ptr< Acceptor > acceptor, boost::shared_ptr< Connection > connection )
+: mAcceptor( acceptor ), mConnection( connection )
+{
+}
+
+void AcceptAwaitable::await_suspend( std::coroutine_handle<> handle )
+{
+	mHandle = handle;
+	mAcceptor->mIoStrand.dispatch( makeAllocHandler( mAcceptor->mHandlerAllocator, boost::bind( &AcceptAwaitable::start, this ) ) );
+}
+
+void AcceptAwaitable::start()
+{
+	IoCompletion completion = { this };
+	Acceptor & acceptor = *mAcceptor;
+	if( acceptor.hasError() || acceptor.mHive->hasStopped() )
+	{
+		abort( acceptor.mIoStrand, acceptor.mHandlerAllocator );
+	}
+	else
+	{
+		acceptor.mAcceptor.async_accept( mConnection->mSocket, acceptor.mIoStrand.wrap( makeAllocHandler( acceptor.mHandlerAllocator, completion ) ) );
+	}
+}
+
+IoResult AcceptAwaitable::await_resume()
+{
+	if( mResult.error )
+	{
+		mConnection->startError( mResult.error );
+	}
+	else
+	{
+		NETWORK_METRIC( mAcceptor->mHiveMetrics->addAccept(); )
+		mConnection->applySocketOptions( mConnection->mSocket );
+		mConnection->startOpen();
+		mConnection->startTimer();
+	}
+	return mResult;
+}
+
+//-----------------------------------------------------------------------------
+
+RecvAwaitable Connection::asyncRecv( std::vector< uint8_t > & buffer, int32_t totalBytes )
+{
+	return RecvAwaitable( shared_from_this(), buffer, totalBytes );
+}
+
+SendAwaitable Connection::asyncSend( const std::vector< uint8_t > & buffer )
+{
+	return SendAwaitable( shared_from_this(), boost::asio::buffer( buffer ) );
+}
+
+ConnectAwaitable Connection::asyncConnect( const std::string & host, uint16_t port )
+{
+	return ConnectAwaitable( shared_from_this(), host, port );
+}
+
+AcceptAwaitable Acceptor::asyncAccept( boost::shared_ptr< Connection > connection )
+{
+	return AcceptAwaitable( shared_from_this(), connection );
+}
+
+#endif
+
+//-----------------------------------------------------------------------------
+
+Datagram::Datagram( boost::shared_ptr< Hive > hive )
+: Datagram( hive, hive->getNextService() )
+{
+}
+
+Datagram::Datagram( boost::shared_ptr< Hive > hive, size_t affinityKey )
+: Datagram( hive, hive->getServiceForKey( affinityKey ) )
+{
+}
+
+Datagram::Datagram( boost::shared_ptr< Hive > hive, boost::asio::io_service & service )
+: mHive( hive ), mIoService( service ), mSocket( mIoService ), mIoStrand( mIoService ), mTimerWheel( hive->getTimerWheel( mIoService ) ), mTimerEntry( &Datagram::dispatchTimer ), mPendingRecvs( 0 ), mReceiveBufferSize( 2048 ), mBatchSize( 32 ), mTimerInterval( 1000 ), mSendWaiting( false ), mErrorState( false )
+{
+	NETWORK_METRIC( mHiveMetrics = &hive->getHiveMetrics( mIoService ); )
+}
+
+Datagram::~Datagram()
+{
+	mTimerWheel.cancel( mTimerEntry );
+	NETWORK_METRIC( mHiveMetrics->removePendingRecv( static_cast< uint64_t >( mPendingRecvs ) ); )
+}
+
+void Datagram::open( const boost::asio::ip::udp & protocol )
+{
+	mSocket.open( protocol );
+	// Batches are read and written until the socket would block, readiness
+	// is only waited on once it does.
+	mSocket.non_blocking( true );
+}
+
+void Datagram::bind( const std::string & ip, uint16_t port )
+{
+	boost::asio::ip::udp::endpoint endpoint( boost::asio::ip::address::from_string( ip ), port );
+	open( endpoint.protocol() );
+	mSocket.bind( endpoint );
+	startTimer();
+}
+
+void Datagram::connect( const std::string & host, uint16_t port )
+{
+	boost::asio::ip::udp::endpoint endpoint( mHive->getResolver().resolveNow( host, !mHive->runsInThisThread() ).front(), port );
+	if( !mSocket.is_open() )
+	{
+		open( endpoint.protocol() );
+		startTimer();
+	}
+	mSocket.connect( endpoint );
+	mPeerEndpoint = endpoint;
+}
+
+void Datagram::connectAsync( const std::string & host, uint16_t port, const ConnectCallback & callback )
+{
+	mHive->getResolver().resolve( host, mIoStrand.wrap( makeAllocHandler( mHandlerAllocator, boost::bind( &Datagram::handleResolve, shared_from_this(), _1, _2, port, callback ) ) ) );
+}
+
+void Datagram::handleResolve( const boost::system::error_code & error, const std::vector< boost::asio::ip::address > & addresses, uint16_t port, const ConnectCallback & callback )
+{
+	NETWORK_METRIC( HandlerTimer handlerTimer( *mHiveMetrics ); )
+	NETWORK_TRACE( TraceScope traceScope( "Datagram::handleResolve", this ); )
+	boost::system::error_code ec = error;
+	if( !ec && ( hasError() || mHive->hasStopped() ) )
+	{
+		ec = boost::asio::error::operation_aborted;
+	}
+	boost::asio::ip::udp::endpoint endpoint;
+	if( !ec )
+	{
+		endpoint = boost::asio::ip::udp::endpoint( addresses.front(), port );
+		if( !mSocket.is_open() )
+		{
+			mSocket.open( endpoint.protocol(), ec );
+			if( !ec )
+			{
+				mSocket.non_blocking( true, ec );
+			}
+			if( !ec )
+			{
+				startTimer();
+			}
+		}
+	}
+	if( !ec )
+	{
+		mSocket.connect( endpoint, ec );
+	}
+	if( ec )
+	{
+		startError( ec );
+	}
+	else
+	{
+		mPeerEndpoint = endpoint;
+	}
+	if( callback )
+	{
+		callback( ec );
+	}
+}
+
+void Datagram::startRecv()
+{
+	mSocket.async_receive( boost::asio::null_buffers(), mIoStrand.wrap( makeAllocHandler( mHandlerAllocator, boost::bind( &Datagram::handleRecv, shared_from_this(), _1 ) ) ) );
+}
+
+void Datagram::startSend()
+{
+	boost::system::error_code ec;
+	sendBatch( ec );
+	if( ec == boost::asio::error::would_block )
+	{
+		mSendWaiting = true;
+		mSocket.async_send( boost::asio::null_buffers(), mIoStrand.wrap( makeAllocHandler( mHandlerAllocator, boost::bind( &Datagram::handleSend, shared_from_this(), _1 ) ) ) );
+	}
+	else if( ec )
+	{
+		startError( ec );
+	}
+}
+
+void Datagram::startTimer()
+{
+	mTimerWheel.schedule( mTimerEntry, shared_from_this(), mTimerInterval );
+	mLastTime = mTimerWheel.getTime();
+}
+
+void Datagram::startError( const boost::system::error_code & error )
+{
+	if( !mErrorState.exchange( true, std::memory_order_acq_rel ) )
+	{
+		boost::system::error_code ec;
+		mSocket.close( ec );
+		mTimerWheel.cancel( mTimerEntry );
+		if( error )
+		{
+			NETWORK_METRIC( mMetrics.addError(); mHiveMetrics->addError( error ); )
+		}
+		onError( error );
+	}
+}
+
+size_t Datagram::recvBatch( boost::system::error_code & ec )
+{
+	size_t batchSize = static_cast< size_t >( std::min< int32_t >( std::max( mBatchSize, 1 ), MAX_BATCH_SIZE ) );
+	size_t bufferSize = static_cast< size_t >( std::max( mReceiveBufferSize, 1 ) );
+	if( mRecvPackets.size() < batchSize )
+	{
+		mRecvPackets.resize( batchSize );
+	}
+	for( size_t i = 0; i < batchSize; ++i )
+	{
+		mRecvPackets[ i ].buffer.resize( bufferSize );
+	}
+    
+#if defined( __linux__ )
+	mmsghdr headers[ MAX_BATCH_SIZE ];
+	iovec iovecs[ MAX_BATCH_SIZE ];
+	for( size_t i = 0; i < batchSize; ++i )
+	{
+		iovecs[ i ].iov_base = &mRecvPackets[ i ].buffer[ 0 ];
+		iovecs[ i ].iov_len = bufferSize;
+		std::memset( &headers[ i ], 0, sizeof( mmsghdr ) );
+		headers[ i ].msg_hdr.msg_name = mRecvPackets[ i ].endpoint.data();
+		headers[ i ].msg_hdr.msg_namelen = static_cast< socklen_t >( mRecvPackets[ i ].endpoint.capacity() );
+		headers[ i ].msg_hdr.msg_iov = &iovecs[ i ];
+		headers[ i ].msg_hdr.msg_iovlen = 1;
+	}
+	int result = ::recvmmsg( mSocket.native_handle(), headers, static_cast< unsigned int >( batchSize ), MSG_DONTWAIT, 0 );
+	if( result < 0 )
+	{
+		ec = boost::system::error_code( errno, boost::asio::error::get_system_category() );
+		if( ec == boost::asio::error::try_again )
+		{
+			ec = boost::asio::error::would_block;
+		}
+		return 0;
+	}
+	size_t count = 0;
+	for( size_t i = 0; i < static_cast< size_t >( result ); ++i )
+	{
+		mRecvPackets[ i ].endpoint.resize( headers[ i ].msg_hdr.msg_namelen );
+		if( headers[ i ].msg_hdr.msg_flags & MSG_TRUNC )
+		{
+			reportPacketError( boost::asio::error::message_size, mRecvPackets[ i ].endpoint );
+			continue;
+		}
+		mRecvPackets[ i ].buffer.resize( headers[ i ].msg_len );
+		if( count != i )
+		{
+			std::swap( mRecvPackets[ count ], mRecvPackets[ i ] );
+		}
+		++count;
+	}
+	return count;
+#else
+	// One spare byte tells a datagram that filled the buffer apart from one
+	// that was truncated to fit it.
+	size_t count = 0;
+	while( count < batchSize )
+	{
+		mRecvPackets[ count ].buffer.resize( bufferSize + 1 );
+		size_t bytes = mSocket.receive_from( boost::asio::buffer( mRecvPackets[ count ].buffer ), mRecvPackets[ count ].endpoint, 0, ec );
+		if( !ec && bytes > bufferSize )
+		{
+			ec = boost::asio::error::message_size;
+		}
+		if( isPacketError( ec ) )
+		{
+			reportPacketError( ec, mRecvPackets[ count ].endpoint );
+			ec = boost::system::error_code();
+			continue;
+		}
+		if( ec )
+		{
+			break;
+		}
+		mRecvPackets[ count ].buffer.resize( bytes );
+		++count;
+	}
+	if( count > 0 && ec == boost::asio::error::would_block )
+	{
+		ec = boost::system::error_code();
+	}
+	return count;
+#endif
+}
+
+void Datagram::sendBatch( boost::system::error_code & ec )
+{
+	size_t batchSize = static_cast< size_t >( std::min< int32_t >( std::max( mBatchSize, 1 ), MAX_BATCH_SIZE ) );
+	while( !mPendingSends.empty() && !ec )
+	{
+		size_t count = 0;
+#if defined( __linux__ )
+		mmsghdr headers[ MAX_BATCH_SIZE ];
+		iovec iovecs[ MAX_BATCH_SIZE ];
+		for( std::list< PendingSend >::iterator itr = mPendingSends.begin(); itr != mPendingSends.end() && count < batchSize; ++itr, ++count )
+		{
+			iovecs[ count ].iov_base = const_cast< uint8_t * >( itr->buffer->empty() ? 0 : &( *itr->buffer )[ 0 ] );
+			iovecs[ count ].iov_len = itr->buffer->size();
+			std::memset( &headers[ count ], 0, sizeof( mmsghdr ) );
+			if( !itr->connected )
+			{
+				headers[ count ].msg_hdr.msg_name = itr->endpoint.data();
+				headers[ count ].msg_hdr.msg_namelen = static_cast< socklen_t >( itr->endpoint.size() );
+			}
+			headers[ count ].msg_hdr.msg_iov = &iovecs[ count ];
+			headers[ count ].msg_hdr.msg_iovlen = 1;
+		}
+		int result = ::sendmmsg( mSocket.native_handle(), headers, static_cast< unsigned int >( count ), MSG_DONTWAIT );
+		if( result < 0 )
+		{
+			ec = boost::system::error_code( errno, boost::asio::error::get_system_category() );
+			if( ec == boost::asio::error::try_again )
+			{
+				ec = boost::asio::error::would_block;
+			}
+			count = 0;
+		}
+		else
+		{
+			count = static_cast< size_t >( result );
+		}
+#else
+		while( count < batchSize && count < mPendingSends.size() )
+		{
+			std::list< PendingSend >::iterator itr = mPendingSends.begin();
+			std::advance( itr, count );
+			if( itr->connected )
+			{
+				mSocket.send( boost::asio::buffer( *itr->buffer ), 0, ec );
+			}
+			else
+			{
+				mSocket.send_to( boost::asio::buffer( *itr->buffer ), itr->endpoint, 0, ec );
+			}
+			if( ec )
+			{
+				break;
+			}
+			++count;
+		}
+#endif
+		for( size_t i = 0; i < count; ++i )
+		{
+			PendingSend & packet = mPendingSends.front();
+			NETWORK_METRIC( mMetrics.addSent( packet.buffer->size() ); mHiveMetrics->addSent( packet.buffer->size() ); )
+			onSend( *packet.buffer, packet.connected ? mPeerEndpoint : packet.endpoint );
+			mPendingSends.pop_front();
+		}
+#if !defined( __linux__ )
+		if( count < batchSize && !mPendingSends.empty() && !ec )
+		{
+			ec = boost::asio::error::would_block;
+		}
+#endif
+		if( isPacketError( ec ) )
+		{
+			// The datagram at the front of the queue was refused, drop it and
+			// carry on with the rest.
+			PendingSend & packet = mPendingSends.front();
+			reportPacketError( ec, packet.connected ? mPeerEndpoint : packet.endpoint );
+			mPendingSends.pop_front();
+			ec = boost::system::error_code();
+		}
+	}
+}
+
+void Datagram::reportPacketError( const boost::system::error_code & ec, const boost::asio::ip::udp::endpoint & endpoint )
+{
+	NETWORK_METRIC( mMetrics.addError(); mHiveMetrics->addError( ec ); )
+	NETWORK_TRACE( Tracer::instant( "Datagram::packetError", this, static_cast< uint64_t >( ec.value() ) ); )
+	onPacketError( ec, endpoint );
+}
+
+bool Datagram::isPacketError( const boost::system::error_code & ec )
+{
+	// Errors that belong to one datagram, or are ICMP errors queued on the
+	// socket by an earlier one, rather than to the socket itself.
+	return ec == boost::asio::error::message_size ||
+		ec == boost::asio::error::connection_refused ||
+		ec == boost::asio::error::connection_reset ||
+		ec == boost::asio::error::host_unreachable ||
+		ec == boost::asio::error::network_unreachable ||
+		ec == boost::asio::error::no_buffer_space ||
+		ec == boost::asio::error::access_denied ||
+		ec == boost::system::errc::operation_not_permitted;
+}
+
+void Datagram::dispatchSend( const PendingSend & packet )
+{
+	NETWORK_TRACE( TraceScope traceScope( "Datagram::dispatchSend", this ); )
+	bool shouldStartSend = mPendingSends.empty() && !mSendWaiting;
+	mPendingSends.push_back( packet );
+	if( shouldStartSend )
+	{
+		startSend();
+	}
+}
+
+void Datagram::dispatchRecv()
+{
+	NETWORK_TRACE( TraceScope traceScope( "Datagram::dispatchRecv", this ); )
+	bool shouldStartReceive = ( mPendingRecvs == 0 );
+	++mPendingRecvs;
+	NETWORK_METRIC( mMetrics.addPendingRecv(); mHiveMetrics->addPendingRecv(); )
+	if( shouldStartReceive )
+	{
+		startRecv();
+	}
+}
+
+void Datagram::dispatchTimer( const boost::shared_ptr< void > & owner )
+{
+	boost::shared_ptr< Datagram > datagram = boost::static_pointer_cast< Datagram >( owner );
+	datagram->mIoStrand.post( makeAllocHandler( datagram->mHandlerAllocator, boost::bind( &Datagram::handleTimer, datagram, boost::system::error_code() ) ) );
+}
+
+void Datagram::handleRecv( const boost::system::error_code & error )
+{
+	NETWORK_METRIC( HandlerTimer handlerTimer( *mHiveMetrics ); )
+	NETWORK_TRACE( TraceScope traceScope( "Datagram::handleRecv", this ); )
+	if( error || hasError() || mHive->hasStopped() )
+	{
+		startError( error );
+		return;
+	}
+    
+	boost::system::error_code ec;
+	size_t count = recvBatch( ec );
+	if( isPacketError( ec ) )
+	{
+		reportPacketError( ec, mPeerEndpoint );
+		startRecv();
+	}
+	else if( ec == boost::asio::error::would_block || ( !ec && count == 0 ) )
+	{
+		// Another reader drained the socket first, or every datagram read
+		// was dropped, wait again.
+		startRecv();
+	}
+	else if( ec )
+	{
+		startError( ec );
+	}
+	else
+	{
+#if NETWORK_METRICS
+		uint64_t bytes = 0;
+		for( size_t i = 0; i < count; ++i )
+		{
+			bytes += mRecvPackets[ i ].buffer.size();
+		}
+		mMetrics.addRecv( bytes, count );
+		mMetrics.removePendingRecv();
+		mHiveMetrics->addRecv( bytes, count );
+		mHiveMetrics->removePendingRecv();
+#endif
+		onRecvBatch( mRecvPackets, count );
+		--mPendingRecvs;
+		if( mPendingRecvs > 0 )
+		{
+			startRecv();
+		}
+	}
+}
+
+void Datagram::handleSend( const boost::system::error_code & error )
+{
+	NETWORK_METRIC( HandlerTimer handlerTimer( *mHiveMetrics ); )
+	NETWORK_TRACE( TraceScope traceScope( "Datagram::handleSend", this ); )
+	mSendWaiting = false;
+	if( error || hasError() || mHive->hasStopped() )
+	{
+		startError( error );
+	}
+	else
+	{
+		startSend();
+	}
+}
+
+void Datagram::handleTimer( const boost::system::error_code & error )
+{
+	NETWORK_METRIC( HandlerTimer handlerTimer( *mHiveMetrics ); )
+	NETWORK_TRACE( TraceScope traceScope( "Datagram::handleTimer", this ); )
+	if( error || hasError() || mHive->hasStopped() )
+	{
+		startError( error );
+	}
+	else
+	{
+		onTimer( mTimerWheel.getElapsed( mLastTime ) );
+		startTimer();
+	}
+}
+
+void Datagram::onRecvBatch( std::vector< DatagramPacket > & packets, size_t count )
+{
+	for( size_t i = 0; i < count && !hasError(); ++i )
+	{
+		onRecv( packets[ i ].buffer, packets[ i ].endpoint );
+	}
+}
+
+void Datagram::onPacketError( const boost::system::error_code &, const boost::asio::ip::udp::endpoint & )
+{
+}
+
+void Datagram::send( const SharedBuffer & buffer )
+{
+	PendingSend packet;
+	packet.buffer = buffer;
+	packet.connected = true;
+	NETWORK_TRACE( Tracer::instant( "Datagram::send", this, buffer->size() ); )
+	mIoStrand.post( makeAllocHandler( mHandlerAllocator, boost::bind( &Datagram::dispatchSend, shared_from_this(), packet ) ) );
+}
+
+void Datagram::send( const std::vector< uint8_t > & buffer )
+{
+	send( SharedBuffer( boost::make_shared< std::vector< uint8_t > >( buffer ) ) );
+}
+
+void Datagram::sendTo( const SharedBuffer & buffer, const boost::asio::ip::udp::endpoint & endpoint )
+{
+	PendingSend packet;
+	packet.buffer = buffer;
+	packet.endpoint = endpoint;
+	packet.connected = false;
+	NETWORK_TRACE( Tracer::instant( "Datagram::send", this, buffer->size() ); )
+	mIoStrand.post( makeAllocHandler( mHandlerAllocator, boost::bind( &Datagram::dispatchSend, shared_from_this(), packet ) ) );
+}
+
+void Datagram::sendTo( const std::vector< uint8_t > & buffer, const boost::asio::ip::udp::endpoint & endpoint )
+{
+	sendTo( SharedBuffer( boost::make_shared< std::vector< uint8_t > >( buffer ) ), endpoint );
+}
+
+void Datagram::recv()
+{
+	NETWORK_TRACE( Tracer::instant( "Datagram::recv", this ); )
+	mIoStrand.post( makeAllocHandler( mHandlerAllocator, boost::bind( &Datagram::dispatchRecv, shared_from_this() ) ) );
+}
+
+void Datagram::disconnect()
+{
+	NETWORK_TRACE( Tracer::instant( "Datagram::disconnect", this ); )
+	mIoStrand.post( makeAllocHandler( mHandlerAllocator, boost::bind( &Datagram::handleTimer, shared_from_this(), boost::asio::error::connection_reset ) ) );
+}
+
+boost::shared_ptr< Hive > Datagram::getHive()
+{
+	return mHive;
+}
+
+boost::asio::io_service & Datagram::getService()
+{
+	return mIoService;
+}
+
+boost::asio::ip::udp::socket & Datagram::getSocket()
+{
+	return mSocket;
+}
+
+NetworkStrand & Datagram::getStrand()
+{
+	return mIoStrand;
+}
+
+void Datagram::setReceiveBufferSize( int32_t size )
+{
+	mReceiveBufferSize = size;
+}
+
+int32_t Datagram::getReceiveBufferSize() const
+{
+	return mReceiveBufferSize;
+}
+
+void Datagram::setBatchSize( int32_t batchSize )
+{
+	mBatchSize = batchSize;
+}
+
+int32_t Datagram::getBatchSize() const
+{
+	return mBatchSize;
+}
+
+void Datagram::setTimerInterval( int32_t timerInterval )
+{
+	mTimerInterval = timerInterval;
+}
+
+int32_t Datagram::getTimerInterval() const
+{
+	return mTimerInterval;
+}
+
+MetricsSnapshot Datagram::getMetrics() const
+{
+#if NETWORK_METRICS
+	return mMetrics.getSnapshot();
+#else
+	return MetricsSnapshot();
+#endif
+}
+
+bool Datagram::hasError()
+{
+	return mErrorState.load( std::memory_order_acquire );
+}
+//-----------------------------------------------------------------------------
+
+NetworkEvent::NetworkEvent()
+: type( EVENT_ERROR ), port( 0 )
+{
+}
+
+const std::vector< uint8_t > & NetworkEvent::getBuffer() const
+{
+	return lease ? lease->getBuffer() : buffer;
+}
+
+//-----------------------------------------------------------------------------
+
+EventQueue::Ring::Ring( size_t capacity )
+: mEvents( capacity ), mStalled( false )
+{
+}
+
+//-----------------------------------------------------------------------------
+
+EventQueue::EventQueue( boost::shared_ptr< Hive > hive, size_t capacity )
+: mHive( hive ), mNextRing( 0 ), mOverflowCount( 0 ), mLocked( !hive->ownsWorkers() )
+{
+	for( size_t i = 0; i < hive->getServiceCount(); ++i )
+	{
+		mRings.push_back( boost::shared_ptr< Ring >( new Ring( capacity ) ) );
+	}
+}
+
+EventQueue::~EventQueue()
+{
+}
+
+void EventQueue::flush( Ring & ring )
+{
+	while( !ring.mOverflow.empty() && ring.mEvents.push( ring.mOverflow.front() ) )
+	{
+		ring.mOverflow.pop_front();
+	}
+	if( !ring.mOverflow.empty() )
+	{
+		ring.mStalled.store( true, std::memory_order_release );
+	}
+}
+
+void EventQueue::handleResume( size_t index )
+{
+	Ring & ring = *mRings[ index ];
+	std::unique_lock< std::mutex > lock( ring.mMutex, std::defer_lock );
+	if( mLocked )
+	{
+		lock.lock();
+	}
+	flush( ring );
+}
+
+void EventQueue::push( NetworkEvent & event )
+{
+	Ring & ring = *mRings[ mHive->getServiceIndex( event.connection->getService() ) ];
+	std::unique_lock< std::mutex > lock( ring.mMutex, std::defer_lock );
+	if( mLocked )
+	{
+		lock.lock();
+	}
+	if( !ring.mOverflow.empty() )
+	{
+		flush( ring );
+	}
+	if( ring.mOverflow.empty() && ring.mEvents.push( event ) )
+	{
+		return;
+	}
+	// The application is behind. Keep the event here rather than blocking
+	// the network thread; Pop asks for the overflow once it has made room.
+	ring.mOverflow.push_back( NetworkEvent() );
+	std::swap( ring.mOverflow.back(), event );
+	ring.mStalled.store( true, std::memory_order_release );
+	mOverflowCount.fetch_add( 1, std::memory_order_relaxed );
+}
+
+void EventQueue::pushAccept( const boost::shared_ptr< Connection > & connection, const std::string & host, uint16_t port )
+{
+	NetworkEvent event;
+	event.type = NetworkEvent::EVENT_ACCEPT;
+	event.connection = connection;
+	event.host = host;
+	event.port = port;
+	push( event );
+}
+
+void EventQueue::pushConnect( const boost::shared_ptr< Connection > & connection, const std::string & host, uint16_t port )
+{
+	NetworkEvent event;
+	event.type = NetworkEvent::EVENT_CONNECT;
+	event.connection = connection;
+	event.host = host;
+	event.port = port;
+	push( event );
+}
+
+void EventQueue::pushRecv( const boost::shared_ptr< Connection > & connection, std::vector< uint8_t > & buffer )
+{
+	NetworkEvent event;
+	event.type = NetworkEvent::EVENT_RECV;
+	event.connection = connection;
+	event.buffer.swap( buffer );
+	push( event );
+}
+
+void EventQueue::pushRecv( const boost::shared_ptr< Connection > & connection, const RecvLease & lease )
+{
+	NetworkEvent event;
+	event.type = NetworkEvent::EVENT_RECV;
+	event.connection = connection;
+	event.lease = lease;
+	push( event );
+}
+
+void EventQueue::pushSend( const boost::shared_ptr< Connection > & connection, const std::vector< uint8_t > & buffer )
+{
+	NetworkEvent event;
+	event.type = NetworkEvent::EVENT_SEND;
+	event.connection = connection;
+	event.buffer = buffer;
+	push( event );
+}
+
+void EventQueue::pushError( const boost::shared_ptr< Connection > & connection, const boost::system::error_code & error )
+{
+	NetworkEvent event;
+	event.type = NetworkEvent::EVENT_ERROR;
+	event.connection = connection;
+	event.error = error;
+	push( event );
+}
+
+bool EventQueue::pop( NetworkEvent & event )
+{
+	for( size_t i = 0; i < mRings.size(); ++i )
+	{
+		size_t index = ( mNextRing + i ) % mRings.size();
+		Ring & ring = *mRings[ index ];
+		if( ring.mStalled.load( std::memory_order_acquire ) && ring.mStalled.exchange( false, std::memory_order_acq_rel ) )
+		{
+			mHive->getService( index ).post( boost::bind( &EventQueue::handleResume, shared_from_this(), index ) );
+		}
+		if( ring.mEvents.pop( event ) )
+		{
+			// Rotate so a busy io_service cannot starve the others.
+			mNextRing = index + 1;
+			return true;
+		}
+	}
+	return false;
+}
+
+size_t EventQueue::drain( const Handler & handler, size_t maxEvents, int32_t maxMicro )
+{
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::microseconds( maxMicro );
+	size_t count = 0;
+	NetworkEvent event;
+	while( ( maxEvents == 0 || count < maxEvents ) && pop( event ) )
+	{
+		handler( event );
+		event = NetworkEvent();
+		++count;
+		if( maxMicro > 0 && std::chrono::steady_clock::now() >= deadline )
+		{
+			break;
+		}
+	}
+	return count;
+}
+
+size_t EventQueue::getSize() const
+{
+	size_t size = 0;
+	for( size_t i = 0; i < mRings.size(); ++i )
+	{
+		size += mRings[ i ]->mEvents.getSize();
+	}
+	return size;
+}
+
+uint64_t EventQueue::getOverflowCount() const
 {
-	return ( boost::interprocess::ipcdetail::atomic_cas32( &mErrorState, 1, 1 ) == 1 );
+	return mOverflowCount.load( std::memory_order_relaxed );
 }
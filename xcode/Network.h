@@ -13,86 +13,2432 @@
 
 //-----------------------------------------------------------------------------
 
+// Boost 1.74 uses std::exchange in its awaitable support without including
+// <utility>, which breaks C++20 builds.
+#include <utility>
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/aligned_storage.hpp>
 #include <string>
 #include <vector>
 #include <list>
+#include <deque>
+#include <map>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <iosfwd>
+#include <stdexcept>
 #include <boost/cstdint.hpp>
 
+// The awaitable functions are only available to C++20 compilers with
+// coroutine support.
+#if defined( __cpp_impl_coroutine )
+#include <coroutine>
+#define NETWORK_COROUTINES 1
+#else
+#define NETWORK_COROUTINES 0
+#endif
+
+//-----------------------------------------------------------------------------
+
+using boost::uint64_t;
+using boost::uint32_t;
+using boost::uint16_t;
+using boost::uint8_t;
+
+using boost::int64_t;
+using boost::int32_t;
+using boost::int16_t;
+using boost::int8_t;
+
+//-----------------------------------------------------------------------------
+
+class Hive;
+class Acceptor;
+class Connection;
+class Datagram;
+class RecvBlock;
+class RecvFreeList;
+class RecvBufferPool;
+class ConnectionPool;
+class BroadcastGroup;
+#if NETWORK_COROUTINES
+class IoAwaitable;
+class RecvAwaitable;
+class SendAwaitable;
+class ConnectAwaitable;
+class AcceptAwaitable;
+#endif
+
+// An immutable, reference counted byte buffer. Sending a SharedBuffer only
+// bumps the reference count, so the same payload can be queued without
+// being copied.
+typedef boost::shared_ptr< const std::vector< uint8_t > > SharedBuffer;
+
+// A lease on a pooled receive block. The block goes back to its pool when
+// the last lease referencing it is released.
+typedef boost::intrusive_ptr< RecvBlock > RecvLease;
+
+void intrusive_ptr_add_ref( RecvBlock * block );
+void intrusive_ptr_release( RecvBlock * block );
+
+//-----------------------------------------------------------------------------
+
+// The storage behind a HandlerAllocator, embedded in the object it serves.
+// Handlers only point at it: each one binds a shared_from_this() of that
+// object, which keeps the arena alive until the operation's memory has
+// been handed back.
+class HandlerArena
+{
+private:
+	// A connection mostly has a read, a write and the odd timer post in
+	// flight. The slot size fits the largest of those operations, a strand
+	// wrapped gather write; anything beyond falls back to the heap.
+	enum { SLOT_COUNT = 3, SLOT_SIZE = 528 };
+    
+	struct Slot
+	{
+		boost::aligned_storage< SLOT_SIZE >::type   mStorage;
+		std::atomic< bool >                         mInUse;
+	};
+    
+	Slot                        mSlots[ SLOT_COUNT ];
+	std::atomic< uint64_t >     mAllocations;
+	std::atomic< uint64_t >     mHeapAllocations;
+    
+private:
+	HandlerArena( const HandlerArena & rhs );
+	HandlerArena & operator =( const HandlerArena & rhs );
+    
+public:
+	HandlerArena();
+    
+	// Returns memory for an asio handler. A free slot is reused when the
+	// handler fits, otherwise the memory comes from the heap.
+	void * allocate( size_t size );
+    
+	// Returns memory obtained from Allocate.
+	void deallocate( void * pointer );
+    
+	// Returns the number of handler allocations made through this object.
+	uint64_t getAllocationCount() const;
+    
+	// Returns the number of handler allocations that fell back to the heap.
+	uint64_t getHeapAllocationCount() const;
+};
+
+//-----------------------------------------------------------------------------
+
+// Hands out the handler memory of a connection, acceptor or datagram
+// endpoint.
+class HandlerAllocator
+{
+private:
+	HandlerArena    mArena;
+    
+private:
+	HandlerAllocator( const HandlerAllocator & rhs );
+	HandlerAllocator & operator =( const HandlerAllocator & rhs );
+    
+public:
+	HandlerAllocator();
+	~HandlerAllocator();
+    
+	// Returns memory for an asio handler. A free slot of the object's own
+	// storage is reused when the handler fits, otherwise the memory comes
+	// from the heap.
+	void * allocate( size_t size );
+    
+	// Returns memory obtained from Allocate.
+	void deallocate( void * pointer );
+    
+	// Returns the number of handler allocations made through this object.
+	uint64_t getAllocationCount() const;
+    
+	// Returns the number of handler allocations that fell back to the heap.
+	uint64_t getHeapAllocationCount() const;
+    
+	// Returns the storage handlers are allocated from.
+	HandlerArena * getArena();
+};
+
+//-----------------------------------------------------------------------------
+
+// A standard allocator over a HandlerArena, which asio finds as the
+// associated allocator of an AllocHandler.
+template< typename T >
+class ArenaAllocator
+{
+	template< typename U > friend class ArenaAllocator;
+    
+private:
+	HandlerArena *  mArena;
+    
+public:
+	typedef T value_type;
+    
+	explicit ArenaAllocator( HandlerArena * arena )
+	: mArena( arena )
+	{
+	}
+    
+	template< typename U >
+	ArenaAllocator( const ArenaAllocator< U > & rhs )
+	: mArena( rhs.mArena )
+	{
+	}
+    
+	T * allocate( size_t count )
+	{
+		return static_cast< T * >( mArena->allocate( sizeof( T ) * count ) );
+	}
+    
+	void deallocate( T * pointer, size_t )
+	{
+		mArena->deallocate( pointer );
+	}
+    
+	template< typename U >
+	bool operator ==( const ArenaAllocator< U > & rhs ) const
+	{
+		return mArena == rhs.mArena;
+	}
+    
+	template< typename U >
+	bool operator !=( const ArenaAllocator< U > & rhs ) const
+	{
+		return mArena != rhs.mArena;
+	}
+};
+
+//-----------------------------------------------------------------------------
+
+// Wraps a handler so that asio allocates its operation from the arena of a
+// HandlerAllocator. Boost before 1.74 asks the allocation hooks for the
+// memory, later releases the associated allocator.
+template< typename Handler >
+class AllocHandler
+{
+private:
+	HandlerArena *  mArena;
+	Handler         mHandler;
+    
+public:
+	typedef ArenaAllocator< void > allocator_type;
+    
+	AllocHandler( HandlerAllocator & allocator, const Handler & handler )
+	: mArena( allocator.getArena() ), mHandler( handler )
+	{
+	}
+    
+	allocator_type get_allocator() const
+	{
+		return allocator_type( mArena );
+	}
+    
+	void operator()()
+	{
+		mHandler();
+	}
+    
+	template< typename Arg1 >
+	void operator()( const Arg1 & arg1 )
+	{
+		mHandler( arg1 );
+	}
+    
+	template< typename Arg1, typename Arg2 >
+	void operator()( const Arg1 & arg1, const Arg2 & arg2 )
+	{
+		mHandler( arg1, arg2 );
+	}
+    
+#if !defined( BOOST_ASIO_NO_DEPRECATED )
+	friend void * asio_handler_allocate( std::size_t size, AllocHandler< Handler > * thisHandler )
+	{
+		return thisHandler->mArena->allocate( size );
+	}
+    
+	friend void asio_handler_deallocate( void * pointer, std::size_t, AllocHandler< Handler > * thisHandler )
+	{
+		thisHandler->mArena->deallocate( pointer );
+	}
+#endif
+};
+
+template< typename Handler >
+inline AllocHandler< Handler > makeAllocHandler( HandlerAllocator & allocator, const Handler & handler )
+{
+	return AllocHandler< Handler >( allocator, handler );
+}
+
+//-----------------------------------------------------------------------------
+
+// The handlers of each connection, acceptor and datagram endpoint are
+// serialized through a strand. Defining NETWORK_SINGLE_THREADED to 1 drops
+// the strands; every io_service must then be run by one thread at a time,
+// as a Hive owning its workers or a single thread calling Run or Poll does.
+// A Hive without workers refuses a second thread calling Run or Poll.
+#ifndef NETWORK_SINGLE_THREADED
+#define NETWORK_SINGLE_THREADED 0
+#endif
+
+// Stands in for a strand on an io_service that only one thread runs. That
+// thread already serializes the handlers, so wrapped handlers run inline on
+// it and only hop over when completed elsewhere, as resolver callbacks on
+// the first io_service are. Posting goes straight to the io_service.
+class DirectStrand
+{
+private:
+	boost::asio::io_service &   mIoService;
+    
+public:
+	explicit DirectStrand( boost::asio::io_service & service )
+	: mIoService( service )
+	{
+	}
+    
+	template< typename Handler >
+	auto wrap( const Handler & handler ) -> decltype( mIoService.wrap( handler ) )
+	{
+		return mIoService.wrap( handler );
+	}
+    
+	template< typename Handler >
+	void post( Handler handler )
+	{
+		mIoService.post( handler );
+	}
+    
+	template< typename Handler >
+	void dispatch( Handler handler )
+	{
+		mIoService.dispatch( handler );
+	}
+    
+	boost::asio::io_service & get_io_service()
+	{
+		return mIoService;
+	}
+};
+
+#if NETWORK_SINGLE_THREADED
+typedef DirectStrand NetworkStrand;
+#else
+typedef boost::asio::io_service::strand NetworkStrand;
+#endif
+
+//-----------------------------------------------------------------------------
+
+class TimerWheel
+{
+public:
+	// The callback invoked when an entry expires. The owner passed to
+	// Schedule is kept alive for the duration of the call.
+	typedef void ( *Callback )( const boost::shared_ptr< void > & owner );
+    
+	// The clock ticks are measured with. It is monotonic, so changes to the
+	// wall clock neither stall nor fire timers.
+	typedef std::chrono::steady_clock Clock;
+    
+	// A timer scheduled on the wheel. Entries are intrusive, scheduling and
+	// canceling them never allocates.
+	class Entry
+	{
+		friend class TimerWheel;
+        
+	private:
+		Entry *                     mPrev;
+		Entry *                     mNext;
+		Entry **                    mSlot;
+		uint64_t                    mExpiry;
+		boost::shared_ptr< void >   mOwner;
+		Callback                    mCallback;
+        
+	private:
+		Entry( const Entry & rhs );
+		Entry & operator =( const Entry & rhs );
+        
+	public:
+		Entry( Callback callback );
+		~Entry();
+        
+		// Returns true if the entry is waiting to expire.
+		bool isScheduled() const;
+	};
+    
+private:
+	enum { LEVEL_COUNT = 4, SLOT_BITS = 6, SLOT_COUNT = 1 << SLOT_BITS };
+    
+	boost::asio::steady_timer                                           mTimer;
+	std::mutex                                                          mMutex;
+	Entry *                                                             mSlots[ LEVEL_COUNT ][ SLOT_COUNT ];
+	std::vector< std::pair< Entry *, boost::shared_ptr< void > > >     mExpired;
+	Clock::time_point                                                   mStartTime;
+	std::atomic< Clock::rep >                                           mTime;
+	uint64_t                                                            mCurrentTick;
+	uint64_t                                                            mArmedTick;
+	size_t                                                              mScheduledCount;
+	int32_t                                                             mResolution;
+	bool                                                                mRunning;
+    
+private:
+	TimerWheel( const TimerWheel & rhs );
+	TimerWheel & operator =( const TimerWheel & rhs );
+	uint64_t getElapsedTicks( const Clock::time_point & time ) const;
+	void link( Entry & entry );
+	void unlink( Entry & entry );
+	void cascade( size_t level, size_t slot );
+	void advance();
+	uint64_t getNextTick() const;
+	void startTick();
+	void handleTick( const boost::system::error_code & ec );
+    
+public:
+	// Creates a wheel ticking every resolutionMilli on the io_service. The
+	// wheel's only OS timer runs while entries are scheduled, and is armed
+	// for the next tick with an entry to expire or cascade, never for the
+	// empty ticks in between.
+	TimerWheel( boost::asio::io_service & service, int32_t resolutionMilli = 10 );
+	~TimerWheel();
+    
+	// Schedules the entry to expire after delayMilli, rounded up to the
+	// resolution of the wheel. A scheduled entry is re-armed. The owner is
+	// kept alive until the entry expires or is canceled.
+	void schedule( Entry & entry, const boost::shared_ptr< void > & owner, int32_t delayMilli );
+    
+	// Cancels the entry if it is scheduled.
+	void cancel( Entry & entry );
+    
+	// Returns the steady clock time of the last tick or Schedule. It is read
+	// without a lock, which is cheaper than reading the clock, and is what
+	// timer deltas are measured with.
+	Clock::time_point getTime();
+    
+	// Returns the time from since to the last tick, in the form passed to
+	// onTimer.
+	boost::posix_time::time_duration getElapsed( const Clock::time_point & since );
+    
+	// Returns the tick length of the wheel.
+	int32_t getResolution() const;
+    
+	// Returns the number of scheduled entries.
+	size_t getScheduledCount();
+};
+
+//-----------------------------------------------------------------------------
+
+// Metrics are recorded unless NETWORK_METRICS is defined to 0, in which case
+// every recording point compiles to nothing.
+#ifndef NETWORK_METRICS
+#define NETWORK_METRICS 1
+#endif
+
+#if NETWORK_METRICS
+#define NETWORK_METRIC( statement ) statement
+#else
+#define NETWORK_METRIC( statement )
+#endif
+
+// A copy of the counts of a LatencyHistogram.
+struct HistogramSnapshot
+{
+	std::vector< uint64_t >     counts;
+	uint64_t                    total;
+	uint64_t                    max;
+    
+	HistogramSnapshot();
+    
+	// Returns the value in nanoseconds that fraction (0 to 1) of the
+	// recorded values are at or below.
+	uint64_t getPercentile( double fraction ) const;
+    
+	// Adds the counts of rhs to this snapshot.
+	void merge( const HistogramSnapshot & rhs );
+};
+
+//-----------------------------------------------------------------------------
+
+// A log-linear histogram of durations in nanoseconds. Every power of two is
+// split into SUB_BUCKET_COUNT buckets, so a recorded value is off by at most
+// 1 / SUB_BUCKET_COUNT. Recording is a single relaxed increment.
+class LatencyHistogram
+{
+public:
+	enum { SUB_BUCKET_BITS = 4, SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS, MAX_VALUE_BITS = 48, BUCKET_COUNT = ( MAX_VALUE_BITS - SUB_BUCKET_BITS + 1 ) * SUB_BUCKET_COUNT };
+    
+private:
+	std::atomic< uint64_t >     mCounts[ BUCKET_COUNT ];
+	std::atomic< uint64_t >     mMax;
+    
+private:
+	LatencyHistogram( const LatencyHistogram & rhs );
+	LatencyHistogram & operator =( const LatencyHistogram & rhs );
+    
+public:
+	LatencyHistogram();
+    
+	// Records a duration.
+	void record( uint64_t nanos );
+    
+	// Returns a copy of the counts. This may be called from any thread
+	// while values are being recorded.
+	HistogramSnapshot getSnapshot() const;
+    
+	// Returns the bucket a value is counted in.
+	static size_t getBucketIndex( uint64_t nanos );
+    
+	// Returns the largest value counted in the bucket.
+	static uint64_t getBucketValue( size_t index );
+};
+
+//-----------------------------------------------------------------------------
+
+// A point in time copy of a Metrics object.
+struct MetricsSnapshot
+{
+	boost::posix_time::ptime                        time;
+	uint64_t                                        bytesSent;
+	uint64_t                                        bytesRecv;
+	uint64_t                                        messagesSent;
+	uint64_t                                        messagesRecv;
+	uint64_t                                        sendQueueDepth;
+	uint64_t                                        sendQueueHighWater;
+	uint64_t                                        pendingRecvs;
+	uint64_t                                        accepts;
+	uint64_t                                        errors;
+	std::map< boost::system::error_code, uint64_t > errorCounts;
+	HistogramSnapshot                               sendLatency;
+	HistogramSnapshot                               handlerTime;
+    
+	MetricsSnapshot();
+    
+	// Adds the counts of rhs to this snapshot. The high water mark is the
+	// larger of the two.
+	void merge( const MetricsSnapshot & rhs );
+    
+	// Returns the accepts per second between an earlier snapshot and this
+	// one.
+	double getAcceptRate( const MetricsSnapshot & earlier ) const;
+};
+
+//-----------------------------------------------------------------------------
+
+// Lock free counters of a connection. Every counter is a relaxed atomic, so
+// recording never blocks and snapshots may be taken from any thread while
+// the Hive runs.
+class Metrics
+{
+private:
+	std::atomic< uint64_t >         mBytesSent;
+	std::atomic< uint64_t >         mBytesRecv;
+	std::atomic< uint64_t >         mMessagesSent;
+	std::atomic< uint64_t >         mMessagesRecv;
+	std::atomic< uint64_t >         mSendQueueDepth;
+	std::atomic< uint64_t >         mSendQueueHighWater;
+	std::atomic< uint64_t >         mPendingRecvs;
+	std::atomic< uint64_t >         mAccepts;
+	std::atomic< uint64_t >         mErrors;
+    
+private:
+	Metrics( const Metrics & rhs );
+	Metrics & operator =( const Metrics & rhs );
+    
+public:
+	Metrics();
+    
+	// Returns a monotonic time in nanoseconds to measure durations with.
+	static uint64_t now();
+    
+	// Counts messages of bytes sent.
+	void addSent( uint64_t bytes, uint64_t messages = 1 );
+    
+	// Counts messages of bytes received.
+	void addRecv( uint64_t bytes, uint64_t messages = 1 );
+    
+	// Counts a buffer entering the send queue and updates the high water
+	// mark.
+	void addSendQueued();
+    
+	// Counts buffers leaving the send queue.
+	void removeSendQueued( uint64_t count );
+    
+	// Counts a recv being posted.
+	void addPendingRecv();
+    
+	// Counts posted recvs completing.
+	void removePendingRecv( uint64_t count = 1 );
+    
+	// Counts an accepted connection.
+	void addAccept();
+    
+	// Counts an error.
+	void addError();
+    
+	// Sets every counter back to zero.
+	void reset();
+    
+	// Returns a copy of every counter.
+	MetricsSnapshot getSnapshot() const;
+};
+
+//-----------------------------------------------------------------------------
+
+// The counters of an io_service of a Hive. On top of the connection
+// counters, errors are counted by error code and send latency and handler
+// run time are kept as histograms.
+class HiveMetrics : public Metrics
+{
+private:
+	// Error values of the system and misc categories below these limits
+	// are counted individually, everything else is counted as other.
+	enum { SYSTEM_ERROR_COUNT = 256, MISC_ERROR_COUNT = 8 };
+    
+	std::atomic< uint64_t >         mSystemErrors[ SYSTEM_ERROR_COUNT ];
+	std::atomic< uint64_t >         mMiscErrors[ MISC_ERROR_COUNT ];
+	std::atomic< uint64_t >         mOtherErrors;
+	LatencyHistogram                mSendLatency;
+	LatencyHistogram                mHandlerTime;
+    
+public:
+	HiveMetrics();
+    
+	using Metrics::addError;
+    
+	// Counts an error by its error code.
+	void addError( const boost::system::error_code & ec );
+    
+	// Records the time from a buffer being queued to its write completing.
+	void recordSendLatency( uint64_t nanos );
+    
+	// Records the run time of a completion handler.
+	void recordHandlerTime( uint64_t nanos );
+    
+	// Returns a copy of every counter and histogram.
+	MetricsSnapshot getSnapshot() const;
+};
+
+//-----------------------------------------------------------------------------
+
+// Records the time from construction to destruction as a handler run time.
+class HandlerTimer
+{
+private:
+	HiveMetrics &   mMetrics;
+	uint64_t        mStart;
+    
+private:
+	HandlerTimer( const HandlerTimer & rhs );
+	HandlerTimer & operator =( const HandlerTimer & rhs );
+    
+public:
+	HandlerTimer( HiveMetrics & metrics )
+	: mMetrics( metrics ), mStart( Metrics::now() )
+	{
+	}
+    
+	~HandlerTimer()
+	{
+		mMetrics.recordHandlerTime( Metrics::now() - mStart );
+	}
+};
+
+//-----------------------------------------------------------------------------
+
+// Tracing points are compiled in unless NETWORK_TRACING is defined to 0, in
+// which case every one compiles to nothing. Compiled in, they record nothing
+// until Tracer::setEnabled is called.
+#ifndef NETWORK_TRACING
+#define NETWORK_TRACING 1
+#endif
+
+#if NETWORK_TRACING
+#define NETWORK_TRACE( statement ) statement
+#else
+#define NETWORK_TRACE( statement )
+#endif
+
+// Records handler runs and the sends and recvs posted to connections as
+// Chrome trace events, viewable in chrome://tracing or Perfetto. Each thread
+// writes into its own ring buffer, so recording takes no lock and the oldest
+// events are overwritten once a buffer is full. While disabled a tracing
+// point costs one relaxed load.
+class Tracer
+{
+private:
+	// Only the owning thread writes a buffer. Every event carries the
+	// sequence number it was written under, so a reader can tell a slot
+	// that was overwritten while it read it.
+	struct Event
+	{
+		std::atomic< uint64_t >     mSequence;
+		std::atomic< const char * > mName;
+		std::atomic< uint64_t >     mTime;
+		std::atomic< uint64_t >     mDuration;
+		std::atomic< uint64_t >     mObject;
+		std::atomic< uint64_t >     mValue;
+		std::atomic< char >         mPhase;
+        
+		Event();
+	};
+    
+	struct Buffer
+	{
+		std::vector< Event >        mEvents;
+		std::atomic< uint64_t >     mCount;
+		std::atomic< uint64_t >     mBase;
+		std::string                 mName;
+		uint32_t                    mThreadId;
+		bool                        mExited;
+        
+		Buffer( size_t events, uint32_t threadId, const std::string & name );
+	};
+    
+	// Marks the buffer of a thread as exited when the thread ends.
+	struct ThreadBuffer
+	{
+		Buffer *                    mBuffer;
+        
+		ThreadBuffer();
+		~ThreadBuffer();
+	};
+    
+	static std::atomic< bool >      sEnabled;
+	static std::atomic< size_t >    sBufferEvents;
+	static std::mutex               sMutex;
+	static std::vector< boost::shared_ptr< Buffer > > sBuffers;
+	static thread_local ThreadBuffer sThreadBuffer;
+	static thread_local std::string sThreadName;
+    
+private:
+	Tracer();
+    
+	static Buffer & getBuffer();
+	static void record( const char * name, char phase, uint64_t time, uint64_t duration, const void * object, uint64_t value );
+    
+	// Formats nanoseconds as the microseconds Chrome trace times are in.
+	static std::string formatMicros( uint64_t nanos );
+    
+public:
+	// Starts or stops recording on every thread.
+	static void setEnabled( bool enabled );
+	static bool isEnabled()
+	{
+		return sEnabled.load( std::memory_order_relaxed );
+	}
+    
+	// Sets the number of events each thread keeps. Threads that record
+	// their first event afterwards get buffers of this size. Defaults to
+	// 32768. The buffer of an exited thread is kept until its events have
+	// been written or cleared, then handed to the next new thread.
+	static void setBufferEvents( size_t events );
+	static size_t getBufferEvents();
+    
+	// Names the calling thread in the trace. Hive workers name themselves.
+	static void setThreadName( const std::string & name );
+    
+	// Records a point in time on the calling thread.
+	static void instant( const char * name, const void * object, uint64_t value = 0 );
+    
+	// Records a span of the calling thread between two Metrics::now() times.
+	static void span( const char * name, uint64_t begin, uint64_t end, const void * object, uint64_t value = 0 );
+    
+	// Records a span that belongs to the object rather than to the thread,
+	// such as the time a buffer waits in a send queue.
+	static void asyncSpan( const char * name, uint64_t begin, uint64_t end, const void * object );
+    
+	// Drops every recorded event.
+	static void clear();
+    
+	// Writes the events of every thread as Chrome trace JSON. Recording may
+	// go on meanwhile, events overwritten during the write are left out.
+	static void write( std::ostream & stream );
+    
+	// Writes the trace to a file, returns false if it cannot be written.
+	static bool dump( const std::string & path );
+};
+
+// Records the time from construction to destruction as a span of the
+// calling thread.
+class TraceScope
+{
+private:
+	const char *    mName;
+	const void *    mObject;
+	uint64_t        mStart;
+    
+private:
+	TraceScope( const TraceScope & rhs );
+	TraceScope & operator =( const TraceScope & rhs );
+    
+public:
+	TraceScope( const char * name, const void * object )
+	: mName( name ), mObject( object ), mStart( Tracer::isEnabled() ? Metrics::now() : 0 )
+	{
+	}
+    
+	~TraceScope()
+	{
+		if( mStart != 0 )
+		{
+			Tracer::span( mName, mStart, Metrics::now(), mObject );
+		}
+	}
+};
+
+//-----------------------------------------------------------------------------
+
+class RecvBlock
+{
+	friend class RecvBufferPool;
+	friend class RecvFreeList;
+	friend void intrusive_ptr_add_ref( RecvBlock * block );
+	friend void intrusive_ptr_release( RecvBlock * block );
+    
+private:
+	std::vector< uint8_t >              mBuffer;
+	boost::shared_ptr< RecvFreeList >   mFreeList;
+	std::atomic< int32_t >              mRefCount;
+    
+private:
+	RecvBlock( size_t blockSize );
+	~RecvBlock();
+	RecvBlock( const RecvBlock & rhs );
+	RecvBlock & operator =( const RecvBlock & rhs );
+    
+public:
+	// Returns the received bytes. The capacity of the vector is reserved by
+	// the pool, so resizing it within the block size does not allocate.
+	std::vector< uint8_t > & getBuffer();
+    
+	// Returns a pointer to the received bytes.
+	uint8_t * data();
+    
+	// Returns the number of received bytes.
+	size_t size() const;
+};
+
+//-----------------------------------------------------------------------------
+
+// The idle blocks of one io_service. A leased block holds its list alive,
+// so the threads of different io_services never share a lock or a
+// reference count.
+class RecvFreeList
+{
+	friend class RecvBufferPool;
+	friend void intrusive_ptr_release( RecvBlock * block );
+    
+private:
+	std::mutex                  mMutex;
+	std::vector< RecvBlock * >  mBlocks;
+	std::atomic< size_t >       mMaxFreeBlocks;
+	std::atomic< size_t >       mLeasedCount;
+    
+private:
+	RecvFreeList( size_t maxFreeBlocks );
+	RecvFreeList( const RecvFreeList & rhs );
+	RecvFreeList & operator =( const RecvFreeList & rhs );
+	void release( RecvBlock * block );
+    
+public:
+	~RecvFreeList();
+};
+
+//-----------------------------------------------------------------------------
+
+class RecvBufferPool
+{
+private:
+	std::vector< boost::shared_ptr< RecvFreeList > >    mFreeLists;
+	std::atomic< size_t >                               mBlockSize;
+    
+private:
+	RecvBufferPool( const RecvBufferPool & rhs );
+	RecvBufferPool & operator =( const RecvBufferPool & rhs );
+    
+public:
+	// Creates a pool with listCount free lists, one for each io_service
+	// leasing from it.
+	RecvBufferPool( size_t blockSize = 4096, size_t maxFreeBlocks = 1024, size_t listCount = 1 );
+	~RecvBufferPool();
+    
+	// Leases a block from the free list at listIndex, which is the index of
+	// the calling io_service in its Hive, allocating a new one only if the
+	// list is empty.
+	RecvLease acquire( size_t listIndex = 0 );
+    
+	// Sets the capacity reserved for each block. Idle blocks with a smaller
+	// capacity, including those whose buffer was swapped out, are grown
+	// when they are leased again.
+	void setBlockSize( size_t blockSize );
+    
+	// Returns the capacity reserved for each block.
+	size_t getBlockSize();
+    
+	// Sets the number of idle blocks kept on each free list. Blocks
+	// returned beyond this limit are freed.
+	void setMaxFreeBlocks( size_t maxFreeBlocks );
+    
+	// Returns the number of idle blocks kept on each free list.
+	size_t getMaxFreeBlocks();
+    
+	// Returns the number of blocks currently on the free lists.
+	size_t getFreeCount();
+    
+	// Returns the number of blocks currently leased.
+	size_t getLeasedCount();
+};
+
+//-----------------------------------------------------------------------------
+
+// Resolves host names without blocking the io_service threads. Results are
+// cached for a TTL and concurrent requests for the same host share a single
+// lookup. Static host entries, which may be loaded from a hosts file, and a
+// replacement lookup function allow resolution to be stubbed out.
+class HostResolver : public boost::enable_shared_from_this< HostResolver >
+{
+public:
+	// Receives the addresses of a host, or the error resolving it.
+	typedef boost::function< void( const boost::system::error_code & ec, const std::vector< boost::asio::ip::address > & addresses ) > Callback;
+    
+	// Looks up the addresses of a host in place of the system resolver. It
+	// is run on the io_service of the resolver and must not block.
+	typedef boost::function< std::vector< boost::asio::ip::address >( const std::string & host, boost::system::error_code & ec ) > Lookup;
+    
+private:
+	struct Entry
+	{
+		std::vector< boost::asio::ip::address > mAddresses;
+		boost::system::error_code               mError;
+		uint64_t                                mExpiry;
+		bool                                    mResolving;
+		std::vector< Callback >                 mWaiters;
+        
+		Entry();
+	};
+    
+	boost::asio::io_service &                                           mIoService;
+	boost::asio::ip::tcp::resolver                                      mResolver;
+	std::mutex                                                          mMutex;
+	std::map< std::string, Entry >                                      mEntries;
+	std::map< std::string, std::vector< boost::asio::ip::address > >   mHostEntries;
+	Lookup                                                              mLookup;
+	int32_t                                                             mTtl;
+	int32_t                                                             mNegativeTtl;
+	size_t                                                              mMaxEntries;
+	uint64_t                                                            mLookupCount;
+	uint64_t                                                            mHitCount;
+    
+private:
+	HostResolver( const HostResolver & rhs );
+	HostResolver & operator =( const HostResolver & rhs );
+	static uint64_t now();
+	static std::string getKey( const std::string & host );
+	void purge( uint64_t time );
+	void makeRoom( uint64_t time );
+	void startLookup( const std::string & key );
+	void dispatchLookup( const std::string & key );
+	void handleLookup( const boost::system::error_code & ec, boost::asio::ip::tcp::resolver::iterator iterator, const std::string & key );
+	void finishLookup( const std::string & key, const boost::system::error_code & ec, const std::vector< boost::asio::ip::address > & addresses );
+    
+public:
+	// Creates a resolver completing its lookups on the io_service. It must
+	// be owned by a boost::shared_ptr, which pending lookups hold on to.
+	HostResolver( boost::asio::io_service & service );
+	~HostResolver();
+    
+	// Resolves host asynchronously. The callback is always invoked on the
+	// io_service of the resolver, never from within this call; wrap it in a
+	// strand to have it run elsewhere. Numeric addresses and static entries
+	// are answered without a lookup.
+	void resolve( const std::string & host, const Callback & callback );
+    
+	// Resolves host on the calling thread, using the cache and static
+	// entries first. Throws boost::system::system_error on failure. Only
+	// meant for setup code, never call it from a handler. If allowLookup is
+	// false, only numeric addresses, static entries and fresh cache entries
+	// are answered and any other host throws boost::asio::error::would_block
+	// instead of blocking.
+	std::vector< boost::asio::ip::address > resolveNow( const std::string & host, bool allowLookup = true );
+    
+	// Sets static addresses for host that take precedence over the cache
+	// and the lookup, like an entry of a hosts file.
+	void setHostEntry( const std::string & host, const std::vector< boost::asio::ip::address > & addresses );
+    
+	// Removes the static addresses of host.
+	void removeHostEntry( const std::string & host );
+    
+	// Adds every entry of a file in hosts file format as static addresses.
+	// Returns false if the file could not be read.
+	bool loadHostsFile( const std::string & path );
+    
+	// Replaces the system resolver with lookup. Passing an empty function
+	// restores the system resolver.
+	void setLookup( const Lookup & lookup );
+    
+	// Sets how long successful and failed lookups are cached. The defaults
+	// are 60 seconds and 5 seconds.
+	void setTtl( int32_t ttlMilli, int32_t negativeTtlMilli );
+    
+	// Returns how long successful lookups are cached.
+	int32_t getTtl();
+    
+	// Returns how long failed lookups are cached.
+	int32_t getNegativeTtl();
+    
+	// Sets the number of hosts cached. Once the cache is full, expired
+	// entries are dropped first, then those closest to expiring. The
+	// default value is 1024.
+	void setMaxEntries( size_t maxEntries );
+    
+	// Drops every cached result. Static entries are kept.
+	void clear();
+    
+	// Returns the number of hosts cached.
+	size_t getCacheSize();
+    
+	// Returns the number of lookups made.
+	uint64_t getLookupCount();
+    
+	// Returns the number of requests answered from the cache.
+	uint64_t getHitCount();
+};
+
+//-----------------------------------------------------------------------------
+
+// Files are sent with sendfile where it is available.
+#if defined( __linux__ ) || defined( __APPLE__ )
+#define NETWORK_SENDFILE 1
+#else
+#define NETWORK_SENDFILE 0
+#endif
+
+#if defined( BOOST_ASIO_HAS_LOCAL_SOCKETS )
+#define NETWORK_SHM 1
+#else
+#define NETWORK_SHM 0
+#endif
+
+#if NETWORK_SHM
+
+// Joins two processes on the same host through a pair of byte rings in a
+// shared memory segment, one ring per direction, each with a single writer
+// and a single reader. A UNIX domain socket between the two carries the
+// segment name when the channel is set up and afterwards a wakeup byte,
+// which is only written when the other side is waiting on an empty or full
+// ring. Used by connections to "shm://" hosts.
+class ShmChannel
+{
+public:
+	enum { NAME_SIZE = 32, DEFAULT_RING_BYTES = 1024 * 1024 };
+    
+private:
+	struct Ring
+	{
+		std::atomic< uint64_t >     mHead;
+		uint8_t                     mHeadPadding[ 64 - sizeof( std::atomic< uint64_t > ) ];
+		std::atomic< uint64_t >     mTail;
+		uint8_t                     mTailPadding[ 64 - sizeof( std::atomic< uint64_t > ) ];
+		std::atomic< uint32_t >     mReaderWaiting;
+		std::atomic< uint32_t >     mWriterWaiting;
+		std::atomic< uint32_t >     mClosed;
+		uint8_t                     mFlagPadding[ 64 - 3 * sizeof( std::atomic< uint32_t > ) ];
+	};
+    
+	// The start of the segment, the data of both rings follows.
+	struct Segment
+	{
+		uint64_t                    mRingBytes;
+		uint8_t                     mPadding[ 64 - sizeof( uint64_t ) ];
+		Ring                        mRings[ 2 ];
+	};
+    
+	boost::asio::local::stream_protocol::socket mSocket;
+	char                            mName[ NAME_SIZE ];
+	uint8_t                         mWakeBuffer[ 64 ];
+	Segment *                       mSegment;
+	size_t                          mSegmentBytes;
+	Ring *                          mRx;
+	Ring *                          mTx;
+	uint8_t *                       mRxData;
+	uint8_t *                       mTxData;
+	uint64_t                        mRingBytes;
+	bool                            mOwner;
+	bool                            mPeerClosed;
+    
+private:
+	ShmChannel( const ShmChannel & rhs );
+	ShmChannel & operator =( const ShmChannel & rhs );
+	void map( int fd, size_t segmentBytes, boost::system::error_code & ec );
+	void wake();
+    
+public:
+	// Creates a channel whose socket completes on the io_service.
+	ShmChannel( boost::asio::io_service & service );
+	~ShmChannel();
+    
+	// Returns the path of the UNIX domain socket a "shm://" host listens on.
+	// It lives in $XDG_RUNTIME_DIR, or else in a directory of the user's own
+	// under /tmp that is created if missing, so only processes of the same
+	// user can listen or connect. Sets ec if name holds a '/' or a NUL, if
+	// the path does not fit a socket address or if the directory is not
+	// private to the user.
+	static std::string getPath( const std::string & name, uint16_t port, boost::system::error_code & ec );
+    
+	// Removes the socket at path. Anything that is not a socket, a symlink
+	// included, is left in place.
+	static void removeSocket( const std::string & path );
+    
+	// Creates and maps a new segment with rings of ringBytes each, writing
+	// the first ring. The socket must be connected.
+	void create( size_t ringBytes, boost::system::error_code & ec );
+    
+	// Maps the segment named in the name buffer, writing the second ring,
+	// and removes the name, so the segment goes away with the last
+	// mapping. The socket must be connected.
+	void open( boost::system::error_code & ec );
+    
+	// Marks the send ring as finished. The peer reads what is left in it
+	// and then sees the end of the stream, while this side goes on reading.
+	void shutdown();
+    
+	// Unmaps the segment and closes the socket. Reads and writes copy
+	// nothing afterwards.
+	void close();
+    
+	// Copies up to size bytes out of the receive ring and returns the
+	// number copied. Wakes the peer if it waits for space. Sets ec, and
+	// copies nothing, if the peer left the ring indices inconsistent.
+	size_t read( uint8_t * data, size_t size, boost::system::error_code & ec );
+    
+	// Copies up to size bytes into the send ring and returns the number
+	// copied. Wakes the peer if it waits for data. Sets ec, and copies
+	// nothing, if the peer left the ring indices inconsistent.
+	size_t write( const uint8_t * data, size_t size, boost::system::error_code & ec );
+    
+	// Asks the peer to wake this side once the receive ring has data.
+	// Returns false, without waiting, if data arrived in the meantime.
+	bool waitRead();
+    
+	// Asks the peer to wake this side once the send ring has space.
+	// Returns false, without waiting, if space was freed in the meantime.
+	bool waitWrite();
+    
+	// Returns true once the receive ring is empty and the peer will not
+	// write to it again, because it shut it down or closed its socket.
+	bool isDrained() const;
+    
+	// Marks that the peer closed its socket. Data left in the receive ring
+	// can still be read.
+	void setPeerClosed();
+    
+	// Returns true once the peer closed its socket.
+	bool isPeerClosed() const;
+    
+	// Returns the socket joining the two sides.
+	boost::asio::local::stream_protocol::socket & getSocket();
+    
+	// Returns the segment name, which is sent to the peer on setup.
+	boost::asio::mutable_buffers_1 getNameBuffer();
+    
+	// Returns the buffer wakeup bytes are read into.
+	boost::asio::mutable_buffers_1 getWakeBuffer();
+};
+
+#endif
+
+//-----------------------------------------------------------------------------
+
+// An on or off socket option that asio has no type for, such as
+// SO_REUSEPORT or TCP_QUICKACK, usable with set_option and get_option of any
+// asio socket or acceptor.
+template< int Level, int Name >
+class BooleanSocketOption
+{
+private:
+	int     mValue;
+    
+public:
+	explicit BooleanSocketOption( bool value = false )
+	: mValue( value ? 1 : 0 )
+	{
+	}
+    
+	bool value() const
+	{
+		return mValue != 0;
+	}
+    
+	template< typename Protocol >
+	int level( const Protocol & ) const
+	{
+		return Level;
+	}
+    
+	template< typename Protocol >
+	int name( const Protocol & ) const
+	{
+		return Name;
+	}
+    
+	template< typename Protocol >
+	int * data( const Protocol & )
+	{
+		return &mValue;
+	}
+    
+	template< typename Protocol >
+	const int * data( const Protocol & ) const
+	{
+		return &mValue;
+	}
+    
+	template< typename Protocol >
+	size_t size( const Protocol & ) const
+	{
+		return sizeof( mValue );
+	}
+    
+	// Some platforms return a single byte for boolean options.
+	template< typename Protocol >
+	void resize( const Protocol &, size_t size )
+	{
+		if( size == sizeof( char ) )
+		{
+			mValue = *reinterpret_cast< const char * >( &mValue ) ? 1 : 0;
+		}
+		else if( size != sizeof( mValue ) )
+		{
+			throw std::length_error( "BooleanSocketOption resize" );
+		}
+	}
+};
+
+//-----------------------------------------------------------------------------
+
+// TCP options applied to the socket of a connection when it is bound,
+// connected or accepted. Buffer sizes of 0 leave the system default.
+struct SocketOptions
+{
+	bool        noDelay;
+	bool        quickAck;
+	bool        keepAlive;
+	int32_t     receiveBufferBytes;
+	int32_t     sendBufferBytes;
+    
+	// The system defaults.
+	SocketOptions();
+    
+	// Sends small messages at once instead of holding them back for Nagle,
+	// and acknowledges every read right away where TCP_QUICKACK exists.
+	// The kernel drops quick ack mode on its own, so it costs a setsockopt
+	// after each read that returns data without filling its buffer.
+	static SocketOptions lowLatency();
+    
+	// Keeps Nagle and gives the socket 4mb buffers in both directions, so
+	// large transfers fill a long or fast link.
+	static SocketOptions bulk();
+};
+
+//-----------------------------------------------------------------------------
+
+class Connection : public boost::enable_shared_from_this< Connection >
+{
+	friend class Acceptor;
+	friend class Hive;
+	friend class ConnectionPool;
+	friend class BroadcastGroup;
+#if NETWORK_COROUTINES
+	friend class RecvAwaitable;
+	friend class SendAwaitable;
+	friend class ConnectAwaitable;
+	friend class AcceptAwaitable;
+#endif
+    
+public:
+	// What Send does with a buffer while the send queue is at or above the
+	// high watermark. The buffer is queued anyway, dropped, or the
+	// connection is disconnected.
+	enum SendQueuePolicy { SEND_QUEUE_NOTIFY, SEND_QUEUE_DROP, SEND_QUEUE_DISCONNECT };
+    
+	// The lifecycle of a connection. A connection is connecting until it is
+	// accepted or connected, open until shutdown is called, draining while
+	// queued sends are written and the peer closes its side, and closed
+	// once an error or disconnect has been handled. States only advance,
+	// except when a pooled connection is recycled.
+	enum State { STATE_CONNECTING, STATE_OPEN, STATE_DRAINING, STATE_CLOSED };
+    
+private:
+	// A file or memory region queued with SendFile, SendRegion or
+	// AsyncSend. It sits in the send queue as an empty SharedBuffer and is
+	// written a chunk at a time. A region is kept alive by its owner until
+	// it is written; an awaited send resumes its awaitable instead.
+	struct SendSource
+	{
+		int                                 mFile;
+		const uint8_t *                     mData;
+		boost::shared_ptr< const void >     mOwner;
+		uint64_t                            mOffset;
+		uint64_t                            mBytes;
+		uint64_t                            mSent;
+#if NETWORK_COROUTINES
+		IoAwaitable *                       mAwaitable;
+#endif
+        
+		SendSource();
+		~SendSource();
+#if NETWORK_SENDFILE
+		void map( boost::system::error_code & ec );
+#endif
+	};
+    
+	enum { SEND_CHUNK_BYTES = 1024 * 1024 };
+    
+	// Caller memory a read posted with RecvInto fills. It sits in the recv
+	// queue as RECV_INTO.
+	struct RecvTarget
+	{
+		std::vector< boost::asio::mutable_buffer > mBuffers;
+		size_t                              mBytes;
+		size_t                              mDone;
+	};
+    
+	enum { RECV_INTO = -1 };
+    
+#if NETWORK_SHM
+	// What a shared memory read completes with.
+	enum ShmRead { SHM_READ_RECV, SHM_READ_FRAME, SHM_READ_INTO };
+#endif
+    
+	boost::shared_ptr< Hive >           mHive;
+	boost::asio::io_service &           mIoService;
+	size_t                              mServiceIndex;
+	boost::asio::ip::tcp::socket        mSocket;
+	NetworkStrand                       mIoStrand;
+	TimerWheel &                        mTimerWheel;
+	TimerWheel::Entry                   mTimerEntry;
+	TimerWheel::Entry                   mConnectEntry;
+	TimerWheel::Clock::time_point       mLastTime;
+	HandlerAllocator                    mHandlerAllocator;
+	RecvLease                           mRecvLease;
+	std::list< int32_t >                mPendingRecvs;
+	std::deque< RecvTarget >            mPendingRecvTargets;
+	std::list< SharedBuffer >           mPendingSends;
+	std::deque< boost::shared_ptr< SendSource > > mPendingSources;
+	std::vector< boost::asio::const_buffer > mSendBuffers;
+	std::vector< boost::asio::ip::tcp::endpoint > mConnectEndpoints;
+	std::vector< boost::shared_ptr< boost::asio::ip::tcp::socket > > mConnectSockets;
+	size_t                              mConnectNext;
+	int32_t                             mConnectAttemptDelay;
+#if NETWORK_COROUTINES
+	IoAwaitable *                       mConnectAwaitable;
+#endif
+	int32_t                             mReceiveBufferSize;
+	int32_t                             mReceiveBufferStartSize;
+	int32_t                             mTimerInterval;
+	int32_t                             mSendBatchMaxBytes;
+	int32_t                             mSendBatchMaxBuffers;
+	bool                                mSendCoalescing;
+	bool                                mSendNotifyPerBatch;
+	std::atomic< uint64_t >             mSendQueueBytes;
+	uint64_t                            mSendQueueHighBytes;
+	uint64_t                            mSendQueueLowBytes;
+	SendQueuePolicy                     mSendQueuePolicy;
+	bool                                mSendQueueFull;
+	std::vector< uint8_t >              mFrameBuffer;
+	size_t                              mFrameBegin;
+	size_t                              mFrameEnd;
+	uint64_t                            mFrameMaxBytes;
+	int32_t                             mFramePrefixBytes;
+	bool                                mFrameBigEndian;
+	bool                                mFrameReading;
+#if NETWORK_METRICS
+	Metrics                             mMetrics;
+	HiveMetrics *                       mHiveMetrics;
+	std::deque< uint64_t >              mSendQueueTimes;
+#endif
+	TimerWheel::Clock::time_point       mDrainTime;
+	int32_t                             mLingerTimeout;
+	bool                                mSendShutdown;
+	std::atomic< State >                mState;
+	SocketOptions                       mSocketOptions;
+	bool                                mSocketOptionsSet;
+	bool                                mAdaptiveReceive;
+	int32_t                             mAdaptiveMinBytes;
+	int32_t                             mAdaptiveMaxBytes;
+	uint32_t                            mAdaptiveLowReads;
+	std::mutex                          mDrainMutex;
+	std::vector< boost::weak_ptr< BroadcastGroup > > mDrainGroups;
+	std::atomic< bool >                 mDrainWatched;
+#if NETWORK_SHM
+	boost::shared_ptr< ShmChannel >     mShm;
+	uint8_t *                           mShmReadData;
+	size_t                              mShmReadBytes;
+	size_t                              mShmReadMinBytes;
+	size_t                              mShmReadDone;
+	ShmRead                             mShmReadKind;
+	bool                                mShmReading;
+	size_t                              mShmSendBuffer;
+	size_t                              mShmSendOffset;
+	size_t                              mShmSendBytes;
+	bool                                mShmSending;
+#endif
+    
+protected:
+	// Creates a connection on the next io_service of the Hive, in round
+	// robin order.
+	Connection( boost::shared_ptr< Hive > hive );
+    
+	// Creates a connection on the io_service of the Hive selected by the
+	// application supplied affinity key. Connections with the same key
+	// share a worker.
+	Connection( boost::shared_ptr< Hive > hive, size_t affinityKey );
+	virtual ~Connection();
+    
+private:
+	Connection( boost::shared_ptr< Hive > hive, boost::asio::io_service & service );
+	Connection( const Connection & rhs );
+	Connection & operator =( const Connection & rhs );
+	void startSend();
+	void startRecv( int32_t totalBytes );
+	void startRecvInto();
+	void startFrameRecv();
+	void startTimer();
+	void startError( const boost::system::error_code & ec );
+	void startConnectAttempt();
+	void failConnect( const boost::system::error_code & ec );
+#if NETWORK_COROUTINES
+	void resumeConnect( const boost::system::error_code & ec );
+#endif
+	void startOpen();
+	void startDrain();
+	void applySocketOptions( boost::asio::ip::tcp::socket & socket );
+	void updateRecv( size_t requestedBytes, size_t actualBytes );
+	void clearQueues();
+	void recycle();
+	bool admitSend( size_t bytes );
+	bool postSend( const SharedBuffer & buffer, bool & admitted );
+	void watchDrain( const boost::weak_ptr< BroadcastGroup > & group );
+	void notifyDrain();
+	void dispatchSend( const SharedBuffer & buffer );
+	void dispatchSendSource( const boost::shared_ptr< SendSource > & source );
+	bool postSendSource( const boost::shared_ptr< SendSource > & source );
+	void dispatchRecv( int32_t totalBytes );
+	void dispatchRecvInto( const std::vector< boost::asio::mutable_buffer > & buffers );
+	static void dispatchTimer( const boost::shared_ptr< void > & owner );
+	static void dispatchConnectTimer( const boost::shared_ptr< void > & owner );
+	void handleResolve( const boost::system::error_code & ec, const std::vector< boost::asio::ip::address > & addresses, uint16_t port );
+	void handleConnect( const boost::system::error_code & ec, boost::shared_ptr< boost::asio::ip::tcp::socket > socket );
+	void handleConnectDelay();
+	void handleSend( const boost::system::error_code & ec, size_t sendCount, size_t sendBytes );
+#if NETWORK_SENDFILE
+	void handleSendFile( const boost::system::error_code & ec, size_t sendBytes );
+#endif
+	void handleRecvReady( const boost::system::error_code & ec, int32_t totalBytes );
+	void handleRecvRest( const boost::system::error_code & ec, size_t actualBytes, size_t readBytes );
+	void handleRecv( const boost::system::error_code & ec, int32_t actualBytes );
+	void handleRecvInto( const boost::system::error_code & ec, size_t actualBytes );
+	void handleFrameRecv( const boost::system::error_code & ec, size_t actualBytes );
+	void handleTimer( const boost::system::error_code & ec );
+	void handleShutdown();
+#if NETWORK_SHM
+	void startShmConnect( const std::string & host, uint16_t port );
+	void startShmWake();
+	void startShmRead( uint8_t * data, size_t size, size_t minBytes, ShmRead kind );
+	void continueShmRead();
+	void continueShmSend();
+	void handleShmConnect( const boost::system::error_code & ec, const std::string & host, uint16_t port );
+	void handleShmHandshake( const boost::system::error_code & ec, const std::string & host, uint16_t port );
+	void handleShmWake( const boost::system::error_code & ec, size_t actualBytes );
+#endif
+    
+private:
+	// Called when the connection has successfully connected to the local
+	// host.
+	virtual void onAccept( const std::string & host, uint16_t port ) = 0;
+    
+	// Called when the connection has successfully connected to the remote
+	// host.
+	virtual void onConnect( const std::string & host, uint16_t port ) = 0;
+    
+	// Called when data has been sent by the connection. When send coalescing
+	// is enabled this is still invoked once for every buffer in the batch,
+	// unless setSendNotifyPerBatch( true ) has been called.
+	virtual void onSend( const std::vector< uint8_t > & buffer ) = 0;
+    
+	// Called once per completed gather write when send coalescing is enabled
+	// and per batch notification is requested. The default implementation
+	// does nothing.
+	virtual void onSendBatch( size_t bufferCount, uint64_t totalBytes );
+    
+	// Called as a file or region queued with SendFile or SendRegion is
+	// written, once per chunk of up to a megabyte, with the bytes written so
+	// far and the total. OnSend is not called for these. The default
+	// implementation does nothing.
+	virtual void onSendProgress( uint64_t sentBytes, uint64_t totalBytes );
+    
+	// Called when the bytes waiting to be sent reach the high watermark.
+	// The default implementation does nothing.
+	virtual void onSendQueueFull( uint64_t queuedBytes );
+    
+	// Called when a send queue that was full has drained to the low
+	// watermark. The default implementation does nothing.
+	virtual void onDrain( uint64_t queuedBytes );
+    
+	// Called when data has been received by the connection.
+	virtual void onRecv( std::vector< uint8_t > & buffer ) = 0;
+    
+	// Called when data has been received by the connection with the pooled
+	// block holding it. The application may keep the lease for as long as it
+	// needs the data, the block is returned to the Hive's pool once the lease
+	// is released. The default implementation invokes OnRecv.
+	virtual void onRecvLease( const RecvLease & lease );
+    
+	// Called for every complete frame when framing is enabled. The data
+	// points into the connection's receive buffer and is only valid for the
+	// duration of the call. The default implementation copies the frame
+	// into a vector and invokes OnRecv.
+	virtual void onRecvFrame( const uint8_t * data, size_t size );
+    
+	// Called once a read posted with RecvInto has filled its buffers, with
+	// the number of bytes read. The default implementation does nothing.
+	virtual void onRecvInto( const std::vector< boost::asio::mutable_buffer > & buffers, size_t size );
+    
+	// Called on each timer event.
+	virtual void onTimer( const boost::posix_time::time_duration & delta ) = 0;
+    
+	// Called when an error is encountered.
+	virtual void onError( const boost::system::error_code & ec ) = 0;
+    
+	// Called when a pooled connection has been released and is about to go
+	// back to its ConnectionPool. The socket is closed and every queue is
+	// empty; application state of the session should be reset here. The
+	// default implementation does nothing.
+	virtual void onRecycle();
+    
+public:
+	// Returns the Hive object.
+	boost::shared_ptr< Hive > getHive();
+    
+	// Returns the io_service this connection was assigned to.
+	boost::asio::io_service & getService();
+    
+	// Returns the socket object.
+	boost::asio::ip::tcp::socket & getSocket();
+    
+	// Returns the strand object.
+	NetworkStrand & getStrand();
+    
+	// Returns the allocator used for the handlers of this object.
+	HandlerAllocator & getHandlerAllocator();
+    
+	// Sets the application specific receive buffer size used. For stream
+	// based protocols such as HTTP, you want this to be pretty large, like
+	// 64kb. For packet based protocols, then it will be much smaller,
+	// usually 512b - 8kb depending on the protocol. The default value is
+	// 4kb.
+	void setReceiveBufferSize( int32_t size );
+    
+	// Returns the size of the receive buffer size of the current object.
+	// With adaptive receive sizing this is the size the next read uses.
+	int32_t getReceiveBufferSize() const;
+    
+	// Enables or disables adaptive receive sizing. The receive buffer size
+	// then doubles, up to maxBytes, whenever a read fills the buffer, and
+	// halves, down to minBytes, after eight reads in a row filling less
+	// than a quarter of it. Only reads of Recv( 0 ) and framed reads are
+	// sized this way, and a recycled connection starts over from the size
+	// last set. The default is disabled.
+	void setAdaptiveReceive( bool enabled, int32_t minBytes = 512, int32_t maxBytes = 256 * 1024 );
+    
+	// Returns true if the receive buffer size adapts to the reads.
+	bool getAdaptiveReceive() const;
+    
+	// Sets the options applied to the socket by Bind, by every connection
+	// attempt and on accept. Buffer sizes only take part in the TCP
+	// handshake when the socket is bound or connected; an accepted socket
+	// gets them afterwards. Must be called before the connection is made.
+	void setSocketOptions( const SocketOptions & options );
+    
+	// Returns the options applied to the socket.
+	const SocketOptions & getSocketOptions() const;
+    
+	// Sets the timer interval of the object. The interval is changed after
+	// the next update is called.
+	void setTimerInterval( int32_t timerIntervalMilli );
+    
+	// Returns the timer interval of the object.
+	int32_t getTimerInterval() const;
+    
+	// Enables or disables send coalescing. When enabled, every buffer queued
+	// at the time a write is started is sent with a single scatter/gather
+	// write instead of one write per buffer. The default is disabled.
+	void setSendCoalescing( bool enabled );
+    
+	// Returns true if send coalescing is enabled.
+	bool getSendCoalescing() const;
+    
+	// Sets the upper limits of a coalesced write. A batch always contains at
+	// least one buffer, even if that buffer alone exceeds maxBytes. The
+	// default values are 64kb and 64 buffers.
+	void setSendBatchLimits( int32_t maxBytes, int32_t maxBuffers );
+    
+	// Returns the maximum number of bytes in a coalesced write.
+	int32_t getSendBatchMaxBytes() const;
+    
+	// Returns the maximum number of buffers in a coalesced write.
+	int32_t getSendBatchMaxBuffers() const;
+    
+	// Sets whether a coalesced write invokes OnSend for every buffer (the
+	// default) or OnSendBatch once for the whole batch.
+	void setSendNotifyPerBatch( bool perBatch );
+    
+	// Returns true if coalesced writes are reported through OnSendBatch.
+	bool getSendNotifyPerBatch() const;
+    
+	// Sets the send queue watermarks in bytes. The queue is full once it
+	// holds highBytes or more and is considered drained again at lowBytes or
+	// less. A highBytes of 0 disables the limit, which is the default.
+	void setSendQueueWatermarks( uint64_t highBytes, uint64_t lowBytes );
+    
+	// Returns the high watermark of the send queue.
+	uint64_t getSendQueueHighWatermark() const;
+    
+	// Returns the low watermark of the send queue.
+	uint64_t getSendQueueLowWatermark() const;
+    
+	// Sets what happens to buffers sent while the queue is full. The
+	// default is SEND_QUEUE_NOTIFY.
+	void setSendQueuePolicy( SendQueuePolicy policy );
+    
+	// Returns the send queue policy.
+	SendQueuePolicy getSendQueuePolicy() const;
+    
+	// Returns the number of bytes posted to be sent that have not been
+	// written yet. This may be called from any thread.
+	uint64_t getSendQueueBytes() const;
+    
+	// Enables length prefixed framing. Each frame is preceded by its payload
+	// length encoded in prefixBytes bytes (1, 2, 4 or 8) of the given byte
+	// order. While framing is enabled the first call to Recv starts a
+	// continuous read; every read pulls in as much as the receive buffer
+	// holds and every complete frame in it is passed to OnRecvFrame. Frames
+	// longer than maxFrameBytes are treated as a protocol error. Passing 0
+	// for prefixBytes disables framing. Must be called before the first Recv.
+	void setFraming( int32_t prefixBytes, bool bigEndian = true, uint64_t maxFrameBytes = 16 * 1024 * 1024 );
+    
+	// Returns the length prefix size in bytes, or 0 if framing is disabled.
+	int32_t getFramePrefixBytes() const;
+    
+	// Returns true if the length prefix is big endian.
+	bool getFrameBigEndian() const;
+    
+	// Returns the largest frame payload accepted.
+	uint64_t getFrameMaxBytes() const;
+    
+	// Returns the counters of this connection. This may be called from any
+	// thread. All counters are zero when NETWORK_METRICS is 0.
+	MetricsSnapshot getMetrics() const;
+    
+	// Returns true if this object has an error associated with it, that is
+	// once it is closed.
+	bool hasError();
+    
+	// Returns the lifecycle state of this object. This may be called from
+	// any thread.
+	State getState() const;
+    
+	// Sets how long a shutdown waits for the peer to close its side once
+	// every queued send has been written. The limit is checked on timer
+	// events, so it is only as precise as the timer interval. The default
+	// value is 5000 ms.
+	void setLingerTimeout( int32_t timeoutMilli );
+    
+	// Returns how long a shutdown waits for the peer.
+	int32_t getLingerTimeout() const;
+    
+	// Binds the socket to the specified interface.
+	void bind( const std::string & ip, uint16_t port );
+    
+	// Sets how long a connection attempt to one address may take before an
+	// attempt to the next resolved address is started alongside it. The
+	// default value is 250 ms.
+	void setConnectAttemptDelay( int32_t delayMilli );
+    
+	// Returns the delay between connection attempts.
+	int32_t getConnectAttemptDelay() const;
+    
+	// Starts an asynchronous connect. The host is resolved through the
+	// Hive's HostResolver and every address is tried, alternating between
+	// IPv6 and IPv4, with a new attempt started whenever the previous one
+	// fails or takes longer than the connect attempt delay. The first
+	// attempt to succeed wins. If the socket was bound with bind, only the
+	// first address of its protocol is tried.
+	//
+	// A host of the form "shm://name" connects to an acceptor listening on
+	// the same name and port on this machine. Data then goes through a
+	// shared memory ring pair instead of a TCP socket; the callbacks are
+	// the same, but the TCP socket returned by GetSocket stays closed and
+	// the coroutine awaitables are not supported.
+	void connect( const std::string & host, uint16_t port );
+    
+	// Posts data to be sent to the connection. The buffer is copied once
+	// into a SharedBuffer. Returns false if the send queue is full, in which
+	// case the send queue policy decides whether the buffer was still
+	// queued.
+	bool send( const std::vector< uint8_t > & buffer );
+    
+	// Posts data to be sent to the connection. The contents of the buffer
+	// are moved into a SharedBuffer and are not copied.
+	bool send( std::vector< uint8_t > && buffer );
+    
+	// Posts a shared buffer to be sent to the connection. Only the reference
+	// is queued, the buffer must not be modified until OnSend is invoked.
+	bool send( const SharedBuffer & buffer );
+    
+	// Posts data to be sent to the connection preceded by the length prefix
+	// configured with SetFraming. Returns false without sending anything if
+	// framing is disabled, or the payload is longer than the prefix can
+	// encode or than maxFrameBytes.
+	bool sendFrame( const std::vector< uint8_t > & payload );
+    
+#if NETWORK_SENDFILE
+	// Posts length bytes of the file at path, starting at offset, to be sent
+	// in order with the other sends. A length of 0 sends the rest of the
+	// file. The file is opened right away; over TCP the kernel then copies
+	// it straight to the socket with sendfile, over shared memory it is
+	// mapped and copied into the ring. Returns false if the file could not
+	// be opened, the range ends past its end or the send queue is full.
+	bool sendFile( const std::string & path, uint64_t offset = 0, uint64_t length = 0 );
+#endif
+    
+	// Posts size bytes at data, such as a memory mapped file, to be sent in
+	// order with the other sends without copying them. owner is released
+	// once the region has been written and must keep it valid until then.
+	bool sendRegion( const void * data, size_t size, const boost::shared_ptr< const void > & owner );
+    
+	// Posts a recv for the connection to process. If total_bytes is 0, then
+	// as many bytes as possible up to GetReceiveBufferSize() will be
+	// waited for. If Recv is not 0, then the connection will wait for exactly
+	// total_bytes before invoking OnRecv.
+	void recv( int32_t totalBytes = 0 );
+    
+	// Posts a read of exactly size bytes into data, queued in order with
+	// Recv. The bytes go from the socket straight into the caller's memory,
+	// such as a pixel buffer, which must stay valid until OnRecvInto is
+	// called. Not available while framing is enabled: the read is then not
+	// posted, false is returned and the connection stays open.
+	bool recvInto( void * data, size_t size );
+    
+	// Posts a read filling each of buffers in turn, as RecvInto above.
+	bool recvInto( const std::vector< boost::asio::mutable_buffer > & buffers );
+    
+	// Posts an asynchronous disconnect event for the object to process.
+	// Queued sends are discarded.
+	void disconnect();
+    
+	// Posts a graceful close. Sends queued before this call are still
+	// written, further sends are refused. The send side of the socket is
+	// then shut down while receiving goes on, so replies still reach OnRecv,
+	// until the peer closes its side and OnError is called with eof. A peer
+	// that stays open past the linger timeout is disconnected with
+	// timed_out.
+	void shutdown();
+    
+#if NETWORK_COROUTINES
+	// Returns an awaitable reading into buffer, which is resized to the
+	// bytes read. If totalBytes is 0 as many bytes as arrive up to the
+	// receive buffer size are read, otherwise exactly totalBytes. The read
+	// bypasses Recv and OnRecv, so do not mix the two on one connection.
+	// It completes with operation_not_supported, leaving the connection
+	// open, while framing is enabled or a Recv is outstanding, and on
+	// "shm://" connections.
+	RecvAwaitable asyncRecv( std::vector< uint8_t > & buffer, int32_t totalBytes = 0 );
+    
+	// Returns an awaitable writing all of buffer, which must stay untouched
+	// until the await completes. The buffer is queued in order with Send
+	// and is subject to the same watermark and policy; the await completes
+	// once it has been written. A send refused by a full queue completes
+	// with no_buffer_space and one made after Shutdown with shut_down,
+	// neither of which closes the connection.
+	SendAwaitable asyncSend( const std::vector< uint8_t > & buffer );
+    
+	// Returns an awaitable connecting as Connect does, racing the addresses
+	// of host with the socket options applied to every attempt. The
+	// connection is open once the await succeeds; OnConnect is not called.
+	ConnectAwaitable asyncConnect( const std::string & host, uint16_t port );
+#endif
+};
+
+//-----------------------------------------------------------------------------
+
+class Acceptor : public boost::enable_shared_from_this< Acceptor >
+{
+	friend class Hive;
+#if NETWORK_COROUTINES
+	friend class AcceptAwaitable;
+#endif
+    
+public:
+	// Creates the connection an accepted client is given. The affinity key
+	// selects the io_service of the listener accepting the client; passing
+	// it on to the Connection constructor keeps the connection on the same
+	// worker.
+	typedef boost::function< boost::shared_ptr< Connection >( boost::shared_ptr< Hive > hive, size_t affinityKey ) > ConnectionFactory;
+    
+	// Receives the outcome of ListenAsync.
+	typedef boost::function< void( const boost::system::error_code & ec ) > ListenCallback;
+    
+private:
+	// An additional SO_REUSEPORT listener on another io_service of the
+	// Hive, sharing the port of the acceptor.
+	struct Listener
+	{
+		boost::asio::ip::tcp::acceptor  mAcceptor;
+		NetworkStrand                   mStrand;
+		size_t                          mAffinityKey;
+        
+		Listener( boost::asio::io_service & service, size_t affinityKey );
+	};
+    
+	// Factory accepts failing for lack of descriptors or memory are
+	// replaced after this delay rather than straight away.
+	enum { ACCEPT_BACKOFF_MILLI = 100 };
+    
+	// Shared memory listeners given port 0 take a free port of this range.
+	enum { SHM_PORT_FIRST = 49152, SHM_PORT_COUNT = 16384 };
+    
+	boost::shared_ptr< Hive >       mHive;
+	boost::asio::io_service &       mIoService;
+	boost::asio::ip::tcp::acceptor  mAcceptor;
+	boost::asio::ip::tcp::endpoint  mLocalEndpoint;
+	NetworkStrand                   mIoStrand;
+	TimerWheel &                    mTimerWheel;
+	TimerWheel::Entry               mTimerEntry;
+	TimerWheel::Clock::time_point   mLastTime;
+	HandlerAllocator                mHandlerAllocator;
+	int32_t                         mTimerInterval;
+	std::vector< boost::shared_ptr< Listener > > mListeners;
+	TimerWheel::Entry               mBackoffEntry;
+	std::mutex                      mBackoffMutex;
+	std::vector< size_t >           mBackoffListeners;
+	ConnectionFactory               mConnectionFactory;
+	int32_t                         mAcceptBacklog;
+	bool                            mReusePort;
+#if NETWORK_METRICS
+	HiveMetrics *                   mHiveMetrics;
+#endif
+	std::atomic< bool >             mErrorState;
+#if NETWORK_SHM
+	boost::shared_ptr< boost::asio::local::stream_protocol::acceptor > mShmAcceptor;
+	std::string                     mShmHost;
+	std::string                     mShmPath;
+	uint16_t                        mShmPort;
+#endif
+    
+private:
+	Acceptor( boost::shared_ptr< Hive > hive, boost::asio::io_service & service );
+	Acceptor( const Acceptor & rhs );
+	Acceptor & operator =( const Acceptor & rhs );
+	void startAccept( size_t listener );
+	void startTimer();
+	void startError( const boost::system::error_code & ec );
+	void postAccept( size_t listener );
+	void restartAccept( const boost::system::error_code & ec, int32_t listener );
+	void dispatchAccept( boost::shared_ptr< Connection > connection );
+	void dispatchClose( size_t listener );
+	static void dispatchTimer( const boost::shared_ptr< void > & owner );
+	static void dispatchBackoff( const boost::shared_ptr< void > & owner );
+	void handleTimer( const boost::system::error_code & ec );
+	void handleAccept( const boost::system::error_code & ec, boost::shared_ptr< Connection > connection, int32_t listener );
+	void startListen( const boost::asio::ip::tcp::endpoint & endpoint, boost::system::error_code & ec );
+	void handleResolve( const boost::system::error_code & ec, const std::vector< boost::asio::ip::address > & addresses, uint16_t port, const ListenCallback & callback );
+#if NETWORK_SHM
+	void startShmAccept( boost::shared_ptr< Connection > connection, int32_t listener );
+	void handleShmAccept( const boost::system::error_code & ec, boost::shared_ptr< Connection > connection, int32_t listener );
+#endif
+    
+protected:
+	// Creates an acceptor on the next io_service of the Hive, in round
+	// robin order.
+	Acceptor( boost::shared_ptr< Hive > hive );
+    
+	// Creates an acceptor on the io_service of the Hive selected by the
+	// application supplied affinity key.
+	Acceptor( boost::shared_ptr< Hive > hive, size_t affinityKey );
+	virtual ~Acceptor();
+    
+private:
+	// Called when a connection has connected to the server. This function
+	// should return true to invoke the connection's OnAccept function if the
+	// connection will be kept. If the connection will not be kept, the
+	// connection's Disconnect function should be called and the function
+	// should return false. The call is made on the connection's strand, so
+	// with a connection factory and several listeners it may run on several
+	// workers at once.
+	virtual bool onAccept( boost::shared_ptr< Connection > connection, const std::string & host, uint16_t port ) = 0;
+    
+	// Called on each timer event.
+	virtual void onTimer( const boost::posix_time::time_duration & delta ) = 0;
+    
+	// Called when an error is encountered. Most typically, this is when the
+	// acceptor is being closed via the Stop function or if the Listen is
+	// called on an address that is not available.
+	virtual void onError( const boost::system::error_code & error ) = 0;
+    
+public:
+	// Returns the Hive object.
+	boost::shared_ptr< Hive > getHive();
+    
+	// Returns the io_service this acceptor was assigned to.
+	boost::asio::io_service & getService();
+    
+	// Returns the acceptor object.
+	boost::asio::ip::tcp::acceptor & getAcceptor();
+    
+	// Returns the strand object.
+	NetworkStrand & getStrand();
+    
+	// Returns the allocator used for the handlers of this object.
+	HandlerAllocator & getHandlerAllocator();
+    
+	// Sets the timer interval of the object. The interval is changed after
+	// the next update is called. The default value is 1000 ms.
+	void setTimerInterval( int32_t timerIntervalMilli );
+    
+	// Returns the timer interval of the object.
+	int32_t getTimerInterval() const;
+    
+	// Sets the factory connections are created with. Listen then keeps
+	// backlog accepts outstanding on every listener and replaces each one as
+	// it completes, so Accept never has to be called. A failed accept is
+	// reported to its connection and replaced as well, after a short delay
+	// when the process ran out of descriptors or memory. Must be called
+	// before Listen.
+	void setConnectionFactory( const ConnectionFactory & factory, int32_t backlog = 16 );
+    
+	// Returns the number of accepts kept outstanding per listener.
+	int32_t getAcceptBacklog() const;
+    
+	// Sets whether the listening socket is opened with SO_REUSEPORT. On
+	// Linux, when a connection factory is set, Listen also opens one more
+	// listener on every other io_service of the Hive and the kernel spreads
+	// new connections across them. Must be called before Listen. The default
+	// is disabled.
+	void setReusePort( bool enabled );
+    
+	// Returns true if listeners are opened with SO_REUSEPORT.
+	bool getReusePort() const;
+    
+	// Returns the number of sockets listening, including the acceptor
+	// itself.
+	size_t getListenerCount() const;
+    
+	// Returns the port listened on, which is the one chosen when Listen was
+	// given port 0, or 0 before Listen.
+	uint16_t getPort() const;
+    
+	// Returns true if this object has an error associated with it.
+	bool hasError();
+    
+public:
+	// Begin listening on the specific network interface. If the port is 0,
+	// an ephemeral port is chosen and can be read from GetAcceptor.
+	//
+	// A host of the form "shm://name" listens for same machine clients
+	// connecting to that name and port instead, through a UNIX domain
+	// socket in a directory private to the user, see ShmChannel::GetPath.
+	// It replaces any stale socket left behind. Every
+	// accepted connection gets a shared memory segment of its own. Port 0
+	// picks a port no other listener of the machine uses, read it with
+	// GetPort. SO_REUSEPORT listeners are not opened.
+	//
+	// A host name is resolved on the calling thread, which blocks it. Called
+	// from a thread running the Hive, such as inside a handler, only numeric
+	// addresses, static entries and fresh cache entries of the resolver are
+	// accepted and any other host throws boost::asio::error::would_block;
+	// use ListenAsync there instead.
+	void listen( const std::string & host, const uint16_t & port );
+    
+	// Begins listening like Listen, but resolves the host through the
+	// Hive's HostResolver without blocking, so it may be called from a
+	// handler. Listening starts on the acceptor's strand once the host is
+	// resolved, and the callback, if given, is then invoked there with the
+	// outcome. A failure also ends the acceptor and reaches OnError. Call
+	// Accept from the callback, as an accept posted before listening starts
+	// fails. "shm://" hosts need no lookup and are listened on as by Listen.
+	void listenAsync( const std::string & host, const uint16_t & port, const ListenCallback & callback = ListenCallback() );
+    
+	// Posts the connection to the listening interface. The next client that
+	// connections will be given this connection. If multiple calls to Accept
+	// are called at a time, then they are accepted in a FIFO order.
+	void accept( boost::shared_ptr< Connection > connection );
+    
+	// Stop the Acceptor from listening.
+	void stop();
+    
+#if NETWORK_COROUTINES
+	// Returns an awaitable accepting the next client into connection. The
+	// connection is open once the await succeeds; neither OnAccept function
+	// is called.
+	AcceptAwaitable asyncAccept( boost::shared_ptr< Connection > connection );
+#endif
+};
+
 //-----------------------------------------------------------------------------
 
-using boost::uint64_t;
-using boost::uint32_t;
-using boost::uint16_t;
-using boost::uint8_t;
+// Keeps closed connections for reuse. A connection acquired from the pool
+// goes back to it when its last reference is released instead of being
+// deleted, keeping its socket, strand, handler memory and buffers. Idle
+// connections are kept per io_service, so a recycled connection stays on
+// the worker it was created for.
+class ConnectionPool : public boost::enable_shared_from_this< ConnectionPool >
+{
+public:
+	// Creates a connection for the pool on the io_service selected by the
+	// affinity key.
+	typedef boost::function< Connection * ( boost::shared_ptr< Hive > hive, size_t affinityKey ) > Constructor;
+    
+private:
+	// Returns a connection to its pool when the last reference to it is
+	// released, or deletes it if the pool is gone.
+	class Recycler
+	{
+	private:
+		boost::weak_ptr< ConnectionPool >   mPool;
+        
+	public:
+		Recycler( const boost::shared_ptr< ConnectionPool > & pool );
+		void operator()( Connection * connection ) const;
+	};
+    
+	boost::shared_ptr< Hive >                   mHive;
+	Constructor                                 mConstructor;
+	std::mutex                                  mMutex;
+	std::vector< std::vector< Connection * > >  mFreeConnections;
+	size_t                                      mMaxFreeConnections;
+	size_t                                      mLeasedCount;
+	uint64_t                                    mCreatedCount;
+	uint64_t                                    mReusedCount;
+    
+private:
+	ConnectionPool( const ConnectionPool & rhs );
+	ConnectionPool & operator =( const ConnectionPool & rhs );
+	void release( Connection * connection );
+    
+public:
+	// Creates a pool of connections made by constructor. At most
+	// maxFreeConnections idle connections are kept per io_service.
+	ConnectionPool( boost::shared_ptr< Hive > hive, const Constructor & constructor, size_t maxFreeConnections = 1024 );
+	~ConnectionPool();
+    
+	// Returns a connection on the next io_service of the Hive, in round
+	// robin order.
+	boost::shared_ptr< Connection > acquire();
+    
+	// Returns a connection on the io_service selected by affinityKey. An
+	// idle connection is reused if there is one, otherwise a new one is
+	// constructed.
+	boost::shared_ptr< Connection > acquire( size_t affinityKey );
+    
+	// Constructs idle connections up front, spread over every io_service of
+	// the Hive, so the first accepts do not pay for construction.
+	void reserve( size_t count );
+    
+	// Returns a factory for Acceptor::SetConnectionFactory that acquires
+	// connections from this pool.
+	Acceptor::ConnectionFactory getFactory();
+    
+	// Sets the number of idle connections kept per io_service. Connections
+	// released beyond this limit are deleted.
+	void setMaxFreeConnections( size_t maxFreeConnections );
+    
+	// Returns the number of idle connections kept per io_service.
+	size_t getMaxFreeConnections();
+    
+	// Returns the number of idle connections in the pool.
+	size_t getFreeCount();
+    
+	// Returns the number of connections currently acquired.
+	size_t getLeasedCount();
+    
+	// Returns the number of connections constructed by the pool.
+	uint64_t getCreatedCount();
+    
+	// Returns the number of acquires served by an idle connection.
+	uint64_t getReusedCount();
+};
 
-using boost::int64_t;
-using boost::int32_t;
-using boost::int16_t;
-using boost::int8_t;
+//-----------------------------------------------------------------------------
+
+// Sends one payload to many connections. A published payload is stored
+// once as a SharedBuffer and every member only queues a reference to it.
+// Members whose send queue is at or above the slow limit do not get the
+// payload queued, so a stalled client cannot make the server buffer
+// without bound. A payload kept for a slow member is sent by the member's
+// own send completions once its queue is below the slow limit again, or by
+// a later Publish or Flush. The group must be owned by a boost::shared_ptr,
+// which members only hold weakly.
+class BroadcastGroup : public boost::enable_shared_from_this< BroadcastGroup >
+{
+public:
+	// What Publish does for a slow member. The payload is skipped, or kept
+	// as the member's latest payload, replacing any older one, and sent
+	// once the member has caught up.
+	enum SlowPolicy { BROADCAST_SKIP, BROADCAST_LATEST };
+    
+private:
+	struct Member
+	{
+		boost::weak_ptr< Connection >   mConnection;
+		SharedBuffer                    mLatest;
+	};
+    
+	std::mutex                      mMutex;
+	std::vector< Member >           mMembers;
+	uint64_t                        mSlowBytes;
+	SlowPolicy                      mSlowPolicy;
+	uint64_t                        mPublishCount;
+	uint64_t                        mSkipCount;
+	uint64_t                        mCoalesceCount;
+    
+private:
+	BroadcastGroup( const BroadcastGroup & rhs );
+	BroadcastGroup & operator =( const BroadcastGroup & rhs );
+    
+public:
+	// Creates an empty group. A member with slowBytes or more queued is
+	// treated as slow.
+	explicit BroadcastGroup( uint64_t slowBytes = 256 * 1024, SlowPolicy slowPolicy = BROADCAST_LATEST );
+	~BroadcastGroup();
+    
+	// Adds connection to the group. Connections are held weakly and leave
+	// the group when they close or are destroyed.
+	void add( boost::shared_ptr< Connection > connection );
+    
+	// Removes connection from the group.
+	void remove( boost::shared_ptr< Connection > connection );
+    
+	// Returns the number of members.
+	size_t getMemberCount();
+    
+	// Queues buffer on every member that keeps up. The buffer is copied
+	// once. Returns the number of members the payload was queued on, which
+	// includes members above their high watermark whose send queue policy
+	// is SEND_QUEUE_NOTIFY. Members are sent to after the group's lock is
+	// released, so Publish may be called from any thread and from within a
+	// member's handlers.
+	size_t publish( const std::vector< uint8_t > & buffer );
+    
+	// Queues buffer on every member that keeps up. The contents of the
+	// buffer are moved and not copied.
+	size_t publish( std::vector< uint8_t > && buffer );
+    
+	// Queues a shared buffer on every member that keeps up. Only the
+	// reference is queued.
+	size_t publish( const SharedBuffer & buffer );
+    
+	// Sends the latest payload kept for each member that has caught up since,
+	// without waiting for the next Publish or the member's send completions.
+	// Returns the number sent.
+	size_t flush();
+    
+	// Sends the latest payload kept for connection if it has caught up
+	// since. The connection calls this itself as its sends complete, so it
+	// is rarely needed. Returns true if a payload was sent.
+	bool flush( boost::shared_ptr< Connection > connection );
+    
+	// Sets the send queue size at which a member is treated as slow.
+	void setSlowBytes( uint64_t slowBytes );
+    
+	// Returns the send queue size at which a member is treated as slow.
+	uint64_t getSlowBytes();
+    
+	// Sets what happens to payloads published to a slow member.
+	void setSlowPolicy( SlowPolicy slowPolicy );
+    
+	// Returns what happens to payloads published to a slow member.
+	SlowPolicy getSlowPolicy();
+    
+	// Returns the number of payloads published.
+	uint64_t getPublishCount();
+    
+	// Returns the number of payloads not sent to a member, because it was
+	// slow or its send queue policy refused the payload.
+	uint64_t getSkipCount();
+    
+	// Returns the number of kept payloads replaced by a newer one before
+	// they could be sent.
+	uint64_t getCoalesceCount();
+};
 
 //-----------------------------------------------------------------------------
 
-class Hive;
-class Acceptor;
-class Connection;
+#if NETWORK_COROUTINES
+
+// The return type of coroutines awaiting the network. The coroutine starts
+// running when it is called and frees itself when it returns; nothing
+// waits on it. An exception escaping the coroutine terminates the program.
+class NetworkTask
+{
+public:
+	struct promise_type
+	{
+		NetworkTask get_return_object()
+		{
+			return NetworkTask();
+		}
+        
+		std::suspend_never initial_suspend() noexcept
+		{
+			return std::suspend_never();
+		}
+        
+		std::suspend_never final_suspend() noexcept
+		{
+			return std::suspend_never();
+		}
+        
+		void return_void()
+		{
+		}
+        
+		void unhandled_exception()
+		{
+			std::terminate();
+		}
+	};
+};
+
+// The outcome of an awaited operation.
+struct IoResult
+{
+	boost::system::error_code   error;
+	size_t                      bytes;
+};
+
+// Shared by the awaitables. The operation is started on the strand of the
+// object when the coroutine suspends, and its completion handler, which
+// runs on the same strand and is allocated through its HandlerAllocator,
+// resumes the coroutine. The awaitable lives in the coroutine frame, so an
+// await costs no heap allocation of its own. Once the Hive stops, the timer
+// of the object closes it and a waiting coroutine is resumed with
+// operation_aborted; awaits started after that complete with
+// operation_aborted at once. A failed await closes the connection, except
+// for a send the connection refused.
+class IoAwaitable
+{
+protected:
+	std::coroutine_handle<>     mHandle;
+	IoResult                    mResult;
+    
+	// Posts a completion with operation_aborted instead of starting the
+	// operation.
+	void abort( NetworkStrand & strand, HandlerAllocator & allocator );
+    
+public:
+	IoAwaitable();
+    
+	bool await_ready() const noexcept
+	{
+		return false;
+	}
+    
+	// Stores the outcome and resumes the coroutine.
+	void complete( const boost::system::error_code & ec, size_t bytes );
+    
+	// Posts Complete to the strand, so the coroutine resumes after the
+	// handler calling this has returned.
+	void post( NetworkStrand & strand, HandlerAllocator & allocator, const boost::system::error_code & ec, size_t bytes );
+};
+
+// Completes an IoAwaitable from an asio completion handler.
+struct IoCompletion
+{
+	IoAwaitable *   mAwaitable;
+    
+	void operator()( const boost::system::error_code & ec ) const
+	{
+		mAwaitable->complete( ec, 0 );
+	}
+    
+	void operator()( const boost::system::error_code & ec, size_t bytes ) const
+	{
+		mAwaitable->complete( ec, bytes );
+	}
+    
+	template< typename Iterator >
+	void operator()( const boost::system::error_code & ec, const Iterator & ) const
+	{
+		mAwaitable->complete( ec, 0 );
+	}
+};
+
+// Awaits Connection::asyncRecv.
+class RecvAwaitable : public IoAwaitable
+{
+private:
+	boost::shared_ptr< Connection > mConnection;
+	std::vector< uint8_t > &        mBuffer;
+	int32_t                         mTotalBytes;
+    
+	void start();
+    
+public:
+	RecvAwaitable( boost::shared_ptr< Connection > connection, std::vector< uint8_t > & buffer, int32_t totalBytes );
+	void await_suspend( std::coroutine_handle<> handle );
+	IoResult await_resume();
+};
+
+// Awaits Connection::asyncSend.
+class SendAwaitable : public IoAwaitable
+{
+private:
+	boost::shared_ptr< Connection > mConnection;
+	boost::asio::const_buffer       mBuffer;
+    
+	void start();
+    
+public:
+	SendAwaitable( boost::shared_ptr< Connection > connection, const boost::asio::const_buffer & buffer );
+	void await_suspend( std::coroutine_handle<> handle );
+	IoResult await_resume();
+};
+
+// Awaits Connection::asyncConnect.
+class ConnectAwaitable : public IoAwaitable
+{
+private:
+	boost::shared_ptr< Connection > mConnection;
+	std::string                     mHost;
+	uint16_t                        mPort;
+    
+	void start();
+    
+public:
+	ConnectAwaitable( boost::shared_ptr< Connection > connection, const std::string & host, uint16_t port );
+	void await_suspend( std::coroutine_handle<> handle );
+	IoResult await_resume();
+};
+
+// Awaits Acceptor::asyncAccept.
+class AcceptAwaitable : public IoAwaitable
+{
+private:
+	boost::shared_ptr< Acceptor >   mAcceptor;
+	boost::shared_ptr< Connection > mConnection;
+    
+	void start();
+    
+public:
+	AcceptAwaitable( boost::shared_ptr< Acceptor > acceptor, boost::shared_ptr< Connection > connection );
+	void await_suspend( std::coroutine_handle<> handle );
+	IoResult await_resume();
+};
+
+#endif
 
 //-----------------------------------------------------------------------------
 
-class Connection : public boost::enable_shared_from_this< Connection >
+// A datagram received or waiting to be sent by a Datagram object.
+struct DatagramPacket
+{
+	std::vector< uint8_t >          buffer;
+	boost::asio::ip::udp::endpoint  endpoint;
+};
+
+//-----------------------------------------------------------------------------
+
+class Datagram : public boost::enable_shared_from_this< Datagram >
 {
-	friend class Acceptor;
 	friend class Hive;
     
+public:
+	// Receives the outcome of ConnectAsync.
+	typedef boost::function< void( const boost::system::error_code & ec ) > ConnectCallback;
+    
 private:
+	enum { MAX_BATCH_SIZE = 64 };
+    
+	struct PendingSend
+	{
+		SharedBuffer                    buffer;
+		boost::asio::ip::udp::endpoint  endpoint;
+		bool                            connected;
+	};
+    
 	boost::shared_ptr< Hive >           mHive;
-	boost::asio::ip::tcp::socket        mSocket;
-	boost::asio::strand                 mIoStrand;
-	boost::asio::deadline_timer         mTimer;
-	boost::posix_time::ptime            mLastTime;
-	std::vector< uint8_t >              mRecvBuffer;
-	std::list< int32_t >                mPendingRecvs;
-	std::list< std::vector< uint8_t > > mPendingSends;
+	boost::asio::io_service &           mIoService;
+	boost::asio::ip::udp::socket        mSocket;
+	NetworkStrand                       mIoStrand;
+	TimerWheel &                        mTimerWheel;
+	TimerWheel::Entry                   mTimerEntry;
+	TimerWheel::Clock::time_point       mLastTime;
+	HandlerAllocator                    mHandlerAllocator;
+	boost::asio::ip::udp::endpoint      mPeerEndpoint;
+	std::vector< DatagramPacket >       mRecvPackets;
+	std::list< PendingSend >            mPendingSends;
+	int32_t                             mPendingRecvs;
 	int32_t                             mReceiveBufferSize;
+	int32_t                             mBatchSize;
 	int32_t                             mTimerInterval;
-	volatile uint32_t                   mErrorState;
+	bool                                mSendWaiting;
+#if NETWORK_METRICS
+	Metrics                             mMetrics;
+	HiveMetrics *                       mHiveMetrics;
+#endif
+	std::atomic< bool >                 mErrorState;
     
 protected:
-	Connection( boost::shared_ptr< Hive > hive );
-	virtual ~Connection();
+	// Creates a datagram endpoint on the next io_service of the Hive, in
+	// round robin order.
+	Datagram( boost::shared_ptr< Hive > hive );
+    
+	// Creates a datagram endpoint on the io_service of the Hive selected by
+	// the application supplied affinity key.
+	Datagram( boost::shared_ptr< Hive > hive, size_t affinityKey );
+	virtual ~Datagram();
     
 private:
-	Connection( const Connection & rhs );
-	Connection & operator =( const Connection & rhs );
+	Datagram( boost::shared_ptr< Hive > hive, boost::asio::io_service & service );
+	Datagram( const Datagram & rhs );
+	Datagram & operator =( const Datagram & rhs );
+	void open( const boost::asio::ip::udp & protocol );
+	void startRecv();
 	void startSend();
-	void startRecv( int32_t totalBytes );
 	void startTimer();
 	void startError( const boost::system::error_code & ec );
-	void dispatchSend( std::vector< uint8_t > buffer );
-	void dispatchRecv( int32_t totalBytes );
-	void dispatchTimer( const boost::system::error_code & ec );
-	void handleConnect( const boost::system::error_code & ec );
-	void handleSend( const boost::system::error_code & ec,  std::list< std::vector< uint8_t > >::iterator sendIt );
-	void handleRecv( const boost::system::error_code & ec, int32_t actualBytes );
+	size_t recvBatch( boost::system::error_code & ec );
+	void sendBatch( boost::system::error_code & ec );
+	void reportPacketError( const boost::system::error_code & ec, const boost::asio::ip::udp::endpoint & endpoint );
+	static bool isPacketError( const boost::system::error_code & ec );
+	void dispatchSend( const PendingSend & packet );
+	void dispatchRecv();
+	static void dispatchTimer( const boost::shared_ptr< void > & owner );
+	void handleRecv( const boost::system::error_code & ec );
+	void handleSend( const boost::system::error_code & ec );
 	void handleTimer( const boost::system::error_code & ec );
+	void handleResolve( const boost::system::error_code & ec, const std::vector< boost::asio::ip::address > & addresses, uint16_t port, const ConnectCallback & callback );
     
 private:
-	// Called when the connection has successfully connected to the local
-	// host.
-	virtual void onAccept( const std::string & host, uint16_t port ) = 0;
-    
-	// Called when the connection has successfully connected to the remote
-	// host.
-	virtual void onConnect( const std::string & host, uint16_t port ) = 0;
+	// Called for every datagram received.
+	virtual void onRecv( std::vector< uint8_t > & buffer, const boost::asio::ip::udp::endpoint & endpoint ) = 0;
     
-	// Called when data has been sent by the connection.
-	virtual void onSend( const std::vector< uint8_t > & buffer ) = 0;
+	// Called once per receive with every datagram read by it. Only the first
+	// count packets are valid, the rest are kept to reuse their buffers. The
+	// default implementation invokes OnRecv for each packet.
+	virtual void onRecvBatch( std::vector< DatagramPacket > & packets, size_t count );
     
-	// Called when data has been received by the connection.
-	virtual void onRecv( std::vector< uint8_t > & buffer ) = 0;
+	// Called when a datagram has been sent.
+	virtual void onSend( const std::vector< uint8_t > & buffer, const boost::asio::ip::udp::endpoint & endpoint ) = 0;
     
 	// Called on each timer event.
 	virtual void onTimer( const boost::posix_time::time_duration & delta ) = 0;
@@ -100,26 +2446,41 @@ private:
 	// Called when an error is encountered.
 	virtual void onError( const boost::system::error_code & ec ) = 0;
     
+	// Called when a single datagram fails, such as one too large to send or
+	// receive, or an ICMP error reported on a connected socket. The datagram
+	// is dropped, counted as an error and the object keeps running. The
+	// default implementation does nothing.
+	virtual void onPacketError( const boost::system::error_code & ec, const boost::asio::ip::udp::endpoint & endpoint );
+    
 public:
 	// Returns the Hive object.
 	boost::shared_ptr< Hive > getHive();
     
+	// Returns the io_service this object was assigned to.
+	boost::asio::io_service & getService();
+    
 	// Returns the socket object.
-	boost::asio::ip::tcp::socket & getSocket();
+	boost::asio::ip::udp::socket & getSocket();
     
 	// Returns the strand object.
-	boost::asio::strand & getStrand();
+	NetworkStrand & getStrand();
     
-	// Sets the application specific receive buffer size used. For stream
-	// based protocols such as HTTP, you want this to be pretty large, like
-	// 64kb. For packet based protocols, then it will be much smaller,
-	// usually 512b - 8kb depending on the protocol. The default value is
-	// 4kb.
+	// Sets the largest datagram that can be received. Larger datagrams are
+	// dropped and reported to OnPacketError with message_size. The default
+	// value is 2kb.
 	void setReceiveBufferSize( int32_t size );
     
-	// Returns the size of the receive buffer size of the current object.
+	// Returns the largest datagram that can be received.
 	int32_t getReceiveBufferSize() const;
     
+	// Sets the most datagrams moved by a single receive or send, up to 64.
+	// On Linux each batch is a single recvmmsg or sendmmsg call. The default
+	// value is 32.
+	void setBatchSize( int32_t batchSize );
+    
+	// Returns the most datagrams moved by a single receive or send.
+	int32_t getBatchSize() const;
+    
 	// Sets the timer interval of the object. The interval is changed after
 	// the next update is called.
 	void setTimerInterval( int32_t timerIntervalMilli );
@@ -127,103 +2488,263 @@ public:
 	// Returns the timer interval of the object.
 	int32_t getTimerInterval() const;
     
+	// Returns the counters of this object. This may be called from any
+	// thread. All counters are zero when NETWORK_METRICS is 0.
+	MetricsSnapshot getMetrics() const;
+    
 	// Returns true if this object has an error associated with it.
 	bool hasError();
     
-	// Binds the socket to the specified interface.
+	// Opens the socket and binds it to the specified interface.
 	void bind( const std::string & ip, uint16_t port );
     
-	// Starts an a/synchronous connect.
+	// Sets the default peer used by Send. The socket is opened if Bind has
+	// not been called. A host name is resolved as by Acceptor::Listen, so a
+	// thread running the Hive may only pass numeric addresses, static
+	// entries and fresh cache entries of the resolver.
 	void connect( const std::string & host, uint16_t port );
     
-	// Posts data to be sent to the connection.
+	// Sets the default peer like Connect, but resolves the host through the
+	// Hive's HostResolver without blocking, so it may be called from a
+	// handler. The peer is set on the strand once the host is resolved, and
+	// the callback, if given, is then invoked there with the outcome. A
+	// failure also ends the endpoint and reaches OnError.
+	void connectAsync( const std::string & host, uint16_t port, const ConnectCallback & callback = ConnectCallback() );
+    
+	// Posts a datagram to be sent to the connected peer.
+	void send( const SharedBuffer & buffer );
+    
+	// Posts a datagram to be sent to the connected peer.
 	void send( const std::vector< uint8_t > & buffer );
     
-	// Posts a recv for the connection to process. If total_bytes is 0, then
-	// as many bytes as possible up to GetReceiveBufferSize() will be
-	// waited for. If Recv is not 0, then the connection will wait for exactly
-	// total_bytes before invoking OnRecv.
-	void recv( int32_t totalBytes = 0 );
+	// Posts a datagram to be sent to endpoint.
+	void sendTo( const SharedBuffer & buffer, const boost::asio::ip::udp::endpoint & endpoint );
     
-	// Posts an asynchronous disconnect event for the object to process.
+	// Posts a datagram to be sent to endpoint.
+	void sendTo( const std::vector< uint8_t > & buffer, const boost::asio::ip::udp::endpoint & endpoint );
+    
+	// Posts a recv for the object to process. Every datagram already queued
+	// on the socket, up to the batch size, is delivered with one call to
+	// OnRecvBatch.
+	void recv();
+    
+	// Posts an asynchronous close event for the object to process.
 	void disconnect();
 };
 
 //-----------------------------------------------------------------------------
 
-class Acceptor : public boost::enable_shared_from_this< Acceptor >
+// A bounded, lock-free queue between exactly one producer thread and one
+// consumer thread. The capacity is rounded up to a power of two. Values are
+// moved in and out of preallocated slots, so neither side allocates.
+template< typename T >
+class SpscQueue
 {
-	friend class Hive;
-    
 private:
-	boost::shared_ptr< Hive >       mHive;
-	boost::asio::ip::tcp::acceptor  mAcceptor;
-	boost::asio::strand             mIoStrand;
-	boost::asio::deadline_timer     mTimer;
-	boost::posix_time::ptime        mLastTime;
-	int32_t                         mTimerInterval;
-	volatile uint32_t               mErrorState;
+	enum { CACHE_LINE_SIZE = 64 };
+    
+	std::vector< T >                mSlots;
+	size_t                          mMask;
+	char                            mPad0[ CACHE_LINE_SIZE ];
+	// Written by the consumer only.
+	std::atomic< size_t >           mHead;
+	size_t                          mTailCache;
+	char                            mPad1[ CACHE_LINE_SIZE ];
+	// Written by the producer only.
+	std::atomic< size_t >           mTail;
+	size_t                          mHeadCache;
+	char                            mPad2[ CACHE_LINE_SIZE ];
     
 private:
-	Acceptor( const Acceptor & rhs );
-	Acceptor & operator =( const Acceptor & rhs );
-	void startTimer();
-	void startError( const boost::system::error_code & ec );
-	void dispatchAccept( boost::shared_ptr< Connection > connection );
-	void handleTimer( const boost::system::error_code & ec );
-	void handleAccept( const boost::system::error_code & ec, boost::shared_ptr< Connection > connection );
+	SpscQueue( const SpscQueue & rhs );
+	SpscQueue & operator =( const SpscQueue & rhs );
     
-protected:
-	Acceptor( boost::shared_ptr< Hive > hive );
-	virtual ~Acceptor();
+	static size_t getSlotCount( size_t capacity )
+	{
+		size_t count = 2;
+		while( count < capacity )
+		{
+			count <<= 1;
+		}
+		return count;
+	}
+    
+public:
+	explicit SpscQueue( size_t capacity )
+	: mSlots( getSlotCount( capacity ) ), mMask( mSlots.size() - 1 ), mHead( 0 ), mTailCache( 0 ), mTail( 0 ), mHeadCache( 0 )
+	{
+	}
+    
+	// Moves value into the queue. Returns false, leaving value untouched, if
+	// the queue is full. Only call from the producer thread.
+	bool push( T & value )
+	{
+		size_t tail = mTail.load( std::memory_order_relaxed );
+		if( tail - mHeadCache == mSlots.size() )
+		{
+			mHeadCache = mHead.load( std::memory_order_acquire );
+			if( tail - mHeadCache == mSlots.size() )
+			{
+				return false;
+			}
+		}
+		mSlots[ tail & mMask ] = std::move( value );
+		mTail.store( tail + 1, std::memory_order_release );
+		return true;
+	}
+    
+	// Moves the oldest value out of the queue. Returns false if the queue is
+	// empty. Only call from the consumer thread.
+	bool pop( T & value )
+	{
+		size_t head = mHead.load( std::memory_order_relaxed );
+		if( head == mTailCache )
+		{
+			mTailCache = mTail.load( std::memory_order_acquire );
+			if( head == mTailCache )
+			{
+				return false;
+			}
+		}
+		value = std::move( mSlots[ head & mMask ] );
+		mHead.store( head + 1, std::memory_order_release );
+		return true;
+	}
+    
+	// Returns the number of values the queue holds at most.
+	size_t getCapacity() const
+	{
+		return mSlots.size();
+	}
+    
+	// Returns the number of values queued. The result is only a snapshot
+	// when called while the other side is active.
+	size_t getSize() const
+	{
+		return mTail.load( std::memory_order_acquire ) - mHead.load( std::memory_order_acquire );
+	}
+};
+
+//-----------------------------------------------------------------------------
+
+// A connection event handed from a network thread to the application.
+struct NetworkEvent
+{
+	enum Type
+	{
+		EVENT_ACCEPT,
+		EVENT_CONNECT,
+		EVENT_RECV,
+		EVENT_SEND,
+		EVENT_ERROR
+	};
+    
+	Type                                type;
+	boost::shared_ptr< Connection >     connection;
+	std::string                         host;
+	uint16_t                            port;
+	std::vector< uint8_t >              buffer;
+	// Holds the received bytes of a receive event queued with its lease,
+	// in place of buffer. The block returns to the pool with the event.
+	RecvLease                           lease;
+	boost::system::error_code           error;
+    
+	NetworkEvent();
+    
+	// Returns the bytes of the event, those of the lease if it has one.
+	const std::vector< uint8_t > & getBuffer() const;
+};
+
+//-----------------------------------------------------------------------------
+
+// Delivers connection events from the threads of a Hive to a single
+// application thread, such as a render loop, without either side waiting on
+// the other. Each io_service of the Hive gets its own SpscQueue, which only
+// one thread may push to. A Hive owning its workers guarantees that, as
+// each io_service runs on its own worker. With any other Hive, which may
+// have several threads calling Run or Poll, pushes to a ring are serialized
+// by a lock instead. Events a full queue cannot take are kept on the
+// network side in order and are moved over once the application has
+// drained the queue; none are dropped.
+class EventQueue : public boost::enable_shared_from_this< EventQueue >
+{
+public:
+	// Receives every event taken off the queue by Drain.
+	typedef boost::function< void( NetworkEvent & event ) > Handler;
     
 private:
-	// Called when a connection has connected to the server. This function
-	// should return true to invoke the connection's OnAccept function if the
-	// connection will be kept. If the connection will not be kept, the
-	// connection's Disconnect function should be called and the function
-	// should return false.
-	virtual bool onAccept( boost::shared_ptr< Connection > connection, const std::string & host, uint16_t port ) = 0;
+	struct Ring
+	{
+		SpscQueue< NetworkEvent >       mEvents;
+		// Only touched by the producing side of the ring.
+		std::deque< NetworkEvent >      mOverflow;
+		std::atomic< bool >             mStalled;
+		// Held by producers when the Hive does not own its workers.
+		std::mutex                      mMutex;
+        
+		explicit Ring( size_t capacity );
+	};
     
-	// Called on each timer event.
-	virtual void onTimer( const boost::posix_time::time_duration & delta ) = 0;
+	boost::shared_ptr< Hive >                   mHive;
+	std::vector< boost::shared_ptr< Ring > >    mRings;
+	size_t                                      mNextRing;
+	std::atomic< uint64_t >                     mOverflowCount;
+	bool                                        mLocked;
     
-	// Called when an error is encountered. Most typically, this is when the
-	// acceptor is being closed via the Stop function or if the Listen is
-	// called on an address that is not available.
-	virtual void onError( const boost::system::error_code & error ) = 0;
+private:
+	EventQueue( const EventQueue & rhs );
+	EventQueue & operator =( const EventQueue & rhs );
+	void flush( Ring & ring );
+	void handleResume( size_t index );
     
 public:
-	// Returns the Hive object.
-	boost::shared_ptr< Hive > getHive();
+	// Creates a queue for the connections of hive holding up to capacity
+	// events per io_service.
+	EventQueue( boost::shared_ptr< Hive > hive, size_t capacity = 4096 );
+	~EventQueue();
     
-	// Returns the acceptor object.
-	boost::asio::ip::tcp::acceptor & getAcceptor();
+	// Queues event on the ring of its connection's io_service. Must be
+	// called from a handler of that connection, typically one of its
+	// On functions.
+	void push( NetworkEvent & event );
     
-	// Returns the strand object.
-	boost::asio::strand & getStrand();
+	// Queues an accept event.
+	void pushAccept( const boost::shared_ptr< Connection > & connection, const std::string & host, uint16_t port );
     
-	// Sets the timer interval of the object. The interval is changed after
-	// the next update is called. The default value is 1000 ms.
-	void setTimerInterval( int32_t timerIntervalMilli );
+	// Queues a connect event.
+	void pushConnect( const boost::shared_ptr< Connection > & connection, const std::string & host, uint16_t port );
     
-	// Returns the timer interval of the object.
-	int32_t getTimerInterval() const;
+	// Queues a receive event. The contents of buffer are moved into the
+	// event, leaving it empty.
+	void pushRecv( const boost::shared_ptr< Connection > & connection, std::vector< uint8_t > & buffer );
     
-	// Returns true if this object has an error associated with it.
-	bool hasError();
+	// Queues a receive event holding lease, typically the one passed to
+	// OnRecvLease, so the bytes are neither copied nor taken out of the
+	// pooled block.
+	void pushRecv( const boost::shared_ptr< Connection > & connection, const RecvLease & lease );
     
-public:
-	// Begin listening on the specific network interface.
-	void listen( const std::string & host, const uint16_t & port );
+	// Queues a send completion event carrying a copy of buffer.
+	void pushSend( const boost::shared_ptr< Connection > & connection, const std::vector< uint8_t > & buffer );
     
-	// Posts the connection to the listening interface. The next client that
-	// connections will be given this connection. If multiple calls to Accept
-	// are called at a time, then they are accepted in a FIFO order.
-	void accept( boost::shared_ptr< Connection > connection );
+	// Queues an error event.
+	void pushError( const boost::shared_ptr< Connection > & connection, const boost::system::error_code & error );
     
-	// Stop the Acceptor from listening.
-	void stop();
+	// Takes events off the queue and passes them to handler until the queue
+	// is empty, maxEvents have been handled or maxMicro microseconds have
+	// passed, whichever comes first. A limit of 0 disables it. Returns the
+	// number of events handled. Only call from the application thread.
+	size_t drain( const Handler & handler, size_t maxEvents = 0, int32_t maxMicro = 0 );
+    
+	// Takes the oldest event of any ring off the queue. Returns false if
+	// there was none. Only call from the application thread.
+	bool pop( NetworkEvent & event );
+    
+	// Returns the number of events waiting in the rings. Overflowed events
+	// are not included.
+	size_t getSize() const;
+    
+	// Returns the number of events that found their ring full.
+	uint64_t getOverflowCount() const;
 };
 
 //-----------------------------------------------------------------------------
@@ -231,40 +2752,131 @@ public:
 class Hive : public boost::enable_shared_from_this< Hive >
 {
 private:
-	boost::asio::io_service                             mIoService;
-	boost::shared_ptr< boost::asio::io_service::work >  mWorkPtr;
-	volatile uint32_t                                   mShutdown;
+	// What a worker thread runs. The thread holds its own references, so
+	// a Hive destroyed by a handler on one of its workers leaves that
+	// worker's io_service and timer wheel alive until the worker returns
+	// from run. The wheel is declared last and so released first.
+	struct Worker
+	{
+		boost::shared_ptr< boost::asio::io_service >    mIoService;
+		boost::shared_ptr< TimerWheel >                 mTimerWheel;
+		size_t                                          mIndex;
+		bool                                            mPin;
+	};
+    
+	std::vector< boost::shared_ptr< boost::asio::io_service > >        mIoServices;
+	std::vector< boost::shared_ptr< boost::asio::io_service::work > >  mWorkPtrs;
+	std::vector< std::thread >                                          mWorkers;
+	std::vector< boost::shared_ptr< TimerWheel > >                      mTimerWheels;
+	std::vector< boost::shared_ptr< HiveMetrics > >                     mMetrics;
+	boost::shared_ptr< HostResolver >                                   mResolver;
+	boost::shared_ptr< RecvBufferPool >                                 mRecvPool;
+	std::atomic< uint32_t >                                             mNextService;
+	bool                                                                mOwnsWorkers;
+	bool                                                                mPinWorkers;
+	std::atomic< bool >                                                 mShutdown;
+#if NETWORK_SINGLE_THREADED
+	std::atomic< std::thread::id >                                      mRunner;
+    
+	class ServiceClaim;
+#endif
     
 private:
 	Hive( const Hive & rhs );
 	Hive & operator =( const Hive & rhs );
+	void startWorkers();
+	void joinWorkers();
+	static void runWorker( const Worker & worker );
     
 public:
+	// Creates a Hive with a single io_service that is driven by the threads
+	// calling Run or Poll.
 	Hive();
+    
+	// Creates a Hive that owns workerCount threads, each running its own
+	// io_service. Connections and acceptors are spread across the workers,
+	// so their handlers always run on the same thread and strands are never
+	// contended. If workerCount is 0, one worker per hardware thread is
+	// created. If pinWorkers is true, each worker is bound to a CPU core.
+	Hive( uint32_t workerCount, bool pinWorkers = false );
 	virtual ~Hive();
     
-	// Returns the io_service of this object.
+	// Returns the first io_service of this object.
 	boost::asio::io_service & getService();
     
+	// Returns the io_service at index.
+	boost::asio::io_service & getService( size_t index );
+    
+	// Returns the number of io_services of this object.
+	size_t getServiceCount() const;
+    
+	// Returns the next io_service in round robin order.
+	boost::asio::io_service & getNextService();
+    
+	// Returns the io_service selected by affinityKey.
+	boost::asio::io_service & getServiceForKey( size_t affinityKey );
+    
+	// Returns the index of the io_service, which is also an affinity key
+	// selecting it.
+	size_t getServiceIndex( boost::asio::io_service & service ) const;
+    
+	// Returns true if this object runs its own worker threads.
+	bool ownsWorkers() const;
+    
+	// Returns true if the calling thread is running one of the io_services
+	// of this object, as it does inside any handler.
+	bool runsInThisThread() const;
+    
+	// Returns the timing wheel driving the timers of every connection and
+	// acceptor on the io_service.
+	TimerWheel & getTimerWheel( boost::asio::io_service & service );
+    
+	// Returns the counters shared by every connection, acceptor and
+	// datagram endpoint on the io_service.
+	HiveMetrics & getHiveMetrics( boost::asio::io_service & service );
+    
+	// Returns the counters of every io_service of this object added
+	// together. This may be called from any thread while the Hive runs.
+	MetricsSnapshot getMetrics() const;
+    
+	// Returns the resolver shared by all connections, acceptors and datagram
+	// endpoints of this object.
+	HostResolver & getResolver();
+    
+	// Returns the pool receive blocks are leased from by all connections of
+	// this object. It keeps a free list for each io_service.
+	boost::shared_ptr< RecvBufferPool > getRecvPool();
+    
 	// Returns true if the Stop function has been called.
 	bool hasStopped();
     
 	// Polls the networking subsystem once from the current thread and
-	// returns.
+	// returns. If this object owns worker threads, they already run every
+	// io_service, so this returns at once without running any handler. If
+	// NETWORK_SINGLE_THREADED is 1 and another thread is running or polling
+	// this object, std::logic_error is thrown.
 	void poll();
     
 	// Runs the networking system on the current thread. This function blocks
 	// until the networking system is stopped, so do not call on a single
 	// threaded application with no other means of being able to call Stop
-	// unless you code in such logic.
+	// unless you code in such logic. If this object owns worker threads,
+	// they already run every io_service, so this returns at once without
+	// blocking and handlers stay on their worker's thread. Stop joins the
+	// workers. If NETWORK_SINGLE_THREADED is 1 and another thread is running
+	// or polling this object, std::logic_error is thrown.
 	void run();
     
 	// Stops the networking system. All work is finished and no more
 	// networking interactions will be possible afterwards until Reset is called.
+	// Owned worker threads are joined, so this must not be called from one.
+	// If NETWORK_SINGLE_THREADED is 1 and another thread is running this
+	// object, that thread is stopped rather than joined in draining it.
 	void stop();
     
 	// Restarts the networking system after Stop as been called. A new work
-	// object is created ad the shutdown flag is cleared.
+	// object is created ad the shutdown flag is cleared. Owned worker
+	// threads are started again.
 	void reset();
 };
 